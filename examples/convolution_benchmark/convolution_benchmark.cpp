@@ -0,0 +1,153 @@
+#include "common.h"
+#include "network.h"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace chrono;
+
+/*
+    The two convolutions of examples/le_net, forward only, on every ConvolutionKernel and on a mix
+    of them picked per layer with setLayerConvolution(). Each setup prints the time of a forward
+    pass, its speedup over the direct convolution kernels and how far L1_y and L3_y land from them,
+    the largest absolute difference and that difference relative to the largest output.
+    The network is built for training, which keeps y apart from a, but only runs forward(); fusion
+    and memory planning are off so both outputs stay readable.
+    Whether reading maps and filters through the texture cache beats the buffer kernels depends
+    on the device, so run it on the GPU and on a CPU OpenCL runtime such as POCL, where images are
+    plain memory. Without image support the image setup falls back to GEMM and says so.
+*/
+
+#define BATCH_SIZE 16
+#define REPEATS 20
+
+struct Setup
+{
+    const char* name;
+    ConvolutionKernel first;    /* L1 */
+    ConvolutionKernel second;   /* L3 */
+};
+
+static const Setup setups[] = {
+    {"direct", CONVOLUTION_DIRECT, CONVOLUTION_DIRECT},
+    {"im2col GEMM", CONVOLUTION_GEMM, CONVOLUTION_GEMM},
+    {"Winograd F(2x2, 5x5)", CONVOLUTION_WINOGRAD, CONVOLUTION_WINOGRAD},
+    {"L1 GEMM, L3 Winograd", CONVOLUTION_GEMM, CONVOLUTION_WINOGRAD},
+    {"RGBA images", CONVOLUTION_IMAGE, CONVOLUTION_IMAGE},
+};
+
+static const char* outputs[] = {"L1_y", "L3_y"};
+
+/* Microseconds per forward pass, the outputs of the last one in results */
+static double run(const Setup& setup, vector<vector<float> >* results)
+{
+    Network network(BATCH_SIZE);
+
+    network.setFusion(false);
+    network.setMemoryPlanning(false);
+    network.setLayerConvolution(1, setup.first);
+    network.setLayerConvolution(3, setup.second);
+
+    network.addInput(32, 32);
+    network.addConvolution(6, 5);       /* L1 6@28x28 */
+    network.addMaxPool();               /* L2 6@14x14 */
+    network.addConvolution16(16, 5);    /* L3 16@10x10 */
+
+    if (!network.build("assets/kernels.cl", true))
+    {
+        cerr << "Failed to build the network. " << __FILE__ << ":"<< __LINE__ << endl;
+        return -1;
+    }
+
+    /* The same pseudo random image and filters for every setup */
+    mt19937 generator(1);
+    uniform_real_distribution<float> uniform(-1, 1);
+    vector<float> values(network.input()->size());
+
+    generate(values.begin(), values.end(), [&]() { return uniform(generator); });
+
+    bool success = network.write(network.input(), &values[0]);
+    vector<Tensor*> parameters = network.parameters();
+
+    for (size_t i = 0; i < parameters.size(); i++)
+    {
+        values.resize(parameters[i]->size());
+        generate(values.begin(), values.end(), [&]() { return 0.2f * uniform(generator); });
+        success &= network.write(parameters[i], &values[0]);
+    }
+
+    /* The first pass builds the Winograd and image filters and warms up the queue */
+    success &= network.forward() && network.finish();
+
+    steady_clock::time_point begin = steady_clock::now();
+
+    for (int i = 0; i < REPEATS; i++)
+    {
+        success &= network.forward();
+    }
+
+    success &= network.finish();
+
+    steady_clock::time_point end = steady_clock::now();
+
+    results->resize(2);
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        Tensor* tensor = network.tensor(outputs[i]);
+
+        (*results)[i].resize(tensor->size());
+        success &= network.read(tensor, &(*results)[i][0]);
+    }
+
+    if (!success)
+    {
+        cerr << "Failed to run " << setup.name << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return -1;
+    }
+
+    return duration_cast<duration<double, micro> >(end - begin).count() / REPEATS;
+}
+
+int main(void)
+{
+    vector<vector<float> > reference, results;
+    double direct = run(setups[0], &reference);
+
+    if (direct < 0)
+    {
+        return 1;
+    }
+
+    for (size_t s = 0; s < sizeof(setups) / sizeof(setups[0]); s++)
+    {
+        double time = s == 0 ? direct : run(setups[s], &results);
+
+        if (time < 0)
+        {
+            return 1;
+        }
+
+        cout << setups[s].name << ": " << time << " us per batch of " << BATCH_SIZE << ", speedup " << direct / time << endl;
+
+        for (size_t i = 0; s > 0 && i < 2; i++)
+        {
+            double error = 0, largest = 0;
+
+            for (size_t j = 0; j < reference[i].size(); j++)
+            {
+                error = max(error, (double)fabs(results[i][j] - reference[i][j]));
+                largest = max(largest, (double)fabs(reference[i][j]));
+            }
+
+            cout << "    " << outputs[i] << " max error " << error << ", relative " << error / max(largest, 1e-30) << endl;
+        }
+    }
+
+    return 0;
+}
@@ -1,3 +1,24 @@
+/*
+    Activations, errors, deltas and pooling indices are stored as real, which -DHALF_PRECISION turns
+    into half. Weights, their gradients and every sum stay float: loads are widened before any
+    arithmetic, so half only narrows what is written back to global memory.
+*/
+#ifdef HALF_PRECISION
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+typedef half real;
+#else
+typedef float real;
+#endif
+
+/*
+    Shape specialisation, see ProgramCache in framework/program.h. The variant of a kernel for one
+    launch shape is this file built with -DSPECIALIZE_<kernel> and -DSHAPE<i> set to its int
+    argument i. The kernels taking part read the sizes their loops depend on from SHAPE<i> in their
+    own variant, which turns trip counts and strides into constants the compiler can unroll with,
+    and from their arguments everywhere else.
+*/
+
+
 inline void atomicAdd_g_f(volatile __global float *addr, float val)
 {
    union{
@@ -14,58 +35,89 @@ current.f32    = *addr;
 }
 
 
+/*
+    Convolution kernels work on a whole batch. Samples are stacked along columns just like the
+    feature maps inside a sample, so dimension 0 of the NDRange runs over batch * numFilters and
+    get_global_id(0) is directly the index of the output map.
+*/
 __kernel void convolution( const int firstRows,
                             const int firstCols,
                             const int secondRows,
                             const int secondCols,
                             const int numFilters,
                             const int sizeFilters,
-                            const __global float* in,
+                            const int batch,
+                            const __global real* in,
                             const __global float* filters,
-                            __global float* outs)
+                            __global real* outs)
 {
     const int globalFil = get_global_id(0);
     const int globalRow = get_global_id(1);
     const int globalCol = get_global_id(2);
+
+    /* Global size may be padded up to a multiple of the local size */
+    if (globalFil >= batch * numFilters || globalRow >= secondRows || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+#ifdef SPECIALIZE_convolution
+    const int rows = SHAPE0, size = SHAPE5;
+#else
+    const int rows = firstRows, size = sizeFilters;
+#endif
     
     float acc = 0;
+    int offsetIn = (globalFil / numFilters) * firstRows * firstCols;
     int offsetOut = globalFil * secondRows * secondCols;
-    int offsetFil = globalFil * sizeFilters * sizeFilters;
+    int offsetFil = (globalFil % numFilters) * size * size;
     
-    for (int r = 0; r < sizeFilters;  r++)
+    for (int r = 0; r < size;  r++)
     {
-        for (int k = 0; k < sizeFilters; k++)
+        for (int k = 0; k < size; k++)
         {
-            acc += in[(globalCol + k) * firstRows + globalRow + r] * filters[offsetFil + k * sizeFilters + r];
+            acc += in[offsetIn + (globalCol + k) * rows + globalRow + r] * filters[offsetFil + k * size + r];
         }
     }
     outs[offsetOut + globalCol * secondRows + globalRow] = acc;
 }
 
 
+/* Filter gradients are summed over every sample of the batch */
 __kernel void back_convolution( const int firstRows,
                                 const int firstCols,
                                 const int secondRows,
                                 const int secondCols,
                                 const int numFilters,
                                 const int sizeFilters,
-                                const __global float* inA,
-                                const __global float* inB,
+                                const int batch,
+                                const __global real* inA,
+                                const __global real* inB,
                                 __global float* outs)
 {
     const int globalFil = get_global_id(0);
     const int globalRow = get_global_id(1);
     const int globalCol = get_global_id(2);
+
+    if (globalFil >= numFilters || globalRow >= sizeFilters || globalCol >= sizeFilters)
+    {
+        return;
+    }
     
     float acc = 0;
     int offsetOut = globalFil * sizeFilters * sizeFilters;
-    int offsetFil = globalFil * sizeFilters * sizeFilters;
     
-    for (int r = 0; r < secondRows;  r++)
+    for (int b = 0; b < batch; b++)
     {
-        for (int k = 0; k < secondCols; k++)
+        int offsetIn = b * firstRows * firstCols;
+        int offsetErr = (b * numFilters + globalFil) * secondRows * secondCols;
+        
+        for (int r = 0; r < secondRows;  r++)
         {
-            acc += inA[(globalCol + k) * firstRows + globalRow + r] * inB[offsetFil + k * secondCols + r];
+            for (int k = 0; k < secondCols; k++)
+            {
+                acc += (float)inA[offsetIn + (globalCol + k) * firstRows + globalRow + r] * inB[offsetErr + k * secondRows + r];
+            }
         }
     }
     outs[offsetOut + globalCol * sizeFilters + globalRow] = acc;
@@ -85,25 +137,42 @@ __kernel void convolution16(const int firstRows,
                             const int firstCols,
                             const int secondRows,
                             const int secondCols,
+                            const int numFilters,
                             const int sizeFilters,
-                            const __global float* in,
+                            const int numMaps,
+                            const int batch,
+                            const __global real* in,
                             const __global float* filters,
-                            __global float* outs)
+                            __global real* outs)
 {
     const int globalFil = get_global_id(0);
     const int globalRow = get_global_id(1);
     const int globalCol = get_global_id(2);
+
+    if (globalFil >= batch * numFilters || globalRow >= secondRows || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+    const int sample = globalFil / numFilters;
+    const int filter = globalFil % numFilters;
+    
+#ifdef SPECIALIZE_convolution16
+    const int rows = SHAPE0, size = SHAPE5;
+#else
+    const int rows = firstRows, size = sizeFilters;
+#endif
     
     float acc = 0;
-    int offsetIn = (globalFil % 6) * firstRows * firstCols;
+    int offsetIn = (sample * numMaps + filter % numMaps) * firstRows * firstCols;
     int offsetOut = globalFil * secondRows * secondCols;
-    int offsetFil = globalFil * sizeFilters * sizeFilters;
+    int offsetFil = filter * size * size;
     
-    for (int r = 0; r < sizeFilters;  r++)
+    for (int r = 0; r < size;  r++)
     {
-        for (int k = 0; k < sizeFilters; k++)
+        for (int k = 0; k < size; k++)
         {
-            acc += in[offsetIn + (globalCol + k) * firstRows + globalRow + r] * filters[offsetFil + k * sizeFilters + r];
+            acc += in[offsetIn + (globalCol + k) * rows + globalRow + r] * filters[offsetFil + k * size + r];
         }
     }
     outs[offsetOut + globalCol * secondRows + globalRow] = acc;
@@ -113,260 +182,1632 @@ __kernel void back_convolution16(const int firstRows,
                             const int firstCols,
                             const int secondRows,
                             const int secondCols,
+                            const int numFilters,
                             const int sizeFilters,
-                            const __global float* inA,
-                            const __global float* inB,
+                            const int numMaps,
+                            const int batch,
+                            const __global real* inA,
+                            const __global real* inB,
                             __global float* outs)
 {
     const int globalFil = get_global_id(0);
     const int globalRow = get_global_id(1);
     const int globalCol = get_global_id(2);
+
+    if (globalFil >= numFilters || globalRow >= sizeFilters || globalCol >= sizeFilters)
+    {
+        return;
+    }
     
     int outOffset = globalFil * sizeFilters * sizeFilters;
-    int inAOffset = (globalFil % 6) * firstRows * firstCols; // <-- let it stay this ways for now
-    int inBOffset = globalFil * secondRows * secondCols;
     
     float acc = 0;
     
-    for (int r = 0; r < secondRows;  r++)
+    for (int b = 0; b < batch; b++)
     {
-        for (int k = 0; k < secondCols; k++)
+        int inAOffset = (b * numMaps + globalFil % numMaps) * firstRows * firstCols;
+        int inBOffset = (b * numFilters + globalFil) * secondRows * secondCols;
+        
+        for (int r = 0; r < secondRows;  r++)
         {
-            acc += inA[inAOffset + (globalCol + k) * firstRows + globalRow + r] * inB[inBOffset + k * secondCols + r];
+            for (int k = 0; k < secondCols; k++)
+            {
+                acc += (float)inA[inAOffset + (globalCol + k) * firstRows + globalRow + r] * inB[inBOffset + k * secondRows + r];
+            }
         }
     }
     outs[outOffset + globalCol * sizeFilters + globalRow] = acc;
 }
 
 
+/* The atomics need 32 bit words, so outs stays float and half precision networks use deconvolution16_gather */
 __kernel void deconvolution16(  const int firstRows,
                                 const int firstCols,
                                 const int secondRows,
                                 const int secondCols,
+                                const int numFilters,
                                 const int sizeFilters,
-                                const __global float* in,
+                                const int numMaps,
+                                const int batch,
+                                const __global real* in,
                                 const __global float* filters,
                                 __global float* outs)
 {
     const int globalFil = get_global_id(0);
     const int globalRow = get_global_id(1);
     const int globalCol = get_global_id(2);
+
+    if (globalFil >= batch * numFilters || globalRow >= firstRows || globalCol >= firstCols)
+    {
+        return;
+    }
     
-    float acc = 0;
-    int offsetIn =  globalFil * firstRows * firstRows;
-    int offsetOut = (globalFil % 6) * secondRows * secondRows;
-    int offsetFil = globalFil * sizeFilters * sizeFilters;
+    const int sample = globalFil / numFilters;
+    const int filter = globalFil % numFilters;
+    
+    int offsetIn =  globalFil * firstRows * firstCols;
+    int offsetOut = (sample * numMaps + filter % numMaps) * secondRows * secondCols;
+    int offsetFil = filter * sizeFilters * sizeFilters;
     
     for (int r = 0; r < sizeFilters;  r++)
     {
         for (int k = 0; k < sizeFilters; k++)
         {
-             //atomicAdd_g_f(&outs[offsetOut + (globalCol + k) * secondRows + globalRow + r], 1);
              atomicAdd_g_f(&outs[offsetOut + (globalCol + k) * secondRows + globalRow + r], 
                 in[offsetIn + globalCol * firstRows + globalRow] * filters[offsetFil + k * sizeFilters + r]);
         }
     }
 }
-                            
 
 
-__kernel void matrix_multiply(  const int firstRows,
-                                const int firstCols,
-                                const int secondCols,
-                                const __global float* inA,
-                                const __global float* inB,
-                                __global float* out)
+/*
+    Same result as deconvolution16, but every work item owns one pixel of the previous error and
+    gathers from all (filter, position) pairs that touch it, so there are no atomics, no zeroing
+    beforehand and the summation order is fixed, which makes the result bitwise reproducible.
+    Launch over batch * numMaps x secondRows x secondCols.
+*/
+__kernel void deconvolution16_gather(   const int firstRows,
+                                        const int firstCols,
+                                        const int secondRows,
+                                        const int secondCols,
+                                        const int numFilters,
+                                        const int sizeFilters,
+                                        const int numMaps,
+                                        const int batch,
+                                        const __global real* in,
+                                        const __global float* filters,
+                                        __global real* outs)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int globalMap = get_global_id(0);
+    const int globalRow = get_global_id(1);
+    const int globalCol = get_global_id(2);
+
+    if (globalMap >= batch * numMaps || globalRow >= secondRows || globalCol >= secondCols)
+    {
+        return;
+    }
     
-    float acc = 0.0f;
+    const int sample = globalMap / numMaps;
+    const int map = globalMap % numMaps;
     
-    for (int k = 0; k < firstCols; k++)
+    float acc = 0;
+    
+    /* Filters are wired to input maps by filter % numMaps */
+    for (int filter = map; filter < numFilters; filter += numMaps)
     {
-        acc += inA[k * firstRows + globalRow] * inB[globalCol * firstCols + k];
+        int offsetIn = (sample * numFilters + filter) * firstRows * firstCols;
+        int offsetFil = filter * sizeFilters * sizeFilters;
+        
+        for (int k = 0; k < sizeFilters; k++)
+        {
+            const int col = globalCol - k;
+            
+            if (col < 0 || col >= firstCols)
+            {
+                continue;
+            }
+            
+            for (int r = 0; r < sizeFilters; r++)
+            {
+                const int row = globalRow - r;
+                
+                if (row >= 0 && row < firstRows)
+                {
+                    acc += in[offsetIn + col * firstRows + row] * filters[offsetFil + k * sizeFilters + r];
+                }
+            }
+        }
     }
     
-    out[globalCol * firstRows + globalRow] = acc;
+    outs[(sample * numMaps + map) * secondRows * secondCols + globalCol * secondRows + globalRow] = acc;
 }
+                            
 
 
-__kernel void sigmoid(  const int rows,
-                        const int cols,
-                        __global float* in,
-                        __global float* out)
-{
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+/*
+    Implicit GEMM convolution engine. A layer with numMaps input maps splits into numMaps GEMMs,
+    one per input map, because filter f only sees map f % numMaps:
+        y[filters of map m] = W[filters of map m] x P[m]
+    W holds the sizeFilters * sizeFilters taps of every filter in a row, and P[m] is the im2col
+    matrix of map m, one patch per column for every sample and output pixel. P[m] is never
+    stored, tiles of it are gathered from the input maps straight into local memory.
+    Launch with local CONV_TILE x CONV_TILE x 1.
+*/
+#ifndef CONV_TILE
+#define CONV_TILE 8
+#endif
 
-    out[globalCol * rows + globalRow] = 1/(1+exp(-in[globalCol * rows + globalRow]));
+/* Element tap of the im2col patch of input map m under output pixel (row, col) of one sample */
+inline float patch(const __global real* in, const int firstRows, const int firstCols, const int sizeFilters,
+                   const int numMaps, const int m, const int tap, const int sample, const int row, const int col)
+{
+    return in[(sample * numMaps + m) * firstRows * firstCols
+              + (col + tap / sizeFilters) * firstRows + row + tap % sizeFilters];
 }
 
+/* Element (tap, column) of the im2col matrix of input map m, columns run over samples then pixels */
+inline float patch_column(const __global real* in, const int firstRows, const int firstCols, const int secondRows,
+                          const int secondCols, const int sizeFilters, const int numMaps, const int m, const int tap, const int column)
+{
+    const int pixels = secondRows * secondCols;
+    const int pixel = column % pixels;
+    
+    return patch(in, firstRows, firstCols, sizeFilters, numMaps, m, tap, column / pixels, pixel % secondRows, pixel / secondRows);
+}
 
-__kernel void maxpool(  const int rows,
-                        const int cols,
-                        const __global float* in,
-                        __global float* ind,
-                        __global float* out)
+/* Global size: batch * outputs per map x filters per map x numMaps, both padded to CONV_TILE */
+__kernel void convolution_gemm( const int firstRows,
+                                const int firstCols,
+                                const int secondRows,
+                                const int secondCols,
+                                const int numFilters,
+                                const int sizeFilters,
+                                const int numMaps,
+                                const int batch,
+                                const __global real* in,
+                                const __global float* filters,
+                                __global real* outs)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int localCol = get_local_id(0);
+    const int localRow = get_local_id(1);
+    const int column = get_global_id(0);
+    const int m = get_global_id(2);
+    const int filter = m + get_global_id(1) * numMaps;
     
-    int index = 0;
-    float max = in[2*(globalCol * rows + globalRow)];
+    const int taps = sizeFilters * sizeFilters;
+    const int pixels = secondRows * secondCols;
+    const int columns = batch * pixels;
     
-    if (in[2*(globalCol * rows + globalRow) + 1] > max)
-    {
-        max = in[2*(globalCol * rows + globalRow) + 1];
-        index = 1;
-    }
-    else if (in[2*(globalCol * rows + globalRow) + rows] > max)
+    __local float Wsub[CONV_TILE][CONV_TILE];
+    __local float Psub[CONV_TILE][CONV_TILE];
+    
+    float acc = 0.0f;
+    
+    /* Work items past the edges still load zeros and meet the barriers */
+    for (int t = 0; t < taps; t += CONV_TILE)
     {
-        max = in[2*(globalCol * rows + globalRow) + rows];
-        index = 2;
+        Wsub[localRow][localCol] = (filter < numFilters && t + localCol < taps) ? filters[filter * taps + t + localCol] : 0.0f;
+        Psub[localRow][localCol] = (column < columns && t + localRow < taps)
+            ? patch_column(in, firstRows, firstCols, secondRows, secondCols, sizeFilters, numMaps, m, t + localRow, column) : 0.0f;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        for (int k = 0; k < CONV_TILE; k++)
+        {
+            acc += Wsub[localRow][k] * Psub[k][localCol];
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    else if (in[2*(globalCol * rows + globalRow) + rows + 1] > max)
+    
+    if (filter < numFilters && column < columns)
     {
-        max = in[2*(globalCol * rows + globalRow) + rows + 1];
-        index = 3;
+        outs[((column / pixels) * numFilters + filter) * pixels + column % pixels] = acc;
     }
-
-    ind[globalCol * rows + globalRow] = index;
-    out[globalCol * rows + globalRow] = max;
 }
 
 
-__kernel void maxpool_error(const int rows,
-                            const int cols,
-                            const __global float* in,
-                            const __global float* ind,
-                            __global float* out)
+/*
+    convolution_gemm with sigmoid and a 2x2 maxpool applied to the tile before it is stored, the
+    convolution output itself never reaches global memory. Columns are reordered so the four pixels
+    of every pooling window sit next to each other, column = (sample * pooled + window) * 4 + q,
+    where q = 0..3 is the position inside the window in the order maxpool numbers it in ind.
+    secondRows and secondCols are the convolution output, out and ind hold the pooled maps.
+    Global size as convolution_gemm, CONV_TILE has to be a multiple of 4.
+*/
+#if CONV_TILE % 4 != 0
+#error "CONV_TILE has to be a multiple of 4 for convolution_gemm_pool"
+#endif
+
+__kernel void convolution_gemm_pool(const int firstRows,
+                                    const int firstCols,
+                                    const int secondRows,
+                                    const int secondCols,
+                                    const int numFilters,
+                                    const int sizeFilters,
+                                    const int numMaps,
+                                    const int batch,
+                                    const __global real* in,
+                                    const __global float* filters,
+                                    __global real* ind,
+                                    __global real* outs)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int localCol = get_local_id(0);
+    const int localRow = get_local_id(1);
+    const int column = get_global_id(0);
+    const int m = get_global_id(2);
+    const int filter = m + get_global_id(1) * numMaps;
+    
+    const int taps = sizeFilters * sizeFilters;
+    const int pooledRows = secondRows / 2;
+    const int pooled = pooledRows * (secondCols / 2);
+    const int columns = batch * pooled * 4;
+    
+    /* Output pixel this work item convolves */
+    const int window = (column / 4) % pooled;
+    const int q = column % 4;
+    const int sample = column / (4 * pooled);
+    const int row = 2 * (window % pooledRows) + (q & 1);
+    const int col = 2 * (window / pooledRows) + (q >> 1);
     
-    int index = ind[globalRow * rows + globalCol];
-     
-    if (index == 0)
+    __local float Wsub[CONV_TILE][CONV_TILE];
+    __local float Psub[CONV_TILE][CONV_TILE];
+    
+    float acc = 0.0f;
+    
+    for (int t = 0; t < taps; t += CONV_TILE)
     {
-        out[2 * (globalCol * 2 * rows + globalRow)] = in[globalRow * rows + globalCol];
-        out[2 * (globalCol * 2 * rows + globalRow) + 1] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow + rows)] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow + rows) + 1] = 0;               
+        Wsub[localRow][localCol] = (filter < numFilters && t + localCol < taps) ? filters[filter * taps + t + localCol] : 0.0f;
+        Psub[localRow][localCol] = (column < columns && t + localRow < taps)
+            ? patch(in, firstRows, firstCols, sizeFilters, numMaps, m, t + localRow, sample, row, col) : 0.0f;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        for (int k = 0; k < CONV_TILE; k++)
+        {
+            acc += Wsub[localRow][k] * Psub[k][localCol];
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    else if (index == 1)
+    
+    /* Psub is free after the last barrier, it now collects the tile for the pooling */
+    Psub[localRow][localCol] = acc;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if (q != 0 || filter >= numFilters || column >= columns)
     {
-        out[2 * (globalCol * 2 * rows + globalRow)] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow) + 1] = in[globalRow * rows + globalCol];
-        out[2 * (globalCol * 2 * rows + globalRow + rows)] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow + rows) + 1] = 0;                             
+        return;
     }
-    else if (index == 2)
+    
+    /* First maximum wins, as in maxpool */
+    int index = 0;
+    float max = acc;
+    
+    for (int i = 1; i < 4; i++)
     {
-        out[2 * (globalCol * 2 * rows + globalRow)] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow) + 1] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow + rows)] = in[globalRow * rows + globalCol];
-        out[2 * (globalCol * 2 * rows + globalRow + rows) + 1] = 0;                            
+        if (Psub[localRow][localCol + i] > max)
+        {
+            max = Psub[localRow][localCol + i];
+            index = i;
+        }
     }
-    else
+    
+    /* Sigmoid is monotonic, so pooling before it picks the same pixel, inference passes no ind */
+    const int offset = (sample * numFilters + filter) * pooled + window;
+    if (ind != 0)
     {
-        out[2 * (globalCol * 2 * rows + globalRow)] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow) + 1] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow + rows)] = 0;
-        out[2 * (globalCol * 2 * rows + globalRow + rows) + 1] = in[globalRow * rows + globalCol];                             
+        ind[offset] = index;
     }
-
+    outs[offset] = 1/(1+exp(-max));
 }
 
 
-__kernel void sigmoid_derivative(   const int rows,
-                                    const int cols,
-                                    const __global float* in,
-                                    __global float* out)
+/*
+    Filter gradients as the GEMM dW[filters of map m] = d[filters of map m] x P[m]^T. The reduction
+    runs over every sample and pixel, which leaves few outputs, so it is split into splits slices
+    along the columns that write partial sums to partial[slice][filter][tap], see split_sum.
+    Global size: taps x filters per map x numMaps * splits, the first two padded to CONV_TILE.
+*/
+__kernel void back_convolution_gemm(const int firstRows,
+                                    const int firstCols,
+                                    const int secondRows,
+                                    const int secondCols,
+                                    const int numFilters,
+                                    const int sizeFilters,
+                                    const int numMaps,
+                                    const int batch,
+                                    const int splits,
+                                    const __global real* inA,
+                                    const __global real* inB,
+                                    __global float* partial)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
-
-    out[globalCol * rows + globalRow] = in[globalCol * rows + globalRow] * (1 - in[globalCol * rows + globalRow]);
+    const int localCol = get_local_id(0);
+    const int localRow = get_local_id(1);
+    const int tap = get_global_id(0);
+    const int m = get_global_id(2) % numMaps;
+    const int slice = get_global_id(2) / numMaps;
+    const int filter = m + get_global_id(1) * numMaps;
+    
+    const int taps = sizeFilters * sizeFilters;
+    const int pixels = secondRows * secondCols;
+    const int columns = batch * pixels;
+    const int sliceSize = (columns + splits - 1) / splits;
+    const int first = slice * sliceSize;
+    const int last = min(columns, first + sliceSize);
+    
+    __local float Dsub[CONV_TILE][CONV_TILE];
+    __local float Psub[CONV_TILE][CONV_TILE];
+    
+    float acc = 0.0f;
+    
+    for (int c = first; c < last; c += CONV_TILE)
+    {
+        /* Dsub[filter][column] and Psub[column][tap] */
+        const int dColumn = c + localCol;
+        const int pColumn = c + localRow;
+        
+        Dsub[localRow][localCol] = (filter < numFilters && dColumn < last)
+            ? inB[((dColumn / pixels) * numFilters + filter) * pixels + dColumn % pixels] : 0.0f;
+        Psub[localRow][localCol] = (tap < taps && pColumn < last)
+            ? patch_column(inA, firstRows, firstCols, secondRows, secondCols, sizeFilters, numMaps, m, tap, pColumn) : 0.0f;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        for (int k = 0; k < CONV_TILE; k++)
+        {
+            acc += Dsub[localRow][k] * Psub[k][localCol];
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    if (filter < numFilters && tap < taps)
+    {
+        partial[(slice * numFilters + filter) * taps + tap] = acc;
+    }
 }
 
 
-__kernel void matrix_subtract(  const int rows,
-                                const int cols,
-                                const __global float* inA,
-                                const __global float* inB,
-                                __global float* out)
-{
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
 
-    out[globalCol * rows + globalRow] = inA[globalCol * rows + globalRow] - inB[globalCol * rows + globalRow];
-}
+/*
+    Winograd F(2x2, 5x5): a 2x2 output tile is AT [(G W GT) . (BT D B)] A, with W the 5x5 filter
+    and D the 6x6 input patch under the tile, in 36 multiplications instead of 100. The transforms
+    use the points 0, 1, -1, 2, -2 and infinity. W[r][k] = filter[k * 5 + r], rows before columns as
+    in convolution, and transformed values are stored row by row, element i * 6 + j.
+*/
+__constant float winogradG[6][5] = {{ 1.0f/4,  0.0f,     0.0f,    0.0f,     0.0f   },
+                                    {-1.0f/6, -1.0f/6,  -1.0f/6, -1.0f/6,  -1.0f/6 },
+                                    {-1.0f/6,  1.0f/6,  -1.0f/6,  1.0f/6,  -1.0f/6 },
+                                    { 1.0f/24, 1.0f/12,  1.0f/6,  1.0f/3,   2.0f/3 },
+                                    { 1.0f/24, -1.0f/12, 1.0f/6, -1.0f/3,   2.0f/3 },
+                                    { 0.0f,    0.0f,     0.0f,    0.0f,     1.0f   }};
 
+__constant float winogradBT[6][6] = {{4.0f,  0.0f, -5.0f,  0.0f, 1.0f, 0.0f},
+                                     {0.0f, -4.0f, -4.0f,  1.0f, 1.0f, 0.0f},
+                                     {0.0f,  4.0f, -4.0f, -1.0f, 1.0f, 0.0f},
+                                     {0.0f, -2.0f, -1.0f,  2.0f, 1.0f, 0.0f},
+                                     {0.0f,  2.0f, -1.0f, -2.0f, 1.0f, 0.0f},
+                                     {0.0f,  4.0f,  0.0f, -5.0f, 0.0f, 1.0f}};
 
-__kernel void matrix_point_multiply(const int rows,
-                                    const int cols,
-                                    const __global float* inA,
-                                    const __global float* inB,
-                                    __global float* out)
-{
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+__constant float winogradAT[2][6] = {{1.0f, 1.0f,  1.0f, 1.0f,  1.0f, 0.0f},
+                                     {0.0f, 1.0f, -1.0f, 2.0f, -2.0f, 1.0f}};
 
-    out[globalCol * rows + globalRow] = inA[globalCol * rows + globalRow] * inB[globalCol * rows + globalRow];
+/* U = G W GT for every filter, 36 floats each. Global size: numFilters */
+__kernel void winograd_filter(  const int numFilters,
+                                const __global float* filters,
+                                __global float* u)
+{
+    const int filter = get_global_id(0);
+    
+    if (filter >= numFilters)
+    {
+        return;
+    }
+    
+    const __global float* w = filters + filter * 25;
+    float gw[6][5];
+    
+    for (int i = 0; i < 6; i++)
+    {
+        for (int k = 0; k < 5; k++)
+        {
+            float acc = 0.0f;
+            
+            for (int r = 0; r < 5; r++)
+            {
+                acc += winogradG[i][r] * w[k * 5 + r];
+            }
+            
+            gw[i][k] = acc;
+        }
+    }
+    
+    for (int i = 0; i < 6; i++)
+    {
+        for (int j = 0; j < 6; j++)
+        {
+            float acc = 0.0f;
+            
+            for (int k = 0; k < 5; k++)
+            {
+                acc += gw[i][k] * winogradG[j][k];
+            }
+            
+            u[filter * 36 + i * 6 + j] = acc;
+        }
+    }
 }
 
-
-__kernel void matrix_transpose_multiply(const int firstRows,
-                                        const int firstCols,
-                                        const int secondCols,
-                                        const __global float* inA,
-                                        const __global float* inB,
-                                        __global float* out)
+/*
+    V = BT D B for every 6x6 patch under a 2x2 output tile, tiles numbered down the columns of
+    tileRows x tileCols. Patches that stick out of the map read zeros, their outputs are dropped.
+    Global size: tileRows * tileCols x maps, maps counting every sample.
+*/
+__kernel void winograd_input(   const int rows,
+                                const int cols,
+                                const int tileRows,
+                                const int tileCols,
+                                const int maps,
+                                const __global real* in,
+                                __global float* v)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int tile = get_global_id(0);
+    const int map = get_global_id(1);
+    const int tiles = tileRows * tileCols;
     
-    float acc = 0.0f;
+    if (tile >= tiles || map >= maps)
+    {
+        return;
+    }
     
-    for (int k = 0; k < firstRows; k++)
+    const int row = 2 * (tile % tileRows);
+    const int col = 2 * (tile / tileRows);
+    const __global real* input = in + map * rows * cols;
+    float d[6][6];
+    float bd[6][6];
+    
+    for (int a = 0; a < 6; a++)
     {
-        acc += inA[globalCol * firstRows + k] * inB[globalCol * firstRows + k];
+        for (int b = 0; b < 6; b++)
+        {
+            d[a][b] = (row + a < rows && col + b < cols) ? input[(col + b) * rows + row + a] : 0.0f;
+        }
     }
     
-    out[globalCol * firstCols + globalRow] = acc;
+    for (int i = 0; i < 6; i++)
+    {
+        for (int b = 0; b < 6; b++)
+        {
+            float acc = 0.0f;
+            
+            for (int a = 0; a < 6; a++)
+            {
+                acc += winogradBT[i][a] * d[a][b];
+            }
+            
+            bd[i][b] = acc;
+        }
+    }
+    
+    for (int i = 0; i < 6; i++)
+    {
+        for (int j = 0; j < 6; j++)
+        {
+            float acc = 0.0f;
+            
+            for (int b = 0; b < 6; b++)
+            {
+                acc += bd[i][b] * winogradBT[j][b];
+            }
+            
+            v[(map * tiles + tile) * 36 + i * 6 + j] = acc;
+        }
+    }
 }
 
-
-__kernel void matrix_multiply_transpose(const int firstRows,
-                                        const int firstCols,
-                                        const int secondRows,
-                                        const __global float* inA,
-                                        const __global float* inB,
-                                        __global float* out)
+/*
+    Y = AT (U . V) A per tile, filter f of a sample reading its input map f % numMaps as in
+    convolution16, numMaps 1 for a plain convolution. inMaps is the number of maps per sample in v.
+    Global size: tileRows * tileCols x batch * numFilters
+*/
+__kernel void winograd_output(  const int secondRows,
+                                const int secondCols,
+                                const int tileRows,
+                                const int tileCols,
+                                const int numFilters,
+                                const int numMaps,
+                                const int inMaps,
+                                const int batch,
+                                const __global float* u,
+                                const __global float* v,
+                                __global real* outs)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int tile = get_global_id(0);
+    const int outMap = get_global_id(1);
+    const int tiles = tileRows * tileCols;
     
-    float acc = 0.0f;
+    if (tile >= tiles || outMap >= batch * numFilters)
+    {
+        return;
+    }
     
-    for (int k = 0; k < firstCols; k++)
+    const int sample = outMap / numFilters;
+    const int filter = outMap % numFilters;
+    const int map = sample * inMaps + filter % numMaps;
+    const __global float* uf = u + filter * 36;
+    const __global float* vt = v + (map * tiles + tile) * 36;
+    float am[2][6];
+    
+    /* AT M, with M = U . V formed on the fly */
+    for (int i = 0; i < 2; i++)
     {
-        acc += inA[k * firstRows + globalRow] * inB[globalCol * firstCols + k];
+        for (int b = 0; b < 6; b++)
+        {
+            float acc = 0.0f;
+            
+            for (int a = 0; a < 6; a++)
+            {
+                acc += winogradAT[i][a] * uf[a * 6 + b] * vt[a * 6 + b];
+            }
+            
+            am[i][b] = acc;
+        }
     }
     
-    out[globalCol * firstRows + globalRow] = acc;
+    const int row = 2 * (tile % tileRows);
+    const int col = 2 * (tile / tileRows);
+    __global real* out = outs + outMap * secondRows * secondCols;
+    
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            float acc = 0.0f;
+            
+            for (int b = 0; b < 6; b++)
+            {
+                acc += am[i][b] * winogradAT[j][b];
+            }
+            
+            if (row + i < secondRows && col + j < secondCols)
+            {
+                out[(col + j) * secondRows + row + i] = acc;
+            }
+        }
+    }
 }
 
 
-__kernel void matrix_add(   const int rows,
+/*
+    CONVOLUTION_IMAGE reads the input maps of a convolution from an RGBA image2d_array_t and its
+    filters from an image2d_t, both through the texture cache, which keeps the 2D neighbourhood of
+    a texel together where the buffer kernels stride by a whole column per tap. Texel (col, row) of
+    slice sample * groups + g holds maps 4g..4g+3 of the sample, groups = ceil(maps / 4), maps past
+    the last one are zero. Images always hold float.
+*/
+__constant sampler_t imageSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+/* The buffer layout of in packed into out. Global size: cols x rows x batch * groups */
+__kernel void image_input(  const int rows,
                             const int cols,
-                            __global float* inA,
-                            __global float* inB,
-                            __global float* out)
+                            const int maps,
+                            const int batch,
+                            const __global real* in,
+                            __write_only image2d_array_t out)
 {
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    const int slice = get_global_id(2);
+    const int groups = (maps + 3) / 4;
+    
+    if (col >= cols || row >= rows || slice >= batch * groups)
+    {
+        return;
+    }
+    
+    const int sample = slice / groups;
+    const int first = 4 * (slice % groups);
+    float values[4];
+    
+    for (int c = 0; c < 4; c++)
+    {
+        values[c] = first + c < maps ? in[(sample * maps + first + c) * rows * cols + col * rows + row] : 0.0f;
+    }
+    
+    write_imagef(out, (int4)(col, row, slice, 0), (float4)(values[0], values[1], values[2], values[3]));
+}
 
-    out[globalCol * rows + globalRow] = inA[globalCol * rows + globalRow] + inB[globalCol * rows + globalRow];
+/*
+    Filter f reads map f % maps, so the filters round * maps + 4g + c, c = 0..3, read the four maps
+    of texel group g and one work item of convolution_image computes all four of them. Texel
+    (tap, round * groups + g) holds their weights at tap, zero for filters past numFilters.
+    Global size: taps x rounds * groups, rounds = ceil(numFilters / maps)
+*/
+__kernel void image_filters(const int numFilters,
+                            const int taps,
+                            const int maps,
+                            const __global float* filters,
+                            __write_only image2d_t out)
+{
+    const int tap = get_global_id(0);
+    const int line = get_global_id(1);
+    const int groups = (maps + 3) / 4;
+    const int rounds = (numFilters + maps - 1) / maps;
+    
+    if (tap >= taps || line >= rounds * groups)
+    {
+        return;
+    }
+    
+    const int first = (line / groups) * maps + 4 * (line % groups);
+    float values[4];
+    
+    for (int c = 0; c < 4; c++)
+    {
+        const bool exists = 4 * (line % groups) + c < maps && first + c < numFilters;
+        
+        values[c] = exists ? filters[(first + c) * taps + tap] : 0.0f;
+    }
+    
+    write_imagef(out, (int2)(tap, line), (float4)(values[0], values[1], values[2], values[3]));
+}
+
+/*
+    Four filters per work item, one texel of input times one texel of weights per tap, see
+    image_filters. The outputs are stored in the buffer layout of convolution, numMaps is 1 for a
+    plain convolution. Global size: secondCols x secondRows x batch * rounds * groups
+*/
+__kernel void convolution_image(const int secondRows,
+                                const int secondCols,
+                                const int numFilters,
+                                const int sizeFilters,
+                                const int numMaps,
+                                const int batch,
+                                __read_only image2d_array_t in,
+                                __read_only image2d_t filters,
+                                __global real* outs)
+{
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    const int groups = (numMaps + 3) / 4;
+    const int lines = ((numFilters + numMaps - 1) / numMaps) * groups;
+    
+    if (col >= secondCols || row >= secondRows || get_global_id(2) >= batch * lines)
+    {
+        return;
+    }
+    
+    const int sample = get_global_id(2) / lines;
+    const int line = get_global_id(2) % lines;
+    const int slice = sample * groups + line % groups;
+    
+#ifdef SPECIALIZE_convolution_image
+    const int size = SHAPE3;
+#else
+    const int size = sizeFilters;
+#endif
+    
+    float4 acc = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+    
+    for (int r = 0; r < size; r++)
+    {
+        for (int k = 0; k < size; k++)
+        {
+            acc += read_imagef(in, imageSampler, (int4)(col + k, row + r, slice, 0)) * read_imagef(filters, imageSampler, (int2)(k * size + r, line));
+        }
+    }
+    
+    const int first = (line / groups) * numMaps + 4 * (line % groups);
+    const float values[4] = {acc.x, acc.y, acc.z, acc.w};
+    
+    for (int c = 0; c < 4; c++)
+    {
+        if (4 * (line % groups) + c < numMaps && first + c < numFilters)
+        {
+            outs[((sample * numFilters + first + c) * secondCols + col) * secondRows + row] = values[c];
+        }
+    }
+}
+
+/* out[i] = sum of in[s * size + i] over the splits slices, always in the same order */
+__kernel void split_sum(const int size,
+                        const int splits,
+                        const __global float* in,
+                        __global float* out)
+{
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex >= size)
+    {
+        return;
+    }
+
+    float acc = 0.0f;
+
+    for (int s = 0; s < splits; s++)
+    {
+        acc += in[s * size + globalIndex];
+    }
+
+    out[globalIndex] = acc;
+}
+
+
+__kernel void matrix_multiply(  const int firstRows,
+                                const int firstCols,
+                                const int secondCols,
+                                const __global float* inA,
+                                const __global real* inB,
+                                __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= firstRows || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+#ifdef SPECIALIZE_matrix_multiply
+    const int rows = SHAPE0, depth = SHAPE1;
+#else
+    const int rows = firstRows, depth = firstCols;
+#endif
+    
+    float acc = 0.0f;
+    
+    for (int k = 0; k < depth; k++)
+    {
+        acc += inA[k * rows + globalRow] * inB[globalCol * depth + k];
+    }
+    
+    out[globalCol * firstRows + globalRow] = acc;
+}
+
+
+/* Error of the previous layer times its sigmoid derivative, out = (inA * inB) * act * (1 - act),
+   which hands a fully connected layer the delta of a previous sigmoid layer in one dispatch */
+__kernel void matrix_multiply_sigmoid_delta(const int firstRows,
+                                            const int firstCols,
+                                            const int secondCols,
+                                            const __global float* inA,
+                                            const __global real* inB,
+                                            const __global real* act,
+                                            __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= firstRows || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+#ifdef SPECIALIZE_matrix_multiply_sigmoid_delta
+    const int rows = SHAPE0, depth = SHAPE1;
+#else
+    const int rows = firstRows, depth = firstCols;
+#endif
+    
+    float acc = 0.0f;
+    
+    for (int k = 0; k < depth; k++)
+    {
+        acc += inA[k * rows + globalRow] * inB[globalCol * depth + k];
+    }
+    
+    const float a = act[globalCol * firstRows + globalRow];
+    out[globalCol * firstRows + globalRow] = acc * a * (1 - a);
+}
+
+
+__kernel void sigmoid(  const int rows,
+                        const int cols,
+                        __global real* in,
+                        __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    out[globalCol * rows + globalRow] = 1/(1+exp(-(float)in[globalCol * rows + globalRow]));
+}
+
+
+/* Feature maps are stacked along columns, so pooling a (2*rows)x(2*cols) matrix in 2x2 windows
+   never mixes two maps as long as every map has an even number of rows and columns. */
+/* ind remembers the winner of every window for maxpool_error, inference passes NULL instead */
+__kernel void maxpool(  const int rows,
+                        const int cols,
+                        const __global real* in,
+                        __global real* ind,
+                        __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+    
+    const int inRows = 2 * rows;
+    const int base = 2 * globalCol * inRows + 2 * globalRow;
+    
+    int index = 0;
+    float max = in[base];
+    
+    if (in[base + 1] > max)
+    {
+        max = in[base + 1];
+        index = 1;
+    }
+    if (in[base + inRows] > max)
+    {
+        max = in[base + inRows];
+        index = 2;
+    }
+    if (in[base + inRows + 1] > max)
+    {
+        max = in[base + inRows + 1];
+        index = 3;
+    }
+
+    if (ind != 0)
+    {
+        ind[globalCol * rows + globalRow] = index;
+    }
+    out[globalCol * rows + globalRow] = max;
+}
+
+
+__kernel void maxpool_error(const int rows,
+                            const int cols,
+                            const __global real* in,
+                            const __global real* ind,
+                            __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+    
+    const int outRows = 2 * rows;
+    const int base = 2 * globalCol * outRows + 2 * globalRow;
+    const int index = ind[globalCol * rows + globalRow];
+    const float error = in[globalCol * rows + globalRow];
+    
+    out[base] = (index == 0) ? error : 0;
+    out[base + 1] = (index == 1) ? error : 0;
+    out[base + outRows] = (index == 2) ? error : 0;
+    out[base + outRows + 1] = (index == 3) ? error : 0;
+}
+
+
+/* maxpool_error, sigmoid_derivative and matrix_point_multiply in one pass for a convolution followed
+   by a pooling layer. in, ind and act (the pooled sigmoid outputs) are rows x cols, out is the delta
+   of the convolution. The pooled output is the activation of the pixel that won, the others get 0. */
+__kernel void maxpool_delta(const int rows,
+                            const int cols,
+                            const __global real* in,
+                            const __global real* ind,
+                            const __global real* act,
+                            __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+    
+    const int outRows = 2 * rows;
+    const int base = 2 * globalCol * outRows + 2 * globalRow;
+    const int index = ind[globalCol * rows + globalRow];
+    const float a = act[globalCol * rows + globalRow];
+    const float delta = in[globalCol * rows + globalRow] * a * (1 - a);
+    
+    out[base] = (index == 0) ? delta : 0;
+    out[base + 1] = (index == 1) ? delta : 0;
+    out[base + outRows] = (index == 2) ? delta : 0;
+    out[base + outRows + 1] = (index == 3) ? delta : 0;
+}
+
+
+__kernel void sigmoid_derivative(   const int rows,
+                                    const int cols,
+                                    const __global real* in,
+                                    __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    const float a = in[globalCol * rows + globalRow];
+    out[globalCol * rows + globalRow] = a * (1 - a);
+}
+
+
+__kernel void matrix_subtract(  const int rows,
+                                const int cols,
+                                const __global float* inA,
+                                const __global real* inB,
+                                __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    out[globalCol * rows + globalRow] = inA[globalCol * rows + globalRow] - inB[globalCol * rows + globalRow];
+}
+
+
+__kernel void matrix_point_multiply(const int rows,
+                                    const int cols,
+                                    const __global real* inA,
+                                    const __global real* inB,
+                                    __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    out[globalCol * rows + globalRow] = (float)inA[globalCol * rows + globalRow] * inB[globalCol * rows + globalRow];
+}
+
+
+/* matrix_subtract, sigmoid_derivative and matrix_point_multiply of the output layer, out = (target - act) * act * (1 - act) */
+__kernel void output_delta( const int rows,
+                            const int cols,
+                            const __global float* target,
+                            const __global real* act,
+                            __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    const float a = act[globalCol * rows + globalRow];
+    out[globalCol * rows + globalRow] = (target[globalCol * rows + globalRow] - a) * a * (1 - a);
+}
+
+
+__kernel void matrix_transpose_multiply(const int firstRows,
+                                        const int firstCols,
+                                        const int secondCols,
+                                        const __global float* inA,
+                                        const __global real* inB,
+                                        __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= firstCols || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+    float acc = 0.0f;
+    
+    for (int k = 0; k < firstRows; k++)
+    {
+        acc += inA[globalRow * firstRows + k] * inB[globalCol * firstRows + k];
+    }
+    
+    out[globalCol * firstCols + globalRow] = acc;
+}
+
+
+/* matrix_transpose_multiply followed by sigmoid, the product is never stored */
+__kernel void matrix_transpose_multiply_sigmoid(const int firstRows,
+                                                const int firstCols,
+                                                const int secondCols,
+                                                const __global float* inA,
+                                                const __global real* inB,
+                                                __global real* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= firstCols || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+    float acc = 0.0f;
+    
+    for (int k = 0; k < firstRows; k++)
+    {
+        acc += inA[globalRow * firstRows + k] * inB[globalCol * firstRows + k];
+    }
+    
+    out[globalCol * firstCols + globalRow] = 1/(1+exp(-acc));
+}
+
+
+/*
+    Register blocked matrix_transpose_multiply, the forward pass of fully connected layers. A work
+    group computes a GEMM_TILE x GEMM_TILE tile of out, every work item GEMM_WPTM x GEMM_WPTN of it,
+    RTSM rows and RTSN columns apart. firstRows goes through local memory GEMM_TILE at a time in two
+    buffers, tile t + 1 is loaded while tile t is summed, one barrier per tile. Anything past the
+    edges loads as zero and is not stored, no size has to be a multiple of GEMM_TILE.
+    Global size: firstCols / GEMM_WPTM x secondCols / GEMM_WPTN, local GEMM_TILE / GEMM_WPTM x GEMM_TILE / GEMM_WPTN
+*/
+#ifndef GEMM_TILE
+#define GEMM_TILE 16
+#endif
+#ifndef GEMM_WPTM
+#define GEMM_WPTM 2
+#endif
+#ifndef GEMM_WPTN
+#define GEMM_WPTN 2
+#endif
+
+#define GEMM_RTSM (GEMM_TILE / GEMM_WPTM)
+#define GEMM_RTSN (GEMM_TILE / GEMM_WPTN)
+
+/* acc[wm * GEMM_WPTN + wn] of the calling work item, Asub and Bsub hold 2 x GEMM_TILE x GEMM_TILE floats each */
+inline void transpose_multiply_blocked(const int firstRows, const int firstCols, const int secondCols,
+                                       const __global float* inA, const __global real* inB,
+                                       __local float* Asub, __local float* Bsub, float* acc)
+{
+    const int row = get_local_id(0);
+    const int col = get_local_id(1);
+    const int id = col * GEMM_RTSM + row;
+    const int firstRow = GEMM_TILE * get_group_id(0);
+    const int firstCol = GEMM_TILE * get_group_id(1);
+    const int numTiles = (firstRows + GEMM_TILE - 1) / GEMM_TILE;
+    const int tileSize = GEMM_TILE * GEMM_TILE;
+    
+    for (int i = 0; i < GEMM_WPTM * GEMM_WPTN; i++)
+    {
+        acc[i] = 0.0f;
+    }
+    
+    for (int t = 0; t <= numTiles; t++)
+    {
+        /* Tile t goes to buffer t % 2, stored k-major; both matrices are read along k, which is contiguous */
+        if (t < numTiles)
+        {
+            for (int i = id; i < tileSize; i += GEMM_RTSM * GEMM_RTSN)
+            {
+                const int k = GEMM_TILE * t + i % GEMM_TILE;
+                const int j = i / GEMM_TILE;
+                const int offset = (t % 2) * tileSize + (i % GEMM_TILE) * GEMM_TILE + j;
+                
+                Asub[offset] = (firstRow + j < firstCols && k < firstRows) ? inA[(firstRow + j) * firstRows + k] : 0.0f;
+                Bsub[offset] = (firstCol + j < secondCols && k < firstRows) ? (float)inB[(firstCol + j) * firstRows + k] : 0.0f;
+            }
+        }
+        
+        /* Tile t - 1 is complete, tile t may still be arriving */
+        if (t > 0)
+        {
+            const int buffer = ((t - 1) % 2) * tileSize;
+            
+            for (int k = 0; k < GEMM_TILE; k++)
+            {
+                float a[GEMM_WPTM];
+                
+                for (int wm = 0; wm < GEMM_WPTM; wm++)
+                {
+                    a[wm] = Asub[buffer + k * GEMM_TILE + row + wm * GEMM_RTSM];
+                }
+                
+                for (int wn = 0; wn < GEMM_WPTN; wn++)
+                {
+                    const float b = Bsub[buffer + k * GEMM_TILE + col + wn * GEMM_RTSN];
+                    
+                    for (int wm = 0; wm < GEMM_WPTM; wm++)
+                    {
+                        acc[wm * GEMM_WPTN + wn] += a[wm] * b;
+                    }
+                }
+            }
+        }
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+__kernel void matrix_transpose_multiply_blocked(const int firstRows,
+                                                const int firstCols,
+                                                const int secondCols,
+                                                const __global float* inA,
+                                                const __global real* inB,
+                                                __global real* out)
+{
+    __local float Asub[2 * GEMM_TILE * GEMM_TILE];
+    __local float Bsub[2 * GEMM_TILE * GEMM_TILE];
+    float acc[GEMM_WPTM * GEMM_WPTN];
+    
+#ifdef SPECIALIZE_matrix_transpose_multiply_blocked
+    const int inputs = SHAPE0, outputs = SHAPE1, samples = SHAPE2;
+#else
+    const int inputs = firstRows, outputs = firstCols, samples = secondCols;
+#endif
+    
+    transpose_multiply_blocked(inputs, outputs, samples, inA, inB, Asub, Bsub, acc);
+    
+    for (int wn = 0; wn < GEMM_WPTN; wn++)
+    {
+        const int globalCol = GEMM_TILE * get_group_id(1) + get_local_id(1) + wn * GEMM_RTSN;
+        
+        for (int wm = 0; wm < GEMM_WPTM; wm++)
+        {
+            const int globalRow = GEMM_TILE * get_group_id(0) + get_local_id(0) + wm * GEMM_RTSM;
+            
+            if (globalRow < outputs && globalCol < samples)
+            {
+                out[globalCol * outputs + globalRow] = acc[wm * GEMM_WPTN + wn];
+            }
+        }
+    }
+}
+
+/* matrix_transpose_multiply_blocked followed by sigmoid */
+__kernel void matrix_transpose_multiply_sigmoid_blocked(const int firstRows,
+                                                        const int firstCols,
+                                                        const int secondCols,
+                                                        const __global float* inA,
+                                                        const __global real* inB,
+                                                        __global real* out)
+{
+    __local float Asub[2 * GEMM_TILE * GEMM_TILE];
+    __local float Bsub[2 * GEMM_TILE * GEMM_TILE];
+    float acc[GEMM_WPTM * GEMM_WPTN];
+    
+#ifdef SPECIALIZE_matrix_transpose_multiply_sigmoid_blocked
+    const int inputs = SHAPE0, outputs = SHAPE1, samples = SHAPE2;
+#else
+    const int inputs = firstRows, outputs = firstCols, samples = secondCols;
+#endif
+    
+    transpose_multiply_blocked(inputs, outputs, samples, inA, inB, Asub, Bsub, acc);
+    
+    for (int wn = 0; wn < GEMM_WPTN; wn++)
+    {
+        const int globalCol = GEMM_TILE * get_group_id(1) + get_local_id(1) + wn * GEMM_RTSN;
+        
+        for (int wm = 0; wm < GEMM_WPTM; wm++)
+        {
+            const int globalRow = GEMM_TILE * get_group_id(0) + get_local_id(0) + wm * GEMM_RTSM;
+            
+            if (globalRow < outputs && globalCol < samples)
+            {
+                out[globalCol * outputs + globalRow] = 1/(1+exp(-acc[wm * GEMM_WPTN + wn]));
+            }
+        }
+    }
+}
+
+
+__kernel void matrix_multiply_transpose(const int firstRows,
+                                        const int firstCols,
+                                        const int secondRows,
+                                        const __global real* inA,
+                                        const __global real* inB,
+                                        __global float* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= firstRows || globalCol >= secondRows)
+    {
+        return;
+    }
+    
+    float acc = 0.0f;
+    
+    for (int k = 0; k < firstCols; k++)
+    {
+        acc += (float)inA[k * firstRows + globalRow] * inB[k * secondRows + globalCol];
+    }
+    
+    out[globalCol * firstRows + globalRow] = acc;
+}
+
+
+__kernel void matrix_add(   const int rows,
+                            const int cols,
+                            __global float* inA,
+                            __global float* inB,
+                            __global float* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    out[globalCol * rows + globalRow] = inA[globalCol * rows + globalRow] + inB[globalCol * rows + globalRow];
+}
+
+
+__kernel void matrix_zero(  const int rows,
+                            const int cols,
+                            __global float* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+
+    out[globalCol * rows + globalRow] = 0;
+}
+
+/*
+    Optimizers, one work item per element of every parameter tensor flattened into one buffer.
+    The gradients already point downhill (the error is target - act), so every step adds them.
+    Weight decay is L2 folded into the gradient for the SGD variants and decoupled for Adam.
+*/
+__kernel void sgd(  const int size,
+                    const float rate,
+                    const float decay,
+                    const __global float* gradients,
+                    __global float* parameters)
+{
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex >= size)
+    {
+        return;
+    }
+
+    const float p = parameters[globalIndex];
+    parameters[globalIndex] = p + rate * (gradients[globalIndex] - decay * p);
+}
+
+
+/* velocity = momentum * velocity + gradient, Nesterov steps along gradient + momentum * velocity instead */
+__kernel void sgd_momentum( const int size,
+                            const int nesterov,
+                            const float rate,
+                            const float momentum,
+                            const float decay,
+                            const __global float* gradients,
+                            __global float* velocity,
+                            __global float* parameters)
+{
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex >= size)
+    {
+        return;
+    }
+
+    const float p = parameters[globalIndex];
+    const float g = gradients[globalIndex] - decay * p;
+    const float v = momentum * velocity[globalIndex] + g;
+
+    velocity[globalIndex] = v;
+    parameters[globalIndex] = p + rate * (nesterov ? g + momentum * v : v);
+}
+
+
+/* correction1 and correction2 are 1 / (1 - beta^t) of step t, they change every step */
+__kernel void adam( const int size,
+                    const float rate,
+                    const float beta1,
+                    const float beta2,
+                    const float epsilon,
+                    const float decay,
+                    const float correction1,
+                    const float correction2,
+                    const __global float* gradients,
+                    __global float* moment1,
+                    __global float* moment2,
+                    __global float* parameters)
+{
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex >= size)
+    {
+        return;
+    }
+
+    const float p = parameters[globalIndex];
+    const float g = gradients[globalIndex];
+    const float m = beta1 * moment1[globalIndex] + (1 - beta1) * g;
+    const float v = beta2 * moment2[globalIndex] + (1 - beta2) * g * g;
+
+    moment1[globalIndex] = m;
+    moment2[globalIndex] = v;
+    parameters[globalIndex] = p + rate * (m * correction1 / (sqrt(v * correction2) + epsilon) - decay * p);
+}
+
+
+/* Narrows the float input of a half precision network, out = in */
+__kernel void to_real(  const int size,
+                        const __global float* in,
+                        __global real* out)
+{
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex >= size)
+    {
+        return;
+    }
+
+    out[globalIndex] = in[globalIndex];
+}
+
+
+/*
+    int8 inference, see Network::calibrate(). Every tensor has a scale of its own and stores a value
+    v as round(v / scale), clamped to -127..127. Products are summed in int, which cannot overflow
+    for the sizes of LeNet (400 * 127 * 127). rescale = scale(syn) * scale(in) / scale(y) brings the
+    sum to the int8 pre-activation y, and lut holds the int8 sigmoid of all 256 of them, so there
+    is no exp on the way.
+*/
+inline char sigmoid_int8(const int acc, const float rescale, const __global char* lut)
+{
+    return lut[clamp(convert_int_sat_rte(acc * rescale), -128, 127) + 128];
+}
+
+
+/* out = in / scale, inverse is 1 / scale */
+__kernel void quantize( const int size,
+                        const float inverse,
+                        const __global float* in,
+                        __global char* out)
+{
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex >= size)
+    {
+        return;
+    }
+
+    out[globalIndex] = convert_char_sat_rte(clamp(in[globalIndex] * inverse, -127.0f, 127.0f));
+}
+
+
+/* convolution16 followed by the sigmoid, a plain convolution is the numMaps == 1 case */
+__kernel void convolution_int8( const int firstRows,
+                                const int firstCols,
+                                const int secondRows,
+                                const int secondCols,
+                                const int numFilters,
+                                const int sizeFilters,
+                                const int numMaps,
+                                const int batch,
+                                const float rescale,
+                                const __global char* in,
+                                const __global char* filters,
+                                const __global char* lut,
+                                __global char* outs)
+{
+    const int globalFil = get_global_id(0);
+    const int globalRow = get_global_id(1);
+    const int globalCol = get_global_id(2);
+
+    if (globalFil >= batch * numFilters || globalRow >= secondRows || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+    const int sample = globalFil / numFilters;
+    const int filter = globalFil % numFilters;
+    
+    int acc = 0;
+    int offsetIn = (sample * numMaps + filter % numMaps) * firstRows * firstCols;
+    int offsetOut = globalFil * secondRows * secondCols;
+    int offsetFil = filter * sizeFilters * sizeFilters;
+    
+    for (int r = 0; r < sizeFilters;  r++)
+    {
+        for (int k = 0; k < sizeFilters; k++)
+        {
+            acc += in[offsetIn + (globalCol + k) * firstRows + globalRow + r] * filters[offsetFil + k * sizeFilters + r];
+        }
+    }
+    outs[offsetOut + globalCol * secondRows + globalRow] = sigmoid_int8(acc, rescale, lut);
+}
+
+
+/* Pooling keeps the scale of its input, the int8 values compare like the values they stand for */
+__kernel void maxpool_int8( const int rows,
+                            const int cols,
+                            const __global char* in,
+                            __global char* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= rows || globalCol >= cols)
+    {
+        return;
+    }
+    
+    const int inRows = 2 * rows;
+    const int base = 2 * globalCol * inRows + 2 * globalRow;
+    
+    out[globalCol * rows + globalRow] = max(max(in[base], in[base + 1]), max(in[base + inRows], in[base + inRows + 1]));
+}
+
+
+/* matrix_transpose_multiply_sigmoid on int8, out = sigmoid(inA^T * inB) */
+__kernel void matrix_transpose_multiply_int8(   const int firstRows,
+                                                const int firstCols,
+                                                const int secondCols,
+                                                const float rescale,
+                                                const __global char* inA,
+                                                const __global char* inB,
+                                                const __global char* lut,
+                                                __global char* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+
+    if (globalRow >= firstCols || globalCol >= secondCols)
+    {
+        return;
+    }
+    
+    int acc = 0;
+    
+    for (int k = 0; k < firstRows; k++)
+    {
+        acc += inA[globalRow * firstRows + k] * inB[globalCol * firstRows + k];
+    }
+    
+    out[globalCol * firstCols + globalRow] = sigmoid_int8(acc, rescale, lut);
+}
+
+
+#ifndef FORWARD_LOCAL
+#define FORWARD_LOCAL 4096
+#endif
+
+/* Largest convolution of a 2x2 window at (row, col) of a column-major map with rows rows, before the sigmoid */
+inline float pooled_convolution(const __local float* in, const int rows, const __global float* filter, const int size, const int row, const int col)
+{
+    float result = -INFINITY;
+
+    for (int q = 0; q < 4; q++)
+    {
+        const __local float* corner = in + (col + (q >> 1)) * rows + row + (q & 1);
+        float acc = 0.0f;
+
+        for (int k = 0; k < size; k++)
+        {
+            for (int r = 0; r < size; r++)
+            {
+                acc += filter[k * size + r] * corner[k * rows + r];
+            }
+        }
+
+        result = fmax(result, acc);
+    }
+
+    return result;
+}
+
+/* Neuron j = sigmoid(syn[j]^T * in) for every j < outputs, spread over the work group */
+inline void fully_connected(const __local float* in, const int inputs, const __global float* syn, const int outputs, __local float* out)
+{
+    for (int j = get_local_id(0); j < outputs; j += get_local_size(0))
+    {
+        float acc = 0.0f;
+
+        for (int k = 0; k < inputs; k++)
+        {
+            acc += syn[j * inputs + k] * in[k];
+        }
+
+        out[j] = 1/(1+exp(-acc));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/*
+    The whole forward pass of a LeNet shaped graph in one dispatch: convolution + maxpool,
+    convolution16 + maxpool and three fully connected layers. Work group g takes sample g and keeps
+    the image and every activation in local memory, FORWARD_LOCAL floats in all; the weights stream
+    from global memory, L5 alone is larger than the constant memory of most devices. Only the
+    outputs go back to global memory. The work items split each layer between them and meet at a
+    barrier before the next one. Layer 1 sees the single input map, filter f of layer 3 map f % maps1.
+*/
+__kernel void forward_lenet(const int rows,
+                            const int cols,
+                            const int maps1,
+                            const int size1,
+                            const int maps3,
+                            const int size3,
+                            const int neurons5,
+                            const int neurons6,
+                            const int outputs,
+                            const __global float* image,
+                            const __global float* syn1,
+                            const __global float* syn3,
+                            const __global float* syn5,
+                            const __global float* syn6,
+                            const __global float* syn7,
+                            __global float* out)
+{
+    __local float memory[FORWARD_LOCAL];
+
+    const int id = get_local_id(0);
+    const int group = get_local_size(0);
+    const int sample = get_group_id(0);
+
+    const int rows2 = (rows - size1 + 1) / 2, cols2 = (cols - size1 + 1) / 2;
+    const int rows4 = (rows2 - size3 + 1) / 2, cols4 = (cols2 - size3 + 1) / 2;
+    const int features = maps3 * rows4 * cols4;
+
+    __local float* in = memory;
+    __local float* a2 = in + rows * cols;
+    __local float* a4 = a2 + maps1 * rows2 * cols2;
+    __local float* a5 = a4 + features;
+    __local float* a6 = a5 + neurons5;
+    __local float* a7 = a6 + neurons6;
+
+    for (int i = id; i < rows * cols; i += group)
+    {
+        in[i] = image[sample * rows * cols + i];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    /* Sigmoid is monotonic, so it only runs on the pooled value */
+    for (int i = id; i < maps1 * rows2 * cols2; i += group)
+    {
+        const int map = i / (rows2 * cols2), pixel = i % (rows2 * cols2);
+
+        a2[i] = 1/(1+exp(-pooled_convolution(in, rows, syn1 + map * size1 * size1, size1, 2 * (pixel % rows2), 2 * (pixel / rows2))));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = id; i < features; i += group)
+    {
+        const int map = i / (rows4 * cols4), pixel = i % (rows4 * cols4);
+        const __local float* input = a2 + (map % maps1) * rows2 * cols2;
+
+        a4[i] = 1/(1+exp(-pooled_convolution(input, rows2, syn3 + map * size3 * size3, size3, 2 * (pixel % rows4), 2 * (pixel / rows4))));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    fully_connected(a4, features, syn5, neurons5, a5);
+    fully_connected(a5, neurons5, syn6, neurons6, a6);
+    fully_connected(a6, neurons6, syn7, outputs, a7);
+
+    for (int i = id; i < outputs; i += group)
+    {
+        out[sample * outputs + i] = a7[i];
+    }
 }
@@ -1,10 +1,15 @@
 #include "common.h"
 #include "image.h"
+#include "dataset.h"
+#include "network.h"
+#include "pipeline.h"
 
 #include <CL/cl.h>
 #include <iostream>
+#include <algorithm>
 #include <chrono>
-#include <cstring>
+#include <cmath>
+#include <vector>
 
 using namespace std;
 using namespace chrono;
@@ -70,1352 +75,355 @@ Operations needed:
         - L3_d = pointwise_multiply(L3_e, L3_g)
         - L3_dsyn = back_convolution16(L2_a, L3_d)
         
-        - L2_e = deconvolution(L3_d, L3_syn)
+        - L2_e = deconvolution16(L3_d, L3_syn)
         
         - L1_e = maxpool_error(L2_e, L2_y)
         - L1_g = sigmoid_gradient(L1_a)
         - L1_d = pointwise_multiply(L1_e, L1_g)
         - L1_dsyn = back_convolution6(L1_d, image)
+
+    Update:
+        - Lx_syn = sgd(Lx_syn, Lx_dsyn)       <-- Lx_syn += Lx_dsyn, one dispatch for every layer
+
+    Network (framework/network.h) derives all of the above from the layer list below, allocates
+    every buffer once and sets every kernel argument once, so a training step only enqueues kernels.
+    The syn and dsyn tensors are slices of one weights and one gradients buffer, the optimizer walks
+    all of them at once (see Optimizer in framework/network.h for momentum, Nesterov and Adam).
+    Only those, image, output and L7_a keep memory of their own (le_net_split adds a gradient_sum
+    for its micro-batches, see setAccumulation()), everything else shares arenas
+    with tensors it is never alive at the same time as (the L1 and L3 tensors of the forward pass
+    and the errors of the backward pass, for instance).
+    Every buffer above holds BATCH_SIZE samples side by side, which turns L5-L7 into real matrix
+    products (syn^T * a) and lets one dispatch per layer cover the whole batch.
+    With fusion (the default) the sigmoids, pools and deltas above run inside the kernels next to
+    them: L1+L2 and L3+L4 are one convolution_gemm_pool each and every L*_d is a single dispatch.
+    With HALF_PRECISION the y, a, e, g, d and pooling indices are halves and to_real narrows the
+    image first; image, output, syn and dsyn stay float.
+    INT8_INFERENCE adds an int8 copy for inference, Lx_a = lut[Lx_syn * Lx-1_a] with int sums and
+    one scale per tensor, see Network::calibrate().
+    MEGAKERNEL answers predict() with forward_lenet instead: one dispatch, one work group per sample,
+    L1-L7 in local memory and only image, the syn tensors and L7_a in global memory.
+    SPECIALIZE trains on kernels compiled for the sizes of their layers, see ProgramCache in
+    framework/program.h, and times each of them against the generic kernel at the end.
 */
 
-#define TEST_IND 17
-#define NUMBER_OF_OPERATIONS 15
+#define TEST_TENSOR "L7_syn"
+#define BATCH_SIZE 16
+#define ITERATIONS 1
 #define SIZE 10
 
-int main(void)
+/* Passes over the training set when it is given on the command line */
+#define EPOCHS 1
+#define CLASSES 10
+
+/* Batches prepared ahead of the device, see InputPipeline */
+#define INPUT_SLOTS 2
+
+/* Set to 1 to keep activations, errors and deltas in half precision where the device has cl_khr_fp16,
+   weights and sums stay float. predict() then checks the outputs against a float network. */
+#define HALF_PRECISION 0
+#define HALF_TOLERANCE 0.01f
+
+/* Set to 1 to also answer the batch from an int8 copy of the trained weights, calibrated on another batch */
+#define INT8_INFERENCE 0
+#define INT8_TOLERANCE 0.05f
+
+/* Set to 1 to run the forward pass of predict() as a single kernel, float only */
+#define MEGAKERNEL 0
+
+/* Set to 1 to build a variant per kernel and layer shape where kernels.cl allows it and report its speedup */
+#define SPECIALIZE 0
+
+/* Set to 1 for a per kernel and per layer timing table and a Chrome trace of every dispatch */
+#define PROFILE 0
+#define TRACE_FILE "le_net_trace.json"
+
+static void addLayers(Network& network)
 {
-    cl_context context = 0;
-    cl_command_queue commandQueue = 0;
-    cl_program program = 0;
-    cl_device_id device = 0;
-    cl_kernel kernels[NUMBER_OF_OPERATIONS] = {0};
-    cl_event event = 0;
-    
-    int numberOfMemoryObjects = 45;
-    cl_mem memoryObjects[45] = {0};
-    cl_int errorNumber;
-    string kernel_names[] = {"convolution", "sigmoid", "maxpool", "convolution16", "matrix_multiply", "matrix_subtract", 
-        "sigmoid_derivative", "matrix_point_multiply", "matrix_transpose_multiply", "matrix_multiply_transpose", 
-        "maxpool_error", "back_convolution16", "deconvolution16", "back_convolution", "matrix_add"};
-    
-    size_t firstRows, firstCols, secondRows, secondCols, numFilters, filterSize;   
-    size_t globalWorksize2[2];
-    size_t globalWorksize3[3];
-    
-    const size_t localWorksize2[2] = {1, 1};
-    const size_t localWorksize3[3] = {1, 1, 1};
-    bool setKernelArgumentsSuccess = true;
-    
-    /*  Prepare context, command queue, program and kernels
-        NOTE: We wont use most of clean functions, as the code will be just huge. */
-        
-    if (!createContext(&context))
+    network.addInput(32, 32);
+    network.addConvolution(6, 5);       /* L1 6@28x28 */
+    network.addMaxPool();               /* L2 6@14x14 */
+    network.addConvolution16(16, 5);    /* L3 16@10x10 */
+    network.addMaxPool();               /* L4 16@5x5 */
+    network.addFullyConnected(120);     /* L5 */
+    network.addFullyConnected(84);      /* L6 */
+    network.addFullyConnected(10);      /* L7 */
+}
+
+/* Forward-only network with the weights of trained */
+static bool buildInference(Network& trained, Network& inference)
+{
+    addLayers(inference);
+
+    if (!inference.build("assets/kernels.cl", false))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed to create an OpenCL context. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        cerr << "Failed to build the inference network. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
     }
 
-    if (!createCommandQueue(context, &commandQueue, &device))
+    vector<Tensor*> from = trained.parameters(), to = inference.parameters();
+    bool copySuccess = true;
+
+    for (size_t i = 0; i < from.size(); i++)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed to create the OpenCL command queue. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        vector<float> weights(from[i]->size());
+        copySuccess = copySuccess && trained.read(from[i], &weights[0]) && inference.write(to[i], &weights[0]);
     }
 
-    if (!createProgram(context, device, "assets/kernels.cl", &program))
+    return copySuccess;
+}
+
+/* Largest difference between outputs and those of a float network and how many samples still get the same class */
+static bool compareFloat(Network& trained, const vector<float>& images, const vector<float>& outputs, const string& name, float tolerance)
+{
+    Network reference(BATCH_SIZE);
+    vector<float> expected(outputs.size());
+
+    if (!buildInference(trained, reference) || !reference.predict(&images[0], &expected[0], BATCH_SIZE))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed to create OpenCL program." << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        return false;
     }
 
-    for (int i = 0; i < NUMBER_OF_OPERATIONS; i++)
+    float worst = 0;
+    size_t agree = 0;
+
+    for (size_t s = 0; s < BATCH_SIZE; s++)
     {
-        kernels[i] = clCreateKernel(program, kernel_names[i].c_str(), &errorNumber);
-        
-        if (!checkSuccess(errorNumber))
+        vector<float>::const_iterator half = outputs.begin() + s * CLASSES, single = expected.begin() + s * CLASSES;
+
+        for (size_t i = 0; i < CLASSES; i++)
         {
-            cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-            cerr << "Failed to create OpenCL kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-            return 1;
+            worst = max(worst, fabs(half[i] - single[i]));
         }
+
+        agree += max_element(half, half + CLASSES) - half == max_element(single, single + CLASSES) - single;
     }
-    
-    /* Ask the OpenCL implementation to allocate buffers for the data */ 
-    bool createMemoryObjectsSuccess = true;  
-    size_t buffSizes[] = {1024, 150, 4704, 4704, 1176, 1176, 400, 1600, 1600, 400,
-                          400, 48000, 120, 120, 10080, 84, 84, 840, 10, 10,
-                          10, 10, 10, 10, 840, 84, 84, 84, 1080, 120,
-                          120, 120, 48000, 400, 1600, 1600, 1600, 400, 1176, 4704,
-                          4704, 4704, 150};
-    
-    for (int i = 0; i < numberOfMemoryObjects; i++)
-    {    
-        memoryObjects[i] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, buffSizes[i] * sizeof(float), NULL, &errorNumber);
-        createMemoryObjectsSuccess &= checkSuccess(errorNumber);
-    }   
-    
-    if (!createMemoryObjectsSuccess)
+
+    cout << name << " outputs within " << worst << " of float, " << agree << " of " << BATCH_SIZE << " samples classified alike" << endl;
+
+    if (worst > tolerance)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed to create OpenCL buffer. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        cerr << name << " outputs are off by more than " << tolerance << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
     }
-    
-    /* Map the memory buffers created by the OpenCL implementation to pointers so we can access them on the CPU */
-    bool mapMemoryObjectsSuccess = true;
-    
-    cl_float* image = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[0], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[0], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
 
-    cl_float* L1_syn = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[1], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[1], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
-    
-    cl_float* L3_syn = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[6], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[6], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
-    
-    cl_float* L5_syn = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[11], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[11], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
+    return true;
+}
 
-    cl_float* L6_syn = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[14], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[14], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
-    
-    cl_float* L7_syn = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[17], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[17], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
-    
-    cl_float* output = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[20], 
-        CL_TRUE, CL_MAP_WRITE, 0, buffSizes[20], 0, NULL, NULL, &errorNumber);
-    mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
-        
-    if (mapMemoryObjectsSuccess == false)
-        cout << "ERROR!" << endl;
-            
-    /* Initialize the data */        
-    for (unsigned int i=0; i<buffSizes[0]; i++)
-        image[i] = 1;
-        
-    for (unsigned int i=0; i<buffSizes[1]; i++)
-        L1_syn[i] = 0.01;
+/* int8 copy of trained with its scales taken from a float pass over calibration */
+static bool predictInt8(Network& trained, const vector<float>& calibration, const vector<float>& images)
+{
+    Network quantized(BATCH_SIZE);
+    vector<float> outputs(trained.output()->size());
 
-    for (unsigned int i=0; i<buffSizes[6]; i++)
-        L3_syn[i] = 0.01;
+    quantized.setPrecision(PRECISION_INT8);
+    addLayers(quantized);
 
-    for (unsigned int i=0; i<buffSizes[11]; i++)
-        L5_syn[i] = 0.01;
+    if (!quantized.build("assets/kernels.cl", false) || !quantized.calibrate(trained, &calibration[0])
+        || !quantized.predict(&images[0], &outputs[0], BATCH_SIZE))
+    {
+        cerr << "Failed to run the int8 network. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
 
-    for (unsigned int i=0; i<buffSizes[14]; i++)
-        L6_syn[i] = 0.01;
+    quantized.memoryReport(cout);
+    return compareFloat(trained, images, outputs, "int8", INT8_TOLERANCE);
+}
 
-    for (unsigned int i=0; i<buffSizes[17]; i++)
-        L7_syn[i] = 0.01;
+/* Answers one batch from a forward-only copy of the trained weights, the way a prediction service would */
+static bool predict(Network& trained, BatchLoader& loader)
+{
+    Network inference(BATCH_SIZE);
 
-    for (unsigned int i=0; i<buffSizes[20]; i++)
-        output[i] = 3;
-                 
-    /* Unmap buffers, so GPU can use them */
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[0], image, 0, NULL, NULL)))
+    if (HALF_PRECISION)
     {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
+        inference.setPrecision(PRECISION_HALF);
     }
 
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[1], L1_syn, 0, NULL, NULL)))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[6], L3_syn, 0, NULL, NULL)))
+    if (MEGAKERNEL)
     {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-        
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[11], L5_syn, 0, NULL, NULL)))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-        
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[14], L6_syn, 0, NULL, NULL)))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-        
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[17], L7_syn, 0, NULL, NULL)))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-        
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[20], output, 0, NULL, NULL)))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    } 
-       
-    /* L1_y = convolution6(image, L1_syn)  <-- Convolution with 6 different filters */
-    firstRows = 32;
-    firstCols = 32;
-    secondRows = 28;
-    secondCols = 28;
-    numFilters = 6;
-    filterSize = 5;
-     
-    globalWorksize3[0] = numFilters;
-    globalWorksize3[1] = secondRows;
-    globalWorksize3[2] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 3, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 4, sizeof(int), (void*)&numFilters));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 5, sizeof(int), (void*)&filterSize));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 6, sizeof(cl_mem), (void*)&memoryObjects[0]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 7, sizeof(cl_mem), (void*)&memoryObjects[1]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[0], 8, sizeof(cl_mem), (void*)&memoryObjects[2]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[0], 3, NULL, globalWorksize3, localWorksize3, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L1_a = sigmoid(L1_y)                <-- 1/1+exp(-L1_y) */
-    firstRows = 28;
-    firstCols = 168;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 2, sizeof(cl_mem), (void*)&memoryObjects[2]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 3, sizeof(cl_mem), (void*)&memoryObjects[3]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[1], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L2_a, L2_y = maxpool(L1_a)            <-- Pools max value from 4 pixels and remember which pixel from four inputs is max */
-    firstRows = 14;
-    firstCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 2, sizeof(cl_mem), (void*)&memoryObjects[3]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 3, sizeof(cl_mem), (void*)&memoryObjects[4]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 4, sizeof(cl_mem), (void*)&memoryObjects[5]));    
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[2], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[2], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[2], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }    
-
-    /* L3_y = convolution16(L2_a, L3_syn) */
-    firstRows = 14;
-    firstCols = 14;
-    secondRows = 10;
-    secondCols = 10;
-    numFilters = 16;
-    filterSize = 5;
-     
-    globalWorksize3[0] = numFilters;
-    globalWorksize3[1] = secondRows;
-    globalWorksize3[2] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 3, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 4, sizeof(int), (void*)&filterSize));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 5, sizeof(cl_mem), (void*)&memoryObjects[5]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 6, sizeof(cl_mem), (void*)&memoryObjects[6]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[3], 7, sizeof(cl_mem), (void*)&memoryObjects[7]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[3], 3, NULL, globalWorksize3, localWorksize3, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        inference.setMegakernel(true);
     }
 
-    /* L3_a = sigmoid(L3_y) */
-    firstRows = 10;
-    firstCols = 160;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 2, sizeof(cl_mem), (void*)&memoryObjects[7]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 3, sizeof(cl_mem), (void*)&memoryObjects[8]));
-   
-    if (!setKernelArgumentsSuccess)
+    if (!buildInference(trained, inference))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[1], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L4_a, L4_y = maxpool(L1_a) */
-    firstRows = 5;
-    firstCols = 80;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 2, sizeof(cl_mem), (void*)&memoryObjects[8]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 3, sizeof(cl_mem), (void*)&memoryObjects[9]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[2], 4, sizeof(cl_mem), (void*)&memoryObjects[10]));    
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[2], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[2], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[2], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L5_y = multiply(L4_a, L5_syn) */
-    firstRows = 1;
-    firstCols = 400;
-    secondCols = 120;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 2, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 3, sizeof(cl_mem), (void*)&memoryObjects[10]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 4, sizeof(cl_mem), (void*)&memoryObjects[11]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 5, sizeof(cl_mem), (void*)&memoryObjects[12]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[4], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[4], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[4], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        return false;
     }
 
-    /* L5_a = sigmoid(L5_y) */
-    firstRows = 1;
-    firstCols = 120;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 2, sizeof(cl_mem), (void*)&memoryObjects[12]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 3, sizeof(cl_mem), (void*)&memoryObjects[13]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[1], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    } 
-    
-    /* L6_y = multiply(L5_a, L6_syn) */
-    firstRows = 1;
-    firstCols = 120;
-    secondCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 2, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 3, sizeof(cl_mem), (void*)&memoryObjects[13]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 4, sizeof(cl_mem), (void*)&memoryObjects[14]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 5, sizeof(cl_mem), (void*)&memoryObjects[15]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[4], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[4], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[4], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
+    inference.memoryReport(cout);
 
-    /* L6_a = sigmoid(L6_y) */
-    firstRows = 1;
-    firstCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 2, sizeof(cl_mem), (void*)&memoryObjects[15]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 3, sizeof(cl_mem), (void*)&memoryObjects[16]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[1], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    } 
-    
-    /* L7_y = multiply(L6_a, L7_syn) */
-    firstRows = 1;
-    firstCols = 84;
-    secondCols = 10;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 2, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 3, sizeof(cl_mem), (void*)&memoryObjects[16]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 4, sizeof(cl_mem), (void*)&memoryObjects[17]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[4], 5, sizeof(cl_mem), (void*)&memoryObjects[18]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[4], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[4], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[4], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
+    vector<float> images(inference.input()->size()), targets(trained.target()->size()), outputs(inference.output()->size());
 
-    /* L7_a = sigmoid(L7_y) */
-    firstRows = 1;
-    firstCols = 10;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 2, sizeof(cl_mem), (void*)&memoryObjects[18]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[1], 3, sizeof(cl_mem), (void*)&memoryObjects[19]));
-   
-    if (!setKernelArgumentsSuccess)
+    if (!loader(0, &images[0], &targets[0]))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[1], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[1], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        return false;
     }
 
-    /* L7_e = subtract(output, L7_a) */
-    firstRows = 1;
-    firstCols = 10;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[5], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[5], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[5], 2, sizeof(cl_mem), (void*)&memoryObjects[20]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[5], 3, sizeof(cl_mem), (void*)&memoryObjects[19]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[5], 4, sizeof(cl_mem), (void*)&memoryObjects[21]));
-           
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[5], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[5], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[5], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L7_g = sigmoid_derivative(L7_a) */
-    firstRows = 1;
-    firstCols = 10;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 2, sizeof(cl_mem), (void*)&memoryObjects[19]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 3, sizeof(cl_mem), (void*)&memoryObjects[22]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[6], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L7_d = pointwise(L7_e, L7_g) */
-    firstRows = 1;
-    firstCols = 10;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 2, sizeof(cl_mem), (void*)&memoryObjects[21]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 3, sizeof(cl_mem), (void*)&memoryObjects[22]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 4, sizeof(cl_mem), (void*)&memoryObjects[23]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[7], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L7_dsyn = transpose_multiply(L6_a, L7_syn) */
-    firstRows = 1;
-    firstCols = 84;
-    secondCols = 10;
-     
-    globalWorksize2[0] = firstCols;
-    globalWorksize2[1] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 2, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 3, sizeof(cl_mem), (void*)&memoryObjects[19]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 4, sizeof(cl_mem), (void*)&memoryObjects[23]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 5, sizeof(cl_mem), (void*)&memoryObjects[24]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[8], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[8], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[8], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L6_e = multiply_transpose(L7_d, L7_syn) */
-    firstRows = 1;
-    firstCols = 10;
-    secondRows = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = secondRows;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 3, sizeof(cl_mem), (void*)&memoryObjects[23]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 4, sizeof(cl_mem), (void*)&memoryObjects[17]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 5, sizeof(cl_mem), (void*)&memoryObjects[25]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[9], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[9], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[9], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L6_g = sigmoid_derivative(L6_a) */
-    firstRows = 1;
-    firstCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 2, sizeof(cl_mem), (void*)&memoryObjects[16]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 3, sizeof(cl_mem), (void*)&memoryObjects[26]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[6], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
+    /* The first call pays for the lazy setup of the driver, the second is the latency a request sees */
+    steady_clock::time_point begin;
 
-    /* L6_d = pointwise(L6_e, L6_g) */
-    firstRows = 1;
-    firstCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 2, sizeof(cl_mem), (void*)&memoryObjects[25]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 3, sizeof(cl_mem), (void*)&memoryObjects[26]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 4, sizeof(cl_mem), (void*)&memoryObjects[27]));
-   
-    if (!setKernelArgumentsSuccess)
+    for (int i = 0; i < 2; i++)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[7], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L6_dsyn = transpose_multiply(L5_a, L6_syn) */
-    firstRows = 1;
-    firstCols = 120;
-    secondCols = 84;
-     
-    globalWorksize2[0] = firstCols;
-    globalWorksize2[1] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 2, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 3, sizeof(cl_mem), (void*)&memoryObjects[13]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 4, sizeof(cl_mem), (void*)&memoryObjects[27]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 5, sizeof(cl_mem), (void*)&memoryObjects[28]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[8], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[8], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[8], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
+        begin = steady_clock::now();
 
-    /* L5_e = multiply_transpose(L6_d, L6_syn) */
-    firstRows = 1;
-    firstCols = 84;
-    secondRows = 120;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = secondRows;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 3, sizeof(cl_mem), (void*)&memoryObjects[27]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 4, sizeof(cl_mem), (void*)&memoryObjects[14]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 5, sizeof(cl_mem), (void*)&memoryObjects[29]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[9], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[9], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[9], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L5_g = sigmoid_derivative(L5_a) */
-    firstRows = 1;
-    firstCols = 120;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 2, sizeof(cl_mem), (void*)&memoryObjects[13]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 3, sizeof(cl_mem), (void*)&memoryObjects[30]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[6], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        if (!inference.predict(&images[0], &outputs[0], BATCH_SIZE))
+        {
+            return false;
+        }
     }
 
-    /* L5_d = pointwise(L5_e, L5_g) */
-    firstRows = 1;
-    firstCols = 120;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 2, sizeof(cl_mem), (void*)&memoryObjects[29]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 3, sizeof(cl_mem), (void*)&memoryObjects[30]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 4, sizeof(cl_mem), (void*)&memoryObjects[31]));
-   
-    if (!setKernelArgumentsSuccess)
+    cout << "Predict latency " << duration_cast<chrono::microseconds> (steady_clock::now() - begin).count() << " us for " << BATCH_SIZE << " samples" << endl;
+    if (HALF_PRECISION && !compareFloat(trained, images, outputs, "Half precision", HALF_TOLERANCE))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        return false;
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[7], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L5_dsyn = transpose_multiply(L4_a, L5_syn) */
-    firstRows = 1;
-    firstCols = 400;
-    secondCols = 120;
-     
-    globalWorksize2[0] = firstCols;
-    globalWorksize2[1] = secondCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 2, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 3, sizeof(cl_mem), (void*)&memoryObjects[10]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 4, sizeof(cl_mem), (void*)&memoryObjects[31]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[8], 5, sizeof(cl_mem), (void*)&memoryObjects[32]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[8], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[8], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[8], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L4_e = multiply_transpose(L5_d, L5_syn) */
-    firstRows = 1;
-    firstCols = 120;
-    secondRows = 400;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = secondRows;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 3, sizeof(cl_mem), (void*)&memoryObjects[31]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 4, sizeof(cl_mem), (void*)&memoryObjects[11]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[9], 5, sizeof(cl_mem), (void*)&memoryObjects[33]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[9], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[9], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[9], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }    
-
-    /* L3_e = maxpool_error(L4_e, L4_y) */
-    firstRows = 5;
-    firstCols = 80;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 2, sizeof(cl_mem), (void*)&memoryObjects[33]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 3, sizeof(cl_mem), (void*)&memoryObjects[9]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 4, sizeof(cl_mem), (void*)&memoryObjects[34]));    
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[10], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[10], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[10], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L3_g = sigmoid_derivative(L3_a) */
-    firstRows = 10;
-    firstCols = 160;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 2, sizeof(cl_mem), (void*)&memoryObjects[8]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 3, sizeof(cl_mem), (void*)&memoryObjects[35]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[6], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L3_d = pointwise(L3_e, L3_g) */
-    firstRows = 10;
-    firstCols = 160;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 2, sizeof(cl_mem), (void*)&memoryObjects[34]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 3, sizeof(cl_mem), (void*)&memoryObjects[35]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 4, sizeof(cl_mem), (void*)&memoryObjects[36]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[7], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L3_dsyn = deconvolution16(L2_a, L3_d) */
-    firstRows = 14;
-    firstCols = 14;
-    secondRows = 10;
-    secondCols = 10;
-    numFilters = 16;
-    filterSize = 5;
-     
-    globalWorksize3[0] = numFilters;
-    globalWorksize3[1] = filterSize;
-    globalWorksize3[2] = filterSize;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 3, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 4, sizeof(int), (void*)&filterSize));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 5, sizeof(cl_mem), (void*)&memoryObjects[5]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 6, sizeof(cl_mem), (void*)&memoryObjects[36]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[11], 7, sizeof(cl_mem), (void*)&memoryObjects[37]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[11], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[11], 3, NULL, globalWorksize3, localWorksize3, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[11], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L2_e = deconvolution16(L3_d, L3_syn) */
-    firstRows = 10;
-    firstCols = 1600;
-    secondRows = 14;
-    secondCols = 84;
-    numFilters = 16;
-     
-    globalWorksize3[0] = 16;
-    globalWorksize3[1] = 10;
-    globalWorksize3[2] = 10;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 3, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 4, sizeof(int), (void*)&filterSize));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 5, sizeof(cl_mem), (void*)&memoryObjects[36]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 6, sizeof(cl_mem), (void*)&memoryObjects[6]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[12], 7, sizeof(cl_mem), (void*)&memoryObjects[38]));        
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[12], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[12], 3, NULL, globalWorksize3, localWorksize3, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[12], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L1_e = maxpool_error(L2_e, L2_y) */
-    firstRows = 14;
-    firstCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 2, sizeof(cl_mem), (void*)&memoryObjects[38]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 3, sizeof(cl_mem), (void*)&memoryObjects[4]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[10], 4, sizeof(cl_mem), (void*)&memoryObjects[39]));    
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[10], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[10], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[10], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L1_g = sigmoid_derivative(L1_a) */
-    firstRows = 28;
-    firstCols = 168;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 2, sizeof(cl_mem), (void*)&memoryObjects[5]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[6], 3, sizeof(cl_mem), (void*)&memoryObjects[40]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[6], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[6], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L1_d = pointwise(L1_e, L1_g) */
-    firstRows = 28;
-    firstCols = 168;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 1, sizeof(int), (void*)&firstCols));      
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 2, sizeof(cl_mem), (void*)&memoryObjects[39]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 3, sizeof(cl_mem), (void*)&memoryObjects[40]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[7], 4, sizeof(cl_mem), (void*)&memoryObjects[41]));
-   
-    if (!setKernelArgumentsSuccess)
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[7], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
+
+    vector<float> calibration(images.size());
+
+    return !INT8_INFERENCE || (loader(1, &calibration[0], &targets[0]) && predictInt8(trained, calibration, images));
+}
+
+/* le_net [train-images-idx3-ubyte train-labels-idx1-ubyte], without them it trains on constant data */
+int main(int argc, char** argv)
+{
+    Network network(BATCH_SIZE);
+    steady_clock::time_point begin, exec, end;
+
+    begin = steady_clock::now();
+
+    addLayers(network);
+
+    if (PROFILE)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[7], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        network.enableProfiling();
     }
-    
-    /* L1_dsyn = back_convolution(image, L1_d) */
-    firstRows = 32;
-    firstCols = 32;
-    secondRows = 28;
-    secondCols = 28;
-    numFilters = 6;
-    filterSize = 5;
-     
-    globalWorksize3[0] = numFilters;
-    globalWorksize3[1] = filterSize;
-    globalWorksize3[2] = filterSize;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 1, sizeof(int), (void*)&firstCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 2, sizeof(int), (void*)&secondRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 3, sizeof(int), (void*)&secondCols));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 4, sizeof(int), (void*)&numFilters));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 5, sizeof(int), (void*)&filterSize));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 6, sizeof(cl_mem), (void*)&memoryObjects[0]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 7, sizeof(cl_mem), (void*)&memoryObjects[41]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[13], 8, sizeof(cl_mem), (void*)&memoryObjects[42]));
-   
-    if (!setKernelArgumentsSuccess)
+
+    if (HALF_PRECISION)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[13], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        network.setPrecision(PRECISION_HALF);
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[13], 3, NULL, globalWorksize3, localWorksize3, 0, NULL, &event)))
+
+    if (SPECIALIZE)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[13], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        network.setSpecialization(true);
     }
-    
-    /* L1_syn = matrix_add(L1_syn, L1_dsyn) */
-    firstRows = 5;
-    firstCols = 30;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 1, sizeof(int), (void*)&firstCols));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 2, sizeof(cl_mem), (void*)&memoryObjects[1]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 3, sizeof(cl_mem), (void*)&memoryObjects[42]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 4, sizeof(cl_mem), (void*)&memoryObjects[1]));   
-   
-    if (!setKernelArgumentsSuccess)
+
+    if (!network.build("assets/kernels.cl", true))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
+        cerr << "Failed to build the network. " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[14], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
+
+    network.memoryReport(cout);
+
+    /* Initialize the weights, the images come through the input pipeline */
+    bool initializeSuccess = true;
+    vector<Tensor*> parameters = network.parameters();
+    size_t imageSize = network.input()->size(), targetSize = network.target()->size();
+    size_t iterations = ITERATIONS;
+    MnistDataset dataset;
+    BatchLoader loader = [imageSize, targetSize](size_t, float* image, float* target)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }
-    
-    /* L3_syn = matrix_add(L3_syn, L3_dsyn) */
-    firstRows = 5;
-    firstCols = 80;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 1, sizeof(int), (void*)&firstCols));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 2, sizeof(cl_mem), (void*)&memoryObjects[6]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 3, sizeof(cl_mem), (void*)&memoryObjects[37]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 4, sizeof(cl_mem), (void*)&memoryObjects[6]));   
-   
-    if (!setKernelArgumentsSuccess)
+        fill(image, image + imageSize, 1.0f);
+        fill(target, target + targetSize, 3.0f);
+        return true;
+    };
+
+    if (argc == 3)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        if (!dataset.open(argv[1], argv[2]))
+        {
+            return 1;
+        }
+
+        iterations = EPOCHS * dataset.batches(BATCH_SIZE);
+        loader = [&dataset](size_t batch, float* image, float* target)
+        {
+            return dataset.load(batch, BATCH_SIZE, 32, 32, CLASSES, image, target);
+        };
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[14], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }    
-    
-    /* L5_syn = matrix_add(L5_syn, L5_dsyn) */
-    firstRows = 400;
-    firstCols = 120;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 1, sizeof(int), (void*)&firstCols));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 2, sizeof(cl_mem), (void*)&memoryObjects[11]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 3, sizeof(cl_mem), (void*)&memoryObjects[32]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 4, sizeof(cl_mem), (void*)&memoryObjects[11]));   
-   
-    if (!setKernelArgumentsSuccess)
+
+    InputPipeline pipeline(network, INPUT_SLOTS, loader);
+
+    for (size_t i = 0; i < parameters.size(); i++)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        initializeSuccess &= network.fill(parameters[i], 0.01);
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[14], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }    
-    
-    /* L6_syn = matrix_add(L6_syn, L6_dsyn) */
-    firstRows = 120;
-    firstCols = 84;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 1, sizeof(int), (void*)&firstCols));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 2, sizeof(cl_mem), (void*)&memoryObjects[14]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 3, sizeof(cl_mem), (void*)&memoryObjects[28]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 4, sizeof(cl_mem), (void*)&memoryObjects[14]));   
-   
-    if (!setKernelArgumentsSuccess)
+
+    if (!initializeSuccess || !pipeline.start(iterations))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
+        cerr << "Failed to initialize the network. " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[14], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
-    {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
-    }    
-    
-    /* L7_syn = matrix_add(L7_syn, L7_dsyn) */
-    firstRows = 84;
-    firstCols = 10;
-     
-    globalWorksize2[0] = firstRows;
-    globalWorksize2[1] = firstCols;
-    
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 0, sizeof(int), (void*)&firstRows));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 1, sizeof(int), (void*)&firstCols));       
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 2, sizeof(cl_mem), (void*)&memoryObjects[17]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 3, sizeof(cl_mem), (void*)&memoryObjects[24]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernels[14], 4, sizeof(cl_mem), (void*)&memoryObjects[17]));   
-   
-    if (!setKernelArgumentsSuccess)
+
+    exec = steady_clock::now();
+
+    for (size_t i = 0; i < iterations; i++)
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        if (!pipeline.train())
+        {
+            cerr << "Failed to enqueue a training step. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
     }
-    
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernels[14], 2, NULL, globalWorksize2, localWorksize2, 0, NULL, &event)))
+
+    if (!network.finish())
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[14], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
 
-    /* Wait for command queue to finish, wait for event and release it */
-    if (!checkSuccess(clFinish(commandQueue)))
+    end = steady_clock::now();
+
+    /* Read results */
+    Tensor* test = network.tensor(TEST_TENSOR);
+    vector<float> res(test->size());
+
+    if (!network.read(test, &res[0]))
     {
-        cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed waiting for kernel execution to finish. " << __FILE__ << ":"<< __LINE__ << endl;
+        cerr << "Failed to read " << TEST_TENSOR << ". " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
-    
-    clWaitForEvents(1, &event);  
-    
-    if (!checkSuccess(clReleaseEvent(event)))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Failed releasing the event object. " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-    
-    /* Map buffer to read results */        
-    cl_float* res = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[TEST_IND], 
-        CL_TRUE, CL_MAP_READ, 0, buffSizes[TEST_IND], 0, NULL, NULL, &errorNumber);
-    
-    if (!checkSuccess(errorNumber))
-    {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Failed to map buffer. " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
-    }
-    
+
     cout << endl << "res: ";
-    for (unsigned int i = 0; i < buffSizes[TEST_IND]; i++)
+    for (unsigned int i = 0; i < res.size(); i++)
     {
         if (i%SIZE == 0)
             cout << endl << i/SIZE << ".\t";
-            
+
         cout << res[i] << "\t";
     }
     cout << endl;
 
-    /* Unmap memory objects */
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[TEST_IND], res, 0, NULL, NULL)))
+    cout << "Prepare time " << duration_cast<chrono::microseconds> (exec - begin).count() << " us" << endl;
+    cout << "Execution time " << duration_cast<chrono::microseconds> (end - exec).count() << " us" << endl;
+
+    if (!predict(network, loader))
+    {
+        cerr << "Failed to predict. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    if (SPECIALIZE)
     {
-       cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
-       cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
-       return 1;
+        cout << endl;
+
+        if (!network.specializationReport(cout))
+        {
+            cerr << "Failed to time the specialised kernels. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
     }
 
-    cleanUpOpenCL(context, commandQueue, program, kernels[0], memoryObjects, numberOfMemoryObjects);
+    if (PROFILE)
+    {
+        cout << endl;
+
+        if (!network.profileReport(cout) || !network.profileTrace(TRACE_FILE))
+        {
+            cerr << "Failed to write the profile. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
+
+        cout << "Trace written to " << TRACE_FILE << endl;
+    }
 }
@@ -0,0 +1,181 @@
+#include "dataset.h"
+#include "cpu_network.h"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+using namespace chrono;
+
+/*
+    examples/le_net on the CPU: the same layers, batch and weights trained by CpuNetwork instead of
+    Network, for boards without a usable OpenCL driver and to put numbers next to the GPU ones.
+    Training and prediction print samples per second, prediction once per thread count up to
+    THREADS, so the scaling of the thread pool shows next to the single thread figure.
+*/
+
+#define TEST_TENSOR "L7_syn"
+#define BATCH_SIZE 16
+#define ITERATIONS 1
+#define SIZE 10
+
+/* Passes over the training set when it is given on the command line */
+#define EPOCHS 1
+#define CLASSES 10
+
+/* 0 uses every hardware thread */
+#define THREADS 0
+
+/* Timed predict() calls per thread count */
+#define PREDICT_REPEATS 10
+
+static void addLayers(CpuNetwork& network)
+{
+    network.addInput(32, 32);
+    network.addConvolution(6, 5);       /* L1 6@28x28 */
+    network.addMaxPool();               /* L2 6@14x14 */
+    network.addConvolution16(16, 5);    /* L3 16@10x10 */
+    network.addMaxPool();               /* L4 16@5x5 */
+    network.addFullyConnected(120);     /* L5 */
+    network.addFullyConnected(84);      /* L6 */
+    network.addFullyConnected(10);      /* L7 */
+}
+
+static double samplesPerSecond(size_t samples, steady_clock::duration time)
+{
+    return samples / max(duration_cast<duration<double> >(time).count(), 1e-9);
+}
+
+/* Forward-only copies of trained with 1, 2, 4 ... threads answer the same batch */
+static bool predict(CpuNetwork& trained, const vector<float>& images)
+{
+    vector<CpuTensor*> from = trained.parameters();
+    vector<size_t> counts;
+
+    for (size_t threads = 1; threads < trained.threads(); threads *= 2)
+    {
+        counts.push_back(threads);
+    }
+
+    counts.push_back(trained.threads());
+
+    for (size_t c = 0; c < counts.size(); c++)
+    {
+        size_t threads = counts[c];
+        CpuNetwork inference(BATCH_SIZE, threads);
+
+        addLayers(inference);
+
+        if (!inference.build(false))
+        {
+            return false;
+        }
+
+        vector<CpuTensor*> to = inference.parameters();
+
+        for (size_t i = 0; i < from.size(); i++)
+        {
+            inference.write(to[i], &from[i]->data[0]);
+        }
+
+        vector<float> outputs(inference.output()->size());
+        steady_clock::time_point begin = steady_clock::now();
+
+        for (int i = 0; i < PREDICT_REPEATS; i++)
+        {
+            if (!inference.predict(&images[0], &outputs[0], BATCH_SIZE))
+            {
+                return false;
+            }
+        }
+
+        cout << "Predict with " << threads << " threads: " << samplesPerSecond(PREDICT_REPEATS * BATCH_SIZE, steady_clock::now() - begin) << " samples/s" << endl;
+    }
+
+    return true;
+}
+
+/* le_net_cpu [train-images-idx3-ubyte train-labels-idx1-ubyte], without them it trains on constant data */
+int main(int argc, char** argv)
+{
+    CpuNetwork network(BATCH_SIZE, THREADS);
+    steady_clock::time_point begin, exec, end;
+
+    begin = steady_clock::now();
+
+    addLayers(network);
+
+    if (!network.build(true))
+    {
+        cerr << "Failed to build the network. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    vector<CpuTensor*> parameters = network.parameters();
+    vector<float> images(network.input()->size(), 1.0f), targets(network.target()->size(), 3.0f);
+    size_t iterations = ITERATIONS;
+    MnistDataset dataset;
+
+    if (argc == 3)
+    {
+        if (!dataset.open(argv[1], argv[2]))
+        {
+            return 1;
+        }
+
+        iterations = EPOCHS * dataset.batches(BATCH_SIZE);
+    }
+
+    for (size_t i = 0; i < parameters.size(); i++)
+    {
+        network.fill(parameters[i], 0.01);
+    }
+
+    cout << "Running on " << network.threads() << " threads" << endl;
+
+    exec = steady_clock::now();
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        if (argc == 3 && !dataset.load(i, BATCH_SIZE, 32, 32, CLASSES, &images[0], &targets[0]))
+        {
+            return 1;
+        }
+
+        if (!network.write(network.input(), &images[0]) || !network.write(network.target(), &targets[0]) || !network.train())
+        {
+            cerr << "Failed to run a training step. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
+    }
+
+    end = steady_clock::now();
+
+    /* Read results */
+    CpuTensor* test = network.tensor(TEST_TENSOR);
+    vector<float> res(test->size());
+
+    network.read(test, &res[0]);
+
+    cout << endl << "res: ";
+    for (unsigned int i = 0; i < res.size(); i++)
+    {
+        if (i%SIZE == 0)
+            cout << endl << i/SIZE << ".\t";
+
+        cout << res[i] << "\t";
+    }
+    cout << endl;
+
+    cout << "Prepare time " << duration_cast<chrono::microseconds> (exec - begin).count() << " us" << endl;
+    cout << "Execution time " << duration_cast<chrono::microseconds> (end - exec).count() << " us" << endl;
+    cout << "Training " << samplesPerSecond(iterations * BATCH_SIZE, end - exec) << " samples/s" << endl;
+
+    if (!predict(network, images))
+    {
+        cerr << "Failed to predict. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+}
@@ -0,0 +1,171 @@
+#include "common.h"
+#include "dataset.h"
+#include "network.h"
+#include "cpu_network.h"
+#include "split_trainer.h"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+using namespace chrono;
+
+/*
+    examples/le_net with every batch shared between the OpenCL device and the CPU cores, see
+    SplitTrainer in framework/split_trainer.h. Each step prints how many samples the device took,
+    the end the samples per second of both sides and of the whole.
+    With HOST_OPENCL the host side is a second Network instead of a CpuNetwork, so two CPU OpenCL
+    devices (POCL for instance) can stand in for the GPU and the cores on a machine without one.
+*/
+
+#define TEST_TENSOR "L7_syn"
+#define BATCH_SIZE 16
+#define ITERATIONS 10
+#define SIZE 10
+
+/* Samples per backward() on either side, the granularity of the split */
+#define MICRO_BATCH 4
+
+/* Passes over the training set when it is given on the command line */
+#define EPOCHS 1
+#define CLASSES 10
+
+/* Set to 1 to run the host share on a second OpenCL context instead of CpuNetwork */
+#define HOST_OPENCL 0
+
+/* Threads of CpuNetwork, 0 uses every hardware thread, one less leaves a core to feed the device */
+#define HOST_THREADS 0
+
+#if HOST_OPENCL
+typedef Network HostNetwork;
+#else
+typedef CpuNetwork HostNetwork;
+#endif
+
+template <class Side>
+static void addLayers(Side& network)
+{
+    network.addInput(32, 32);
+    network.addConvolution(6, 5);       /* L1 6@28x28 */
+    network.addMaxPool();               /* L2 6@14x14 */
+    network.addConvolution16(16, 5);    /* L3 16@10x10 */
+    network.addMaxPool();               /* L4 16@5x5 */
+    network.addFullyConnected(120);     /* L5 */
+    network.addFullyConnected(84);      /* L6 */
+    network.addFullyConnected(10);      /* L7 */
+}
+
+static bool build(Network& network)
+{
+    /* SplitTrainer sums the micro-batches with backward(true) */
+    network.setAccumulation(true);
+
+    return network.build("assets/kernels.cl", true);
+}
+
+static bool build(CpuNetwork& network)
+{
+    return network.build(true);
+}
+
+/* le_net_split [train-images-idx3-ubyte train-labels-idx1-ubyte], without them it trains on constant data */
+int main(int argc, char** argv)
+{
+    Network device(MICRO_BATCH);
+#if HOST_OPENCL
+    HostNetwork host(MICRO_BATCH);
+#else
+    HostNetwork host(MICRO_BATCH, HOST_THREADS);
+#endif
+    steady_clock::time_point begin, exec, end;
+
+    begin = steady_clock::now();
+
+    addLayers(device);
+    addLayers(host);
+
+    if (!build(device) || !build(host))
+    {
+        cerr << "Failed to build the networks. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    /* Only the device weights are initialized, the trainer copies them to the host */
+    bool initializeSuccess = true;
+    vector<Tensor*> parameters = device.parameters();
+    vector<float> images(BATCH_SIZE * 32 * 32, 1.0f), targets(BATCH_SIZE * CLASSES, 3.0f);
+    size_t iterations = ITERATIONS;
+    MnistDataset dataset;
+
+    if (argc == 3)
+    {
+        if (!dataset.open(argv[1], argv[2]))
+        {
+            return 1;
+        }
+
+        iterations = EPOCHS * dataset.batches(BATCH_SIZE);
+    }
+
+    for (size_t i = 0; i < parameters.size(); i++)
+    {
+        initializeSuccess &= device.fill(parameters[i], 0.01);
+    }
+
+    if (!initializeSuccess)
+    {
+        cerr << "Failed to initialize the network. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    SplitTrainer<Network, HostNetwork> trainer(device, host, BATCH_SIZE);
+
+    exec = steady_clock::now();
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        if (argc == 3 && !dataset.load(i, BATCH_SIZE, 32, 32, CLASSES, &images[0], &targets[0]))
+        {
+            return 1;
+        }
+
+        cout << "Step " << i << ": " << trainer.deviceSamples() << " of " << BATCH_SIZE << " samples on the device" << endl;
+
+        if (!trainer.train(&images[0], &targets[0]))
+        {
+            cerr << "Failed to run a training step. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
+    }
+
+    end = steady_clock::now();
+
+    /* Read results */
+    Tensor* test = device.tensor(TEST_TENSOR);
+    vector<float> res(test->size());
+
+    if (!device.read(test, &res[0]))
+    {
+        cerr << "Failed to read " << TEST_TENSOR << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    cout << endl << "res: ";
+    for (unsigned int i = 0; i < res.size(); i++)
+    {
+        if (i%SIZE == 0)
+            cout << endl << i/SIZE << ".\t";
+
+        cout << res[i] << "\t";
+    }
+    cout << endl;
+
+    double seconds = max(duration_cast<duration<double> >(end - exec).count(), 1e-9);
+
+    cout << "Prepare time " << duration_cast<chrono::microseconds> (exec - begin).count() << " us" << endl;
+    cout << "Execution time " << duration_cast<chrono::microseconds> (end - exec).count() << " us" << endl;
+    cout << "Device " << trainer.deviceThroughput() << " samples/s, host " << trainer.hostThroughput()
+         << " samples/s, together " << iterations * BATCH_SIZE / seconds << " samples/s" << endl;
+}
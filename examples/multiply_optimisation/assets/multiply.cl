@@ -1,6 +1,23 @@
+/* Defaults, the autotuner overrides both with -DTS=... -DWPT=... */
+#ifndef TS
 #define TS 8
+#endif
+#ifndef WPT
 #define WPT 4
+#endif
+
+/* Register block of matrix_multiply_blocked, WPTM rows by WPTN columns, WPT x WPT unless given */
+#ifndef WPTM
+#define WPTM WPT
+#endif
+#ifndef WPTN
+#define WPTN WPT
+#endif
+
+/* Rows of the tile a work group of TS x RTS work items covers when every item computes WPT columns */
+#define RTS (TS/WPT)
 // --------------------------------------------------------------------------------------------
+/* -DSPECIALIZE_matrix_multiply -DSHAPE0=M -DSHAPE1=N -DSHAPE2=K compile the sizes in, see ProgramCache in framework/program.h */
 __kernel void matrix_multiply(  const int M,
                                 const int N,
                                 const int K,
@@ -11,14 +28,20 @@ __kernel void matrix_multiply(  const int M,
     const int globalRow = get_global_id(0);
     const int globalCol = get_global_id(1);
     
+#ifdef SPECIALIZE_matrix_multiply
+    const int rows = SHAPE0, depth = SHAPE2;
+#else
+    const int rows = M, depth = K;
+#endif
+    
     float acc = 0.0f;
     
-    for (int k = 0; k < K; k++)
+    for (int k = 0; k < depth; k++)
     {
-        acc += inA[k * M + globalRow] * inB[globalCol * K + k];
+        acc += inA[k * rows + globalRow] * inB[globalCol * depth + k];
     }
     
-    out[globalCol * M + globalRow] = acc;
+    out[globalCol * rows + globalRow] = acc;
 }
 // --------------------------------------------------------------------------------------------
 __kernel void matrix_multiply_tiling(   const int M, 
@@ -60,6 +83,7 @@ __kernel void matrix_multiply_tiling(   const int M,
     out[globalCol * M + globalRow] = acc;
 }
 // --------------------------------------------------------------------------------------------
+// Every work item computes WPT columns, launch with local TS x RTS and global M x N/WPT.
 __kernel void matrix_multiply_less_loads(   const int M,
                                             const int N,
                                             const int K,
@@ -70,7 +94,7 @@ __kernel void matrix_multiply_less_loads(   const int M,
     const int row = get_local_id(0);
     const int col = get_local_id(1);
     const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int globalCol = TS * get_group_id(1) + col;
     
     __local float Asub[TS][TS];
     __local float Bsub[TS][TS];
@@ -90,8 +114,8 @@ __kernel void matrix_multiply_less_loads(   const int M,
             const int tiledRow = TS * t + row;
             const int tiledCol = TS * t + col;
             
-            Asub[col + r * WPT][row] = inA[(tiledCol + r * WPT) * M + globalRow];
-            Bsub[col + r * WPT][row] = inB[(globalCol + r * WPT) * K + tiledRow];
+            Asub[col + r * RTS][row] = inA[(tiledCol + r * RTS) * M + globalRow];
+            Bsub[col + r * RTS][row] = inB[(globalCol + r * RTS) * K + tiledRow];
         }
         
         barrier(CLK_LOCAL_MEM_FENCE);
@@ -100,7 +124,7 @@ __kernel void matrix_multiply_less_loads(   const int M,
         {
             for (int r = 0; r < WPT; r++)
             {
-                acc[r] += Asub[k][row] * Bsub[col + r * WPT][k];
+                acc[r] += Asub[k][row] * Bsub[col + r * RTS][k];
             }
         }
         
@@ -109,12 +133,20 @@ __kernel void matrix_multiply_less_loads(   const int M,
     
     for (int r = 0; r < WPT; r++)
     {
-        out[(globalCol + r * WPT) * M + globalRow] = acc[r];
+        out[(globalCol + r * RTS) * M + globalRow] = acc[r];
     }
 }
 // --------------------------------------------------------------------------------------------
-// NOTE: Still work in progress!!! We should transpose second input matrix.
-__kernel void matrix_multiply_vector(   const int M,
+// Every work item computes a WPTM x WPTN block of a TS x TS tile of out, rows and columns RTSM
+// and RTSN apart so neighbouring work items read neighbouring local memory. The K dimension goes
+// through local memory TS at a time in two buffers: tile t + 1 is loaded while tile t is summed,
+// which leaves one barrier per tile. Anything past M, N or K loads as zero and is not stored, so
+// no dimension has to be a multiple of TS. Launch with local TS/WPTM x TS/WPTN and global
+// M/WPTM x N/WPTN, rounded up to the local size.
+#define RTSM (TS/WPTM)
+#define RTSN (TS/WPTN)
+
+__kernel void matrix_multiply_blocked(  const int M,
                                         const int N,
                                         const int K,
                                         const __global float* inA,
@@ -123,33 +155,129 @@ __kernel void matrix_multiply_vector(   const int M,
 {
     const int row = get_local_id(0);
     const int col = get_local_id(1);
-    const int globalRow = get_global_id(0);
-    const int globalCol = get_global_id(1);
+    const int id = col * RTSM + row;
+    const int firstRow = TS * get_group_id(0);
+    const int firstCol = TS * get_group_id(1);
+    const int numTiles = (K + TS - 1) / TS;
     
-    __local float4 Asub[TS][TS/4];
-    __local float4 Bsub[TS][TS/4];
-
-    const int numTiles = K/TS;       
-    float4 acc = {0.0f, 0.0f, 0.0f, 0.0f};
-
-    for (int t = 0; t < numTiles; t++)
+    __local float Asub[2][TS][TS];
+    __local float Bsub[2][TS][TS];
+    
+    float acc[WPTM][WPTN];
+    
+    for (int wm = 0; wm < WPTM; wm++)
     {
-        const int tiledRow = TS * t + row;
-        const int tiledCol = TS * t + col;
-        
-        Asub[col][row] = vload4((tiledCol * M + globalRow), inA);
-        Bsub[col][row] = vload4((globalCol * K + tiledRow), inB);
+        for (int wn = 0; wn < WPTN; wn++)
+        {
+            acc[wm][wn] = 0.0f;
+        }
+    }
     
-        barrier(CLK_LOCAL_MEM_FENCE);
+    for (int t = 0; t <= numTiles; t++)
+    {
+        /* Tile t goes to buffer t % 2, A down its columns and B down its rows, both contiguous in memory */
+        if (t < numTiles)
+        {
+            for (int i = id; i < TS * TS; i += RTSM * RTSN)
+            {
+                const int a = i % TS, b = i / TS;
+                const int k = TS * t + b;
+                const int kB = TS * t + a;
+                
+                Asub[t % 2][b][a] = (firstRow + a < M && k < K) ? inA[k * M + firstRow + a] : 0.0f;
+                Bsub[t % 2][a][b] = (firstCol + b < N && kB < K) ? inB[(firstCol + b) * K + kB] : 0.0f;
+            }
+        }
         
-        for (int k = 0; k < TS; k++)
+        /* Tile t - 1 is complete, tile t may still be arriving */
+        if (t > 0)
         {
-            acc += Asub[k][row] * Bsub[col][k]; 
+            const int previous = (t - 1) % 2;
+            
+            for (int k = 0; k < TS; k++)
+            {
+                float a[WPTM];
+                
+                for (int wm = 0; wm < WPTM; wm++)
+                {
+                    a[wm] = Asub[previous][k][row + wm * RTSM];
+                }
+                
+                for (int wn = 0; wn < WPTN; wn++)
+                {
+                    const float b = Bsub[previous][k][col + wn * RTSN];
+                    
+                    for (int wm = 0; wm < WPTM; wm++)
+                    {
+                        acc[wm][wn] += a[wm] * b;
+                    }
+                }
+            }
         }
         
-        barrier(CLK_LOCAL_MEM_FENCE);     
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    for (int wn = 0; wn < WPTN; wn++)
+    {
+        const int globalCol = firstCol + col + wn * RTSN;
+        
+        for (int wm = 0; wm < WPTM; wm++)
+        {
+            const int globalRow = firstRow + row + wm * RTSM;
+            
+            if (globalRow < M && globalCol < N)
+            {
+                out[globalCol * M + globalRow] = acc[wm][wn];
+            }
+        }
     }
+}
+// --------------------------------------------------------------------------------------------
+// out (cols x rows) = in^T, packs B for matrix_multiply_vector. Pay it once per weight matrix.
+__kernel void matrix_transpose( const int rows,
+                                const int cols,
+                                const __global float* in,
+                                __global float* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
     
-    vstore4(acc, (globalCol * M + globalRow), out);
+    out[globalRow * cols + globalCol] = in[globalCol * rows + globalRow];
 }
+// --------------------------------------------------------------------------------------------
+// Every work item computes a 4x4 block of out from float4 loads of A and of the transposed B,
+// so for each k the rows of A and the columns of B it needs are both contiguous. No local
+// memory, on Mali it is the same cache as global memory. M and N have to be multiples of 4,
+// launch with global M/4 x N/4.
+__kernel void matrix_multiply_vector(   const int M,
+                                        const int N,
+                                        const int K,
+                                        const __global float* inA,
+                                        const __global float* inBT,
+                                        __global float* out)
+{
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+    
+    float4 acc0 = (float4)(0.0f);
+    float4 acc1 = (float4)(0.0f);
+    float4 acc2 = (float4)(0.0f);
+    float4 acc3 = (float4)(0.0f);
 
+    for (int k = 0; k < K; k++)
+    {
+        const float4 a = vload4(k * (M / 4) + globalRow, inA);
+        const float4 b = vload4(k * (N / 4) + globalCol, inBT);
+        
+        acc0 += a * b.x;
+        acc1 += a * b.y;
+        acc2 += a * b.z;
+        acc3 += a * b.w;
+    }
+    
+    vstore4(acc0, (4 * globalCol + 0) * (M / 4) + globalRow, out);
+    vstore4(acc1, (4 * globalCol + 1) * (M / 4) + globalRow, out);
+    vstore4(acc2, (4 * globalCol + 2) * (M / 4) + globalRow, out);
+    vstore4(acc3, (4 * globalCol + 3) * (M / 4) + globalRow, out);
+}
@@ -1,18 +1,73 @@
 #include "common.h"
 #include "image.h"
+#include "program.h"
+#include "tuner.h"
 
 #include <CL/cl.h>
 #include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <vector>
 
-#define SIZE 128
-#define LOCAL_SIZE 16
-#define WORK_SIZE(X, Y) ((X) < (Y) ? (X) : (Y/2))
-#define WPT 1
+/*
+    out (ROWS x COLS) = A (ROWS x DEPTH) * B (DEPTH x COLS), column major. The default is the shape
+    of L5 in examples/le_net for a batch of 16, which no tile size above 8 divides; the tuner then
+    only has matrix_multiply_blocked left above TS=8, the one variant that handles the edges.
+*/
+#define ROWS 120
+#define COLS 16
+#define DEPTH 400
+#define KERNELS_FILE "assets/multiply.cl"
+#define TUNING_CACHE "tuning.cache"
+
+/* Name a kernel of multiply.cl here to skip the tuner, it then runs with the default TS and WPT; all but
+   matrix_multiply_blocked need TS to divide ROWS, COLS and DEPTH */
+#define KERNEL_NAME ""
+#define DEFAULT_TS 8
+#define DEFAULT_WPT 4
+
+/* Launches of the naive matrix_multiply, generic and specialised for (ROWS, COLS, DEPTH), the fastest one counts */
+#define SPECIALIZATION_REPEATS 10
 
 using namespace std;
 using namespace chrono;
 
+/* Arguments as for the reference run, out gets the product */
+static bool timeNaive(cl_command_queue commandQueue, cl_kernel kernel, int M, int N, int K, cl_mem* memoryObjects, double* microseconds)
+{
+    size_t worksize[2] = {(size_t)M, (size_t)N};
+    bool setKernelArgumentsSuccess = true;
+
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 0, sizeof(int), (void*)&M));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 1, sizeof(int), (void*)&N));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 2, sizeof(int), (void*)&K));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&memoryObjects[0]));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 4, sizeof(cl_mem), (void*)&memoryObjects[1]));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 5, sizeof(cl_mem), (void*)&memoryObjects[4]));
+
+    if (!setKernelArgumentsSuccess)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < SPECIALIZATION_REPEATS; i++)
+    {
+        steady_clock::time_point begin = steady_clock::now();
+
+        if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, worksize, NULL, 0, NULL, NULL))
+            || !checkSuccess(clFinish(commandQueue)))
+        {
+            return false;
+        }
+
+        double elapsed = duration<double, micro>(steady_clock::now() - begin).count();
+        *microseconds = i == 0 ? elapsed : min(*microseconds, elapsed);
+    }
+
+    return true;
+}
+
 int main(void)
 {
     cl_context context = 0;
@@ -20,23 +75,29 @@ int main(void)
     cl_program program = 0;
     cl_device_id device = 0;
     cl_kernel kernel = 0;
+    cl_kernel transposeKernel = 0;
+    cl_kernel referenceKernel = 0;
     cl_event event = 0;
     
-    int numberOfMemoryObjects = 3;
-    cl_mem memoryObjects[3] = {0, 0, 0};
+    /* A, B, C, B transposed for matrix_multiply_vector and the result of the naive matrix_multiply */
+    int numberOfMemoryObjects = 5;
+    cl_mem memoryObjects[5] = {0, 0, 0, 0, 0};
     cl_int errorNumber;
     
     size_t M, N, K;
-    M = N = K = SIZE;
+    M = ROWS;
+    N = COLS;
+    K = DEPTH;
     
-    size_t globalWorksize[2] = {M, N/WPT};
-    const size_t localWorksize[2] = {WORK_SIZE(LOCAL_SIZE, SIZE), WORK_SIZE(LOCAL_SIZE, SIZE)/WPT};
-    cout << WORK_SIZE(LOCAL_SIZE, SIZE);
-    cl_int arraySize = SIZE * SIZE;
+    GemmConfig config;
+    size_t globalWorksize[2];
+    cl_int arraySize = M * N;
     size_t bufferSize = arraySize * sizeof(cl_float);
+    size_t firstSize = M * K * sizeof(cl_float);
+    size_t secondSize = K * N * sizeof(cl_float);
     bool setKernelArgumentsSuccess = true;
     
-    steady_clock::time_point begin, exec, end;
+    steady_clock::time_point begin, pack, exec, end;
 
     /* Remmember start time */
     begin = steady_clock::now();
@@ -56,33 +117,55 @@ int main(void)
         return 1;
     }
 
-    if (!createProgram(context, device, "assets/multiply.cl", &program))
+    /* Pick the fastest variant for this size, only the first run on a device pays for the sweep */
+    if (string(KERNEL_NAME).empty())
     {
-        cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
-        cerr << "Failed to create OpenCL program." << __FILE__ << ":"<< __LINE__ << endl;
-        return 1;
+        if (!tuneMatrixMultiply(context, device, KERNELS_FILE, TUNING_CACHE, M, N, K, &config))
+        {
+            cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
+            cerr << "Failed to tune matrix multiply. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
     }
+    else
+    {
+        config.kernelName = KERNEL_NAME;
+        config.tileSize = DEFAULT_TS;
+        config.workPerThread = DEFAULT_WPT;
+        matrixMultiplyLocalSize(config.kernelName, DEFAULT_TS, DEFAULT_WPT, config.local);
+        config.time = 0;
+    }
+
+    cout << "Using " << config.kernelName << " TS=" << config.tileSize << " WPT=" << config.workPerThread
+         << " local " << config.local[0] << "x" << config.local[1] << " (" << config.time << " us when tuned)" << endl;
 
-    kernel = clCreateKernel(program, "matrix_multiply_less_loads", &errorNumber);
-    if (!checkSuccess(errorNumber))
+    if (!createMatrixMultiply(context, device, KERNELS_FILE, config, &program, &kernel))
     {
         cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
         cerr << "Failed to create OpenCL kernel. " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
+
+    matrixMultiplyGlobalSize(config, M, N, globalWorksize);
     
     /* Ask the OpenCL implementation to allocate buffers for the data */     
     bool createMemoryObjectsSuccess = true;
     
-    memoryObjects[0] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bufferSize, NULL, &errorNumber);
+    memoryObjects[0] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, firstSize, NULL, &errorNumber);
     createMemoryObjectsSuccess &= checkSuccess(errorNumber);
     
-    memoryObjects[1] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bufferSize, NULL, &errorNumber);
+    memoryObjects[1] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, secondSize, NULL, &errorNumber);
     createMemoryObjectsSuccess &= checkSuccess(errorNumber);
     
     memoryObjects[2] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bufferSize, NULL, &errorNumber);
     createMemoryObjectsSuccess &= checkSuccess(errorNumber);
     
+    memoryObjects[3] = clCreateBuffer(context, CL_MEM_READ_WRITE, secondSize, NULL, &errorNumber);
+    createMemoryObjectsSuccess &= checkSuccess(errorNumber);
+    
+    memoryObjects[4] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bufferSize, NULL, &errorNumber);
+    createMemoryObjectsSuccess &= checkSuccess(errorNumber);
+    
     if (!createMemoryObjectsSuccess)
     {
         cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
@@ -94,17 +177,21 @@ int main(void)
     bool mapMemoryObjectsSuccess = true;
     
     cl_float* A = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[0], 
-        CL_TRUE, CL_MAP_WRITE, 0, bufferSize, 0, NULL, NULL, &errorNumber);
+        CL_TRUE, CL_MAP_WRITE, 0, firstSize, 0, NULL, NULL, &errorNumber);
     mapMemoryObjectsSuccess &= checkSuccess(errorNumber);
 
     cl_float* B = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[1], 
-        CL_TRUE, CL_MAP_WRITE, 0, bufferSize, 0, NULL, NULL, &errorNumber);
+        CL_TRUE, CL_MAP_WRITE, 0, secondSize, 0, NULL, NULL, &errorNumber);
     
-    /* Initialize the data */
-    for (int i = 0; i < arraySize; i++)
+    /* Initialize the data, all ones would hide transposed indices */
+    for (size_t i = 0; i < M * K; i++)
+    {
+       A[i] = (i % 7) * 0.25f;
+    }
+
+    for (size_t i = 0; i < K * N; i++)
     {
-       A[i] = 1.0f;
-       B[i] = 1.0f;
+       B[i] = (i % 5) * 0.5f - 1.0f;
     }
     
     /* Unmap buffers, so GPU can use them */
@@ -122,12 +209,41 @@ int main(void)
        return 1;
     }
 
+    pack = steady_clock::now();
+
+    /* Pack B once, with weights this is paid per weight update and not per multiply */
+    if (matrixMultiplyTransposesB(config))
+    {
+        size_t transposeWorksize[2] = {K, N};
+
+        transposeKernel = clCreateKernel(program, "matrix_transpose", &errorNumber);
+        setKernelArgumentsSuccess &= checkSuccess(errorNumber);
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(transposeKernel, 0, sizeof(int), (void*)&K));
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(transposeKernel, 1, sizeof(int), (void*)&N));
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(transposeKernel, 2, sizeof(cl_mem), (void*)&memoryObjects[1]));
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(transposeKernel, 3, sizeof(cl_mem), (void*)&memoryObjects[3]));
+
+        if (!setKernelArgumentsSuccess
+            || !checkSuccess(clEnqueueNDRangeKernel(commandQueue, transposeKernel, 2, NULL, transposeWorksize, NULL, 0, NULL, NULL))
+            || !checkSuccess(clFinish(commandQueue)))
+        {
+            clReleaseKernel(transposeKernel);
+            cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
+            cerr << "Failed to transpose B. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
+
+        clReleaseKernel(transposeKernel);
+    }
+
     /* Set the kernel arguments for first matrix multiply and enqueue the kernel */
+    cl_mem* secondMatrix = matrixMultiplyTransposesB(config) ? &memoryObjects[3] : &memoryObjects[1];
+
     setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 0, sizeof(int), (void*)&M));
     setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 1, sizeof(int), (void*)&N));
     setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 2, sizeof(int), (void*)&K));
     setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&memoryObjects[0]));
-    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 4, sizeof(cl_mem), (void*)&memoryObjects[1]));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 4, sizeof(cl_mem), (void*)secondMatrix));
     setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, 5, sizeof(cl_mem), (void*)&memoryObjects[2]));
    
     if (!setKernelArgumentsSuccess)
@@ -140,7 +256,7 @@ int main(void)
     /* Kernel is pushed to queue, remmember time */
     exec = steady_clock::now();
 
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalWorksize, localWorksize, 0, NULL, &event)))
+    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalWorksize, config.local, 0, NULL, &event)))
     {
         cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
         cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
@@ -166,37 +282,118 @@ int main(void)
        return 1;
     }
     
-    /* Map buffer to read results */
+    /* Naive matrix_multiply on the same data is the reference */
+    size_t referenceWorksize[2] = {M, N};
+
+    referenceKernel = clCreateKernel(program, "matrix_multiply", &errorNumber);
+    setKernelArgumentsSuccess &= checkSuccess(errorNumber);
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(referenceKernel, 0, sizeof(int), (void*)&M));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(referenceKernel, 1, sizeof(int), (void*)&N));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(referenceKernel, 2, sizeof(int), (void*)&K));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(referenceKernel, 3, sizeof(cl_mem), (void*)&memoryObjects[0]));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(referenceKernel, 4, sizeof(cl_mem), (void*)&memoryObjects[1]));
+    setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(referenceKernel, 5, sizeof(cl_mem), (void*)&memoryObjects[4]));
+
+    if (!setKernelArgumentsSuccess
+        || !checkSuccess(clEnqueueNDRangeKernel(commandQueue, referenceKernel, 2, NULL, referenceWorksize, NULL, 0, NULL, NULL)))
+    {
+        clReleaseKernel(referenceKernel);
+        cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
+        cerr << "Failed enqueuing the reference kernel. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    clReleaseKernel(referenceKernel);
+
+    /* Map buffers to read results */
+    bool mapResultsSuccess = true;
+
     cl_float* C = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[2], 
         CL_TRUE, CL_MAP_READ, 0, bufferSize, 0, NULL, NULL, &errorNumber);
+    mapResultsSuccess &= checkSuccess(errorNumber);
+
+    cl_float* reference = (cl_float*)clEnqueueMapBuffer(commandQueue, memoryObjects[4], 
+        CL_TRUE, CL_MAP_READ, 0, bufferSize, 0, NULL, NULL, &errorNumber);
+    mapResultsSuccess &= checkSuccess(errorNumber);
     
-    if (!checkSuccess(errorNumber))
+    if (!mapResultsSuccess)
     {
        cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
        cerr << "Failed to map buffer. " << __FILE__ << ":"<< __LINE__ << endl;
        return 1;
     }
 
-    cout << "C: " << endl;
+    int errors = 0;
     for (int i = 0; i < arraySize; i++)
     {
-/*
-        if (C[i] != K)
-            cout << "Error, result is " << C[i] << " not a " << K << " at index " << i << endl;
-*/
-        cout << "i= " << i << " " << C[i] << endl;
-
+        if (fabs(C[i] - reference[i]) > 1e-3f * (fabs(reference[i]) + 1))
+        {
+            if (errors < 10)
+                cout << "Error, result is " << C[i] << " not a " << reference[i] << " at index " << i << endl;
+            errors++;
+        }
     }
+
+    cout << config.kernelName << (errors == 0 ? " matches" : " does not match") << " matrix_multiply";
+    cout << " (" << errors << " of " << arraySize << " elements differ)" << endl;
     
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[2], C, 0, NULL, NULL)))
+    bool unmapResultsSuccess = true;
+
+    unmapResultsSuccess &= checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[2], C, 0, NULL, NULL));
+    unmapResultsSuccess &= checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[4], reference, 0, NULL, NULL));
+
+    if (!unmapResultsSuccess)
     {
        cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
        cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
        return 1;
     }
     
+    /* The naive kernel again with M, N and K compiled in, which lets the K loop unroll */
+    ProgramCache variants;
+    string options = "-DTS=" + to_string(config.tileSize) + " -DWPT=" + to_string(config.workPerThread);
+    vector<int> shape = {(int)M, (int)N, (int)K};
+    cl_kernel genericKernel = 0, specializedKernel = 0;
+    bool specialized = false;
+    double genericTime = 0, specializedTime = 0;
+
+    genericKernel = clCreateKernel(program, "matrix_multiply", &errorNumber);
+
+    bool specializationSuccess = checkSuccess(errorNumber) && variants.open(context, device, KERNELS_FILE, options, program);
+
+    if (specializationSuccess)
+    {
+        specializedKernel = variants.createKernel("matrix_multiply", shape, &specialized);
+    }
+
+    specializationSuccess &= specializedKernel != 0
+        && timeNaive(commandQueue, genericKernel, M, N, K, memoryObjects, &genericTime)
+        && timeNaive(commandQueue, specializedKernel, M, N, K, memoryObjects, &specializedTime);
+
+    if (genericKernel != 0)
+    {
+        clReleaseKernel(genericKernel);
+    }
+
+    if (specializedKernel != 0)
+    {
+        clReleaseKernel(specializedKernel);
+    }
+
+    if (!specializationSuccess)
+    {
+        cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
+        cerr << "Failed to time the specialised matrix_multiply. " << __FILE__ << ":"<< __LINE__ << endl;
+        return 1;
+    }
+
+    cout << "matrix_multiply " << (specialized ? "specialised" : "generic, the variant failed to build,") << " for "
+         << M << "x" << N << "x" << K << ": " << specializedTime << " us, generic " << genericTime << " us, speedup "
+         << genericTime / max(specializedTime, 1e-3) << endl;
+
     /* Print timming information */
-    cout << "Prepare time " << duration_cast<chrono::microseconds> (exec - begin).count() << " us" << endl;
+    cout << "Prepare time " << duration_cast<chrono::microseconds> (pack - begin).count() << " us" << endl;
+    cout << "Pack time " << duration_cast<chrono::microseconds> (exec - pack).count() << " us" << endl;
     cout << "Execution time " << duration_cast<chrono::microseconds> (end - exec).count() << " us" << endl;
 
     cleanUpOpenCL(context, commandQueue, program, kernel, memoryObjects, numberOfMemoryObjects);
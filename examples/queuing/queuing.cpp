@@ -16,7 +16,9 @@ int main(void)
     cl_program program = 0;
     cl_device_id device = 0;
     cl_kernel kernelAB = 0, kernelBC = 0, kernelCA = 0;
-    cl_event event = 0;
+    cl_event unmapEvents[3] = {0, 0, 0};
+    cl_event events[3] = {0, 0, 0};
+    cl_command_queue_properties queueProperties = 0;
     
     int numberOfMemoryObjects = 3;
     cl_mem memoryObjects[3] = {0, 0, 0};
@@ -46,6 +48,23 @@ int main(void)
         return 1;
     }
 
+    /* Out-of-order queues only order what the wait lists order, which is what the events below are for */
+    clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(queueProperties), &queueProperties, NULL);
+
+    if (queueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+    {
+        clReleaseCommandQueue(commandQueue);
+        commandQueue = clCreateCommandQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &errorNumber);
+
+        if (!checkSuccess(errorNumber))
+        {
+            commandQueue = 0;
+            cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
+            cerr << "Failed to create the out-of-order command queue. " << __FILE__ << ":"<< __LINE__ << endl;
+            return 1;
+        }
+    }
+
     if (!createProgram(context, device, "assets/multiply.cl", &program))
     {
         cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
@@ -119,21 +138,21 @@ int main(void)
     }
     
     /* Unmap buffers, so GPU can use them */
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[0], A, 0, NULL, NULL)))
+    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[0], A, 0, NULL, &unmapEvents[0])))
     {
        cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
        cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
        return 1;
     }
 
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[1], B, 0, NULL, NULL)))
+    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[1], B, 0, NULL, &unmapEvents[1])))
     {
        cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
        cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
        return 1;
     }
     
-    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[2], C, 0, NULL, NULL)))
+    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, memoryObjects[2], C, 0, NULL, &unmapEvents[2])))
     {
        cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
        cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
@@ -155,7 +174,8 @@ int main(void)
         return 1;
     }
 
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernelAB, 2, NULL, globalWorksize, localWorksize, 0, NULL, &event)))
+    /* C = A * B needs all three buffers unmapped */
+    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernelAB, 2, NULL, globalWorksize, localWorksize, 3, unmapEvents, &events[0])))
     {
         cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
         cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
@@ -177,7 +197,8 @@ int main(void)
         return 1;
     }
     
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernelBC, 2, NULL, globalWorksize, localWorksize, 0, NULL, &event)))
+    /* A = B * C reads the C written above and overwrites the A it read */
+    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernelBC, 2, NULL, globalWorksize, localWorksize, 1, &events[0], &events[1])))
     {
         cleanUpOpenCL(context, commandQueue, program, kernelBC, memoryObjects, numberOfMemoryObjects);
         cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
@@ -199,27 +220,35 @@ int main(void)
         return 1;
     }
     
-    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernelCA, 2, NULL, globalWorksize, localWorksize, 0, NULL, &event)))
+    /* B = C * A reads the A written above and overwrites the B both earlier products read */
+    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernelCA, 2, NULL, globalWorksize, localWorksize, 1, &events[1], &events[2])))
     {
         cleanUpOpenCL(context, commandQueue, program, kernelBC, memoryObjects, numberOfMemoryObjects);
         cerr << "Failed enqueuing the kernel. " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
 
-    /* Wait for command queue to finish, wait for event and release it */
-    if (!checkSuccess(clFinish(commandQueue)))
+    /* The last product depends on every other command, so waiting for it waits for them all */
+    if (!checkSuccess(clWaitForEvents(1, &events[2])))
     {
         cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
         cerr << "Failed waiting for kernel execution to finish. " << __FILE__ << ":"<< __LINE__ << endl;
         return 1;
     }
     
-    clWaitForEvents(1 , &event);    
+    /* Release every event only once nothing can wait on it anymore */
+    bool releaseEventsSuccess = true;
+    
+    for (int i = 0; i < 3; i++)
+    {
+        releaseEventsSuccess &= checkSuccess(clReleaseEvent(unmapEvents[i]));
+        releaseEventsSuccess &= checkSuccess(clReleaseEvent(events[i]));
+    }
     
-    if (!checkSuccess(clReleaseEvent(event)))
+    if (!releaseEventsSuccess)
     {
        cleanUpOpenCL(context, commandQueue, program, kernelAB, memoryObjects, numberOfMemoryObjects);
-       cerr << "Failed releasing the event object. " << __FILE__ << ":"<< __LINE__ << endl;
+       cerr << "Failed releasing the event objects. " << __FILE__ << ":"<< __LINE__ << endl;
        return 1;
     }
     
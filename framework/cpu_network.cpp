@@ -0,0 +1,753 @@
+#include "cpu_network.h"
+#include "simd.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+CpuNetwork::CpuNetwork(size_t batchSize, size_t threads)
+    : batchSize(batchSize), pool(threads), built(false), optimizerSteps(0), targetTensor(NULL)
+{
+    Optimizer defaults = {OPTIMIZER_SGD, 1.0f, 0.9f, 0.999f, 1e-8f, 0.0f};
+
+    optimizer = defaults;
+}
+
+CpuNetwork::~CpuNetwork()
+{
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        delete tensors[i];
+    }
+}
+
+void CpuNetwork::addInput(size_t rows, size_t cols)
+{
+    CpuLayer layer = CpuLayer();
+
+    layer.type = LAYER_INPUT;
+    layer.outMaps = 1;
+    layer.outRows = rows;
+    layer.outCols = cols;
+    layers.push_back(layer);
+}
+
+void CpuNetwork::addConvolution(int numFilters, int filterSize)
+{
+    CpuLayer layer = CpuLayer();
+
+    layer.type = LAYER_CONVOLUTION;
+    layer.numFilters = numFilters;
+    layer.filterSize = filterSize;
+    layers.push_back(layer);
+}
+
+void CpuNetwork::addConvolution16(int numFilters, int filterSize)
+{
+    CpuLayer layer = CpuLayer();
+
+    layer.type = LAYER_CONVOLUTION16;
+    layer.numFilters = numFilters;
+    layer.filterSize = filterSize;
+    layers.push_back(layer);
+}
+
+void CpuNetwork::addMaxPool()
+{
+    CpuLayer layer = CpuLayer();
+
+    layer.type = LAYER_MAXPOOL;
+    layers.push_back(layer);
+}
+
+void CpuNetwork::addFullyConnected(int outputs)
+{
+    CpuLayer layer = CpuLayer();
+
+    layer.type = LAYER_FULLY_CONNECTED;
+    layer.outMaps = 1;
+    layer.outRows = outputs;
+    layer.outCols = 1;
+    layers.push_back(layer);
+}
+
+/* Call before build() */
+void CpuNetwork::setOptimizer(const Optimizer& settings)
+{
+    optimizer = settings;
+}
+
+bool CpuNetwork::build(bool training)
+{
+    if (built)
+    {
+        cerr << "Network is already built. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (batchSize == 0)
+    {
+        cerr << "Network needs a batch of at least one sample. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (layers.size() < 2 || layers[0].type != LAYER_INPUT)
+    {
+        cerr << "Network needs an input layer followed by at least one layer. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (!buildLayer(i, training))
+        {
+            return false;
+        }
+    }
+
+    if (training)
+    {
+        targetTensor = createTensor("output", layers.back().a->rows, layers.back().a->cols);
+    }
+
+    built = true;
+    return resetOptimizer();
+}
+
+CpuTensor* CpuNetwork::createTensor(const string& name, size_t rows, size_t cols)
+{
+    CpuTensor* tensor = new CpuTensor;
+
+    tensor->name = name;
+    tensor->rows = rows;
+    tensor->cols = cols;
+    tensor->data.assign(rows * cols, 0.0f);
+    tensors.push_back(tensor);
+
+    return tensor;
+}
+
+/* Same shapes and tensor names as Network::buildLayer(), minus the tensors only the kernels need */
+bool CpuNetwork::buildLayer(size_t index, bool training)
+{
+    CpuLayer& layer = layers[index];
+    string prefix = "L" + to_string(index) + "_";
+
+    if (layer.type == LAYER_INPUT)
+    {
+        layer.a = createTensor("image", layer.outRows, batchSize * layer.outMaps * layer.outCols);
+        return true;
+    }
+
+    const CpuLayer& previous = layers[index - 1];
+    size_t synRows = 0, synCols = 0;
+
+    switch (layer.type)
+    {
+    case LAYER_CONVOLUTION:
+    case LAYER_CONVOLUTION16:
+        if (layer.type == LAYER_CONVOLUTION && previous.outMaps != 1)
+        {
+            cerr << "Layer " << index << ": convolution expects a single input map. " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+        layer.outMaps = layer.numFilters;
+        layer.outRows = previous.outRows - layer.filterSize + 1;
+        layer.outCols = previous.outCols - layer.filterSize + 1;
+        synRows = layer.filterSize;
+        synCols = layer.numFilters * layer.filterSize;
+        break;
+
+    case LAYER_MAXPOOL:
+        if (previous.outRows % 2 != 0 || previous.outCols % 2 != 0)
+        {
+            cerr << "Layer " << index << ": maxpool expects even sized maps. " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+        layer.outMaps = previous.outMaps;
+        layer.outRows = previous.outRows / 2;
+        layer.outCols = previous.outCols / 2;
+        break;
+
+    case LAYER_FULLY_CONNECTED:
+        synRows = previous.outRows * previous.outMaps * previous.outCols;
+        synCols = layer.outRows;
+        break;
+
+    default:
+        cerr << "Layer " << index << ": input layer can only be the first one. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    size_t rows = layer.outRows;
+    size_t cols = batchSize * layer.outMaps * layer.outCols;
+
+    layer.a = createTensor(prefix + "a", rows, cols);
+
+    if (layer.type == LAYER_MAXPOOL && training)
+    {
+        layer.ind = createTensor(prefix + "ind", rows, cols);
+    }
+    else if (layer.type != LAYER_MAXPOOL)
+    {
+        layer.syn = createTensor(prefix + "syn", synRows, synCols);
+
+        if (training)
+        {
+            layer.dsyn = createTensor(prefix + "dsyn", synRows, synCols);
+        }
+    }
+
+    if (training)
+    {
+        layer.e = createTensor(prefix + "e", rows, cols);
+    }
+
+    return true;
+}
+
+static void sigmoid(float* values, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        values[i] = 1 / (1 + exp(-values[i]));
+    }
+}
+
+bool CpuNetwork::forward()
+{
+    if (!built)
+    {
+        cerr << "Network is not built. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    for (size_t i = 1; i < layers.size(); i++)
+    {
+        forwardLayer(i);
+    }
+
+    return true;
+}
+
+void CpuNetwork::forwardLayer(size_t index)
+{
+    CpuLayer& layer = layers[index];
+    const CpuLayer& previous = layers[index - 1];
+    size_t inRows = previous.outRows, inCols = previous.outCols, inMaps = previous.outMaps;
+    size_t outRows = layer.outRows, outCols = layer.outCols;
+    const float* in = &previous.a->data[0];
+    float* out = &layer.a->data[0];
+
+    switch (layer.type)
+    {
+    case LAYER_CONVOLUTION:
+    case LAYER_CONVOLUTION16:
+    {
+        /* One output map per item, filter f sees input map f % inMaps, which is 0 for a plain convolution */
+        size_t numFilters = layer.numFilters, size = layer.filterSize;
+        const float* syn = &layer.syn->data[0];
+
+        pool.run(batchSize * numFilters, [&](size_t begin, size_t end)
+        {
+            for (size_t map = begin; map < end; map++)
+            {
+                size_t sample = map / numFilters, filter = map % numFilters;
+                const float* input = in + (sample * inMaps + filter % inMaps) * inRows * inCols;
+                const float* weights = syn + filter * size * size;
+                float* output = out + map * outRows * outCols;
+
+                std::fill(output, output + outRows * outCols, 0.0f);
+
+                /* Every tap adds a shifted input column to an output column */
+                for (size_t col = 0; col < outCols; col++)
+                {
+                    for (size_t k = 0; k < size; k++)
+                    {
+                        for (size_t r = 0; r < size; r++)
+                        {
+                            axpy(weights[k * size + r], input + (col + k) * inRows + r, output + col * outRows, outRows);
+                        }
+                    }
+                }
+
+                sigmoid(output, outRows * outCols);
+            }
+        });
+        break;
+    }
+    case LAYER_MAXPOOL:
+    {
+        /* First maximum wins and ind numbers the window as the maxpool kernel does */
+        size_t rows = layer.a->rows;
+        size_t offsets[4] = {0, 1, 2 * rows, 2 * rows + 1};
+        float* ind = layer.ind != NULL ? &layer.ind->data[0] : NULL;
+
+        pool.run(layer.a->cols, [&](size_t begin, size_t end)
+        {
+            for (size_t col = begin; col < end; col++)
+            {
+                for (size_t row = 0; row < rows; row++)
+                {
+                    const float* window = in + 2 * col * 2 * rows + 2 * row;
+                    int winner = 0;
+
+                    for (int i = 1; i < 4; i++)
+                    {
+                        if (window[offsets[i]] > window[offsets[winner]])
+                        {
+                            winner = i;
+                        }
+                    }
+
+                    out[col * rows + row] = window[offsets[winner]];
+
+                    if (ind != NULL)
+                    {
+                        ind[col * rows + row] = winner;
+                    }
+                }
+            }
+        });
+        break;
+    }
+    case LAYER_FULLY_CONNECTED:
+    {
+        /* a (outputs x batch) = sigmoid(syn^T * a), one neuron per item */
+        size_t inputs = layer.syn->rows;
+        const float* syn = &layer.syn->data[0];
+
+        pool.run(outRows, [&](size_t begin, size_t end)
+        {
+            for (size_t neuron = begin; neuron < end; neuron++)
+            {
+                for (size_t sample = 0; sample < batchSize; sample++)
+                {
+                    float y = dot(syn + neuron * inputs, in + sample * inputs, inputs);
+                    out[sample * outRows + neuron] = 1 / (1 + exp(-y));
+                }
+            }
+        });
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool CpuNetwork::train()
+{
+    return backward() && update();
+}
+
+bool CpuNetwork::backward(bool accumulate)
+{
+    if (targetTensor == NULL)
+    {
+        cerr << "Network was not built for training. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!forward())
+    {
+        return false;
+    }
+
+    CpuLayer& last = layers.back();
+
+    for (size_t i = 0; i < last.e->size(); i++)
+    {
+        last.e->data[i] = targetTensor->data[i] - last.a->data[i];
+    }
+
+    /* backwardLayer() overwrites dsyn, an accumulating pass keeps the earlier sums aside */
+    vector<vector<float> > earlier;
+
+    for (size_t i = 1; i < layers.size() && accumulate; i++)
+    {
+        if (layers[i].dsyn != NULL)
+        {
+            earlier.push_back(layers[i].dsyn->data);
+        }
+    }
+
+    for (size_t i = layers.size() - 1; i > 0; i--)
+    {
+        backwardLayer(i);
+    }
+
+    for (size_t i = 1, j = 0; i < layers.size() && accumulate; i++)
+    {
+        if (layers[i].dsyn != NULL)
+        {
+            axpy(1.0f, &earlier[j++][0], &layers[i].dsyn->data[0], layers[i].dsyn->size());
+        }
+    }
+
+    return true;
+}
+
+/* Every error of backward() was propagated with the weights of this step, only now they change */
+bool CpuNetwork::update()
+{
+    if (targetTensor == NULL)
+    {
+        cerr << "Network was not built for training. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    optimizerSteps++;
+
+    for (size_t i = 1; i < layers.size(); i++)
+    {
+        if (layers[i].syn != NULL)
+        {
+            updateLayer(layers[i]);
+        }
+    }
+
+    return true;
+}
+
+/* Turns the error of layer index into its delta, then writes dsyn and the error of the layer before */
+void CpuNetwork::backwardLayer(size_t index)
+{
+    CpuLayer& layer = layers[index];
+    CpuLayer& previous = layers[index - 1];
+    size_t inRows = previous.outRows, inCols = previous.outCols, inMaps = previous.outMaps;
+    size_t outRows = layer.outRows, outCols = layer.outCols;
+    bool hasPrevious = index > 1;
+    const float* in = &previous.a->data[0];
+    float* e = &layer.e->data[0];
+
+    if (layer.type == LAYER_MAXPOOL)
+    {
+        if (!hasPrevious)
+        {
+            return;
+        }
+
+        /* Only the winner of every window gets the error, ind says which */
+        size_t rows = layer.a->rows;
+        size_t offsets[4] = {0, 1, 2 * rows, 2 * rows + 1};
+        const float* ind = &layer.ind->data[0];
+        float* error = &previous.e->data[0];
+
+        pool.run(layer.a->cols, [&](size_t begin, size_t end)
+        {
+            for (size_t col = begin; col < end; col++)
+            {
+                for (size_t row = 0; row < rows; row++)
+                {
+                    float* window = error + 2 * col * 2 * rows + 2 * row;
+                    int winner = ind[col * rows + row];
+
+                    for (int i = 0; i < 4; i++)
+                    {
+                        window[offsets[i]] = i == winner ? e[col * rows + row] : 0;
+                    }
+                }
+            }
+        });
+        return;
+    }
+
+    const float* a = &layer.a->data[0];
+
+    pool.run(layer.e->size(), [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            e[i] *= a[i] * (1 - a[i]);
+        }
+    });
+
+    const float* syn = &layer.syn->data[0];
+    float* dsyn = &layer.dsyn->data[0];
+    float* error = hasPrevious ? &previous.e->data[0] : NULL;
+
+    if (layer.type == LAYER_FULLY_CONNECTED)
+    {
+        /* dsyn = a * d^T summed over the batch, e = syn * d */
+        size_t inputs = layer.syn->rows;
+
+        pool.run(outRows, [&](size_t begin, size_t end)
+        {
+            for (size_t neuron = begin; neuron < end; neuron++)
+            {
+                float* gradient = dsyn + neuron * inputs;
+
+                std::fill(gradient, gradient + inputs, 0.0f);
+
+                for (size_t sample = 0; sample < batchSize; sample++)
+                {
+                    axpy(e[sample * outRows + neuron], in + sample * inputs, gradient, inputs);
+                }
+            }
+        });
+
+        if (hasPrevious)
+        {
+            pool.run(batchSize, [&](size_t begin, size_t end)
+            {
+                for (size_t sample = begin; sample < end; sample++)
+                {
+                    float* column = error + sample * inputs;
+
+                    std::fill(column, column + inputs, 0.0f);
+
+                    for (size_t neuron = 0; neuron < outRows; neuron++)
+                    {
+                        axpy(e[sample * outRows + neuron], syn + neuron * inputs, column, inputs);
+                    }
+                }
+            });
+        }
+        return;
+    }
+
+    size_t numFilters = layer.numFilters, size = layer.filterSize;
+
+    /* Filter gradients summed over every sample and pixel, one filter per item */
+    pool.run(numFilters, [&](size_t begin, size_t end)
+    {
+        for (size_t filter = begin; filter < end; filter++)
+        {
+            for (size_t k = 0; k < size; k++)
+            {
+                for (size_t r = 0; r < size; r++)
+                {
+                    float acc = 0;
+
+                    for (size_t sample = 0; sample < batchSize; sample++)
+                    {
+                        const float* input = in + (sample * inMaps + filter % inMaps) * inRows * inCols;
+                        const float* delta = e + (sample * numFilters + filter) * outRows * outCols;
+
+                        for (size_t col = 0; col < outCols; col++)
+                        {
+                            acc += dot(input + (col + k) * inRows + r, delta + col * outRows, outRows);
+                        }
+                    }
+
+                    dsyn[filter * size * size + k * size + r] = acc;
+                }
+            }
+        }
+    });
+
+    if (!hasPrevious)
+    {
+        return;
+    }
+
+    /* The error of an input map gathers from the filters wired to it, one input map per item */
+    pool.run(batchSize * inMaps, [&](size_t begin, size_t end)
+    {
+        for (size_t map = begin; map < end; map++)
+        {
+            size_t sample = map / inMaps;
+            float* output = error + map * inRows * inCols;
+
+            std::fill(output, output + inRows * inCols, 0.0f);
+
+            for (size_t filter = map % inMaps; filter < numFilters; filter += inMaps)
+            {
+                const float* delta = e + (sample * numFilters + filter) * outRows * outCols;
+                const float* weights = syn + filter * size * size;
+
+                for (size_t col = 0; col < outCols; col++)
+                {
+                    for (size_t k = 0; k < size; k++)
+                    {
+                        for (size_t r = 0; r < size; r++)
+                        {
+                            axpy(weights[k * size + r], delta + col * outRows, output + (col + k) * inRows + r, outRows);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+/* The rules of the sgd, sgd_momentum and adam kernels */
+void CpuNetwork::updateLayer(CpuLayer& layer)
+{
+    float* parameters = &layer.syn->data[0];
+    const float* gradients = &layer.dsyn->data[0];
+    float* state0 = layer.state[0].empty() ? NULL : &layer.state[0][0];
+    float* state1 = layer.state[1].empty() ? NULL : &layer.state[1][0];
+    const Optimizer& o = optimizer;
+    float correction1 = 1.0f / (1.0f - pow(o.momentum, (float)optimizerSteps));
+    float correction2 = 1.0f / (1.0f - pow(o.beta2, (float)optimizerSteps));
+
+    pool.run(layer.syn->size(), [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            const float p = parameters[i];
+
+            switch (o.type)
+            {
+            case OPTIMIZER_SGD:
+                parameters[i] = p + o.learningRate * (gradients[i] - o.weightDecay * p);
+                break;
+
+            case OPTIMIZER_MOMENTUM:
+            case OPTIMIZER_NESTEROV:
+            {
+                const float g = gradients[i] - o.weightDecay * p;
+                const float v = o.momentum * state0[i] + g;
+
+                state0[i] = v;
+                parameters[i] = p + o.learningRate * (o.type == OPTIMIZER_NESTEROV ? g + o.momentum * v : v);
+                break;
+            }
+            case OPTIMIZER_ADAM:
+            {
+                const float g = gradients[i];
+                const float m = o.momentum * state0[i] + (1 - o.momentum) * g;
+                const float v = o.beta2 * state1[i] + (1 - o.beta2) * g * g;
+
+                state0[i] = m;
+                state1[i] = v;
+                parameters[i] = p + o.learningRate * (m * correction1 / (sqrt(v * correction2) + o.epsilon) - o.weightDecay * p);
+                break;
+            }
+            }
+        }
+    });
+}
+
+bool CpuNetwork::resetOptimizer()
+{
+    size_t states = optimizer.type == OPTIMIZER_ADAM ? 2 : optimizer.type == OPTIMIZER_SGD ? 0 : 1;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        for (size_t j = 0; j < 2; j++)
+        {
+            layers[i].state[j].assign(j < states && layers[i].syn != NULL ? layers[i].syn->size() : 0, 0.0f);
+        }
+    }
+
+    optimizerSteps = 0;
+    return true;
+}
+
+/* Nothing runs behind the caller's back, every pass is done when its call returns */
+bool CpuNetwork::finish()
+{
+    return true;
+}
+
+bool CpuNetwork::predict(const float* images, float* outputs, size_t samples)
+{
+    CpuTensor* in = input();
+    CpuTensor* out = output();
+
+    if (samples == 0 || samples > batchSize)
+    {
+        cerr << "Predict takes 1 to " << batchSize << " samples, not " << samples << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    copy(images, images + in->size() / batchSize * samples, in->data.begin());
+
+    if (!forward())
+    {
+        return false;
+    }
+
+    copy(out->data.begin(), out->data.begin() + out->size() / batchSize * samples, outputs);
+    return true;
+}
+
+bool CpuNetwork::write(CpuTensor* tensor, const float* data)
+{
+    copy(data, data + tensor->size(), tensor->data.begin());
+    return true;
+}
+
+bool CpuNetwork::fill(CpuTensor* tensor, float value)
+{
+    std::fill(tensor->data.begin(), tensor->data.end(), value);
+    return true;
+}
+
+bool CpuNetwork::read(CpuTensor* tensor, float* data)
+{
+    copy(tensor->data.begin(), tensor->data.end(), data);
+    return true;
+}
+
+size_t CpuNetwork::batch() const
+{
+    return batchSize;
+}
+
+size_t CpuNetwork::threads() const
+{
+    return pool.size();
+}
+
+CpuTensor* CpuNetwork::tensor(const string& name)
+{
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        if (tensors[i]->name == name)
+        {
+            return tensors[i];
+        }
+    }
+
+    return NULL;
+}
+
+CpuTensor* CpuNetwork::input()
+{
+    return layers.front().a;
+}
+
+CpuTensor* CpuNetwork::target()
+{
+    return targetTensor;
+}
+
+CpuTensor* CpuNetwork::output()
+{
+    return layers.back().a;
+}
+
+vector<CpuTensor*> CpuNetwork::parameters()
+{
+    vector<CpuTensor*> result;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].syn != NULL)
+        {
+            result.push_back(layers[i].syn);
+        }
+    }
+
+    return result;
+}
+
+vector<CpuTensor*> CpuNetwork::parameterGradients()
+{
+    vector<CpuTensor*> result;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].dsyn != NULL)
+        {
+            result.push_back(layers[i].dsyn);
+        }
+    }
+
+    return result;
+}
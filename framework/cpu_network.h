@@ -0,0 +1,107 @@
+#ifndef CPU_NETWORK_H
+#define CPU_NETWORK_H
+
+#include "layer_type.h"
+#include "optimizer.h"
+#include "thread_pool.h"
+
+#include <string>
+#include <vector>
+
+/* Host memory counterpart of Tensor, laid out the same way: column-major, samples along the columns */
+struct CpuTensor
+{
+    std::string name;
+    size_t rows;
+    size_t cols;
+    std::vector<float> data;
+
+    size_t size() const { return rows * cols; }
+};
+
+/*
+    The layer graph of Network computed on the CPU, for boards without a usable OpenCL driver and
+    for comparing throughput. Same layers, tensor names and layouts, same sigmoid, pooling,
+    convolution16 wiring and optimizers, and the same calls in the same order, so code written
+    against Network only swaps the class and drops the kernels file from build(). The loops come
+    down to dot() and axpy() of simd.h, and every layer splits its outputs over a ThreadPool:
+    output maps for convolutions, neurons for fully connected layers, filters for the filter
+    gradients. Each output is summed by one thread in a fixed order, so results do not depend on
+    the number of threads, but they differ from the GPU in the last bits.
+    Everything runs inside the calls, forward() and train() return when the pass is done.
+*/
+class CpuNetwork
+{
+public:
+    /* threads 0 uses every hardware thread */
+    explicit CpuNetwork(size_t batchSize = 1, size_t threads = 0);
+    ~CpuNetwork();
+
+    void addInput(size_t rows, size_t cols);
+    void addConvolution(int numFilters, int filterSize);
+    void addConvolution16(int numFilters, int filterSize);
+    void addMaxPool();
+    void addFullyConnected(int outputs);
+
+    void setOptimizer(const Optimizer& settings);
+    bool build(bool training);
+
+    bool forward();
+    bool train();
+    /* train() in two halves, as in Network, accumulate adds the gradients to the ones dsyn holds */
+    bool backward(bool accumulate = false);
+    bool update();
+    bool finish();
+    bool predict(const float* images, float* outputs, size_t samples);
+    bool resetOptimizer();
+
+    bool write(CpuTensor* tensor, const float* data);
+    bool fill(CpuTensor* tensor, float value);
+    bool read(CpuTensor* tensor, float* data);
+
+    size_t batch() const;
+    size_t threads() const;
+    CpuTensor* tensor(const std::string& name);
+    CpuTensor* input();
+    CpuTensor* target();
+    CpuTensor* output();
+    std::vector<CpuTensor*> parameters();
+    std::vector<CpuTensor*> parameterGradients();
+
+private:
+    /* e holds the error of a and is turned into the delta in place */
+    struct CpuLayer
+    {
+        LayerType type;
+        int numFilters;
+        int filterSize;
+        size_t outMaps;
+        size_t outRows;
+        size_t outCols;
+
+        CpuTensor* syn;
+        CpuTensor* dsyn;
+        CpuTensor* a;
+        CpuTensor* ind;
+        CpuTensor* e;
+        std::vector<float> state[2];   /* velocity, or the two Adam moments */
+    };
+
+    CpuTensor* createTensor(const std::string& name, size_t rows, size_t cols);
+    bool buildLayer(size_t index, bool training);
+    void forwardLayer(size_t index);
+    void backwardLayer(size_t index);
+    void updateLayer(CpuLayer& layer);
+
+    size_t batchSize;
+    ThreadPool pool;
+    bool built;
+    Optimizer optimizer;
+    size_t optimizerSteps;
+
+    std::vector<CpuLayer> layers;
+    std::vector<CpuTensor*> tensors;
+    CpuTensor* targetTensor;
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "dataset.h"
+
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/* IDX magic: two zero bytes, 0x08 for unsigned bytes, then the number of dimensions */
+#define IDX_UNSIGNED_BYTE 0x08
+
+static uint32_t bigEndian(const unsigned char* bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static void unmapIdx(IdxFile* file)
+{
+    if (file->mapping != NULL)
+    {
+        munmap(file->mapping, file->mappedBytes);
+    }
+
+    file->data = NULL;
+    file->mapping = NULL;
+    file->mappedBytes = 0;
+    file->dims.clear();
+}
+
+static bool mapIdx(const string& filename, size_t dimensions, IdxFile* file)
+{
+    int descriptor = open(filename.c_str(), O_RDONLY);
+
+    if (descriptor < 0)
+    {
+        cerr << "Unable to open " << filename << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    struct stat status;
+    void* mapping = MAP_FAILED;
+
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+    {
+        mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    }
+
+    /* The mapping keeps the file alive on its own */
+    close(descriptor);
+
+    if (mapping == MAP_FAILED)
+    {
+        cerr << "Unable to map " << filename << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    file->mapping = mapping;
+    file->mappedBytes = status.st_size;
+
+    const unsigned char* bytes = (const unsigned char*)mapping;
+    size_t header = 4 + 4 * dimensions;
+
+    if (file->mappedBytes < header || bytes[0] != 0 || bytes[1] != 0 || bytes[2] != IDX_UNSIGNED_BYTE || bytes[3] != dimensions)
+    {
+        cerr << filename << " is not an IDX file of unsigned bytes with " << dimensions << " dimensions. " << __FILE__ << ":"<< __LINE__ << endl;
+        unmapIdx(file);
+        return false;
+    }
+
+    size_t items = 1;
+    bool fits = true;
+
+    /* Checked before every multiply, so dims crafted to wrap items around cannot pass as a short file */
+    for (size_t i = 0; i < dimensions && fits; i++)
+    {
+        size_t dim = bigEndian(bytes + 4 + 4 * i);
+
+        file->dims.push_back(dim);
+        fits = dim == 0 || items <= (file->mappedBytes - header) / dim;
+        items *= dim;
+    }
+
+    if (!fits)
+    {
+        cerr << filename << " is shorter than its header says. " << __FILE__ << ":"<< __LINE__ << endl;
+        unmapIdx(file);
+        return false;
+    }
+
+    file->data = bytes + header;
+
+    /* Shuffled batches jump all over the file, read-ahead would only pull in pages nobody asked for */
+    madvise(mapping, file->mappedBytes, MADV_RANDOM);
+
+    return true;
+}
+
+MnistDataset::MnistDataset(unsigned seed)
+    : epoch(0), seed(seed)
+{
+    images.data = labels.data = NULL;
+    images.mapping = labels.mapping = NULL;
+    images.mappedBytes = labels.mappedBytes = 0;
+}
+
+MnistDataset::~MnistDataset()
+{
+    close();
+}
+
+void MnistDataset::close()
+{
+    unmapIdx(&images);
+    unmapIdx(&labels);
+    order.clear();
+}
+
+bool MnistDataset::open(const string& imagesFile, const string& labelsFile)
+{
+    close();
+
+    if (!mapIdx(imagesFile, 3, &images) || !mapIdx(labelsFile, 1, &labels))
+    {
+        close();
+        return false;
+    }
+
+    if (images.dims[0] != labels.dims[0])
+    {
+        cerr << imagesFile << " and " << labelsFile << " hold a different number of samples. " << __FILE__ << ":"<< __LINE__ << endl;
+        close();
+        return false;
+    }
+
+    /* Forces the first load() to shuffle */
+    epoch = (size_t)-1;
+    return true;
+}
+
+size_t MnistDataset::size() const
+{
+    return labels.dims.empty() ? 0 : labels.dims[0];
+}
+
+size_t MnistDataset::batches(size_t batchSize) const
+{
+    return batchSize == 0 ? 0 : size() / batchSize;
+}
+
+bool MnistDataset::load(size_t batch, size_t batchSize, size_t rows, size_t cols, size_t classes, float* image, float* target)
+{
+    size_t perEpoch = batches(batchSize);
+    size_t imageRows = images.dims.empty() ? 0 : images.dims[1];
+    size_t imageCols = images.dims.empty() ? 0 : images.dims[2];
+
+    if (perEpoch == 0 || imageRows > rows || imageCols > cols)
+    {
+        cerr << "Dataset does not fit batches of " << batchSize << " " << rows << "x" << cols << " images. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (batch / perEpoch != epoch)
+    {
+        epoch = batch / perEpoch;
+        order.resize(size());
+
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
+        }
+
+        mt19937 random(seed + epoch);
+        shuffle(order.begin(), order.end(), random);
+    }
+
+    /* Centered, the way LeNet pads the 28x28 digits to 32x32 */
+    size_t top = (rows - imageRows) / 2;
+    size_t left = (cols - imageCols) / 2;
+    size_t first = (batch % perEpoch) * batchSize;
+
+    fill(image, image + batchSize * rows * cols, 0.0f);
+    fill(target, target + batchSize * classes, 0.0f);
+
+    for (size_t s = 0; s < batchSize; s++)
+    {
+        size_t sample = order[first + s];
+        const unsigned char* pixels = images.data + sample * imageRows * imageCols;
+        float* out = image + s * rows * cols;
+
+        /* IDX is row-major, tensors are column-major */
+        for (size_t r = 0; r < imageRows; r++)
+        {
+            for (size_t c = 0; c < imageCols; c++)
+            {
+                out[(left + c) * rows + top + r] = pixels[r * imageCols + c] / 255.0f;
+            }
+        }
+
+        size_t label = labels.data[sample];
+
+        if (label >= classes)
+        {
+            cerr << "Label " << label << " of sample " << sample << " is out of range. " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+
+        target[s * classes + label] = 1.0f;
+    }
+
+    return true;
+}
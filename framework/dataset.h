@@ -0,0 +1,50 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* One IDX file mapped read-only, see http://yann.lecun.com/exdb/mnist/ for the layout */
+struct IdxFile
+{
+    const unsigned char* data;      /* first item, right after the header */
+    size_t mappedBytes;
+    void* mapping;
+    std::vector<uint32_t> dims;     /* dims[0] items of dims[1] x dims[2] ... unsigned bytes */
+};
+
+/*
+    MNIST images and labels read straight from the memory-mapped IDX files, nothing is copied
+    into the process and the page cache keeps the resident size flat over any number of epochs.
+    Every epoch walks the samples through its own permutation, which only depends on the seed and
+    the epoch number, so a run can be repeated exactly; batches never straddle epochs,
+    the last size() % batchSize samples of an epoch are left out.
+    load() writes a batch in the layout of the network tensors: images padded to rows x cols,
+    centered, scaled to 0..1 and stacked along columns, targets one-hot, classes x batchSize.
+    Meant to be the BatchLoader of an InputPipeline, so load() is only called from one thread.
+*/
+class MnistDataset
+{
+public:
+    explicit MnistDataset(unsigned seed = 0);
+    ~MnistDataset();
+
+    bool open(const std::string& imagesFile, const std::string& labelsFile);
+    size_t size() const;
+    size_t batches(size_t batchSize) const;
+
+    /* batch counts on across epochs, batch / batches(batchSize) is the epoch */
+    bool load(size_t batch, size_t batchSize, size_t rows, size_t cols, size_t classes, float* image, float* target);
+
+private:
+    void close();
+
+    IdxFile images;
+    IdxFile labels;
+    std::vector<uint32_t> order;    /* permutation of the current epoch */
+    size_t epoch;
+    unsigned seed;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "common.h"
+#include "launch.h"
+
+#include <CL/cl.h>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+bool queryLaunchLimits(cl_device_id device, LaunchLimits* limits)
+{
+    bool querySuccess = true;
+
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &limits->maxWorkGroupSize, NULL));
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &limits->maxDimensions, NULL));
+
+    if (!querySuccess)
+    {
+        cerr << "Failed to collect device info. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* Only the first three dimensions are ever used */
+    size_t sizes[16];
+    cl_uint dimensions = min(limits->maxDimensions, (cl_uint)16);
+
+    if (!checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, dimensions * sizeof(size_t), sizes, NULL)))
+    {
+        cerr << "Failed to collect device info. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    for (cl_uint i = 0; i < 3; i++)
+    {
+        limits->maxWorkItemSizes[i] = i < dimensions ? sizes[i] : 1;
+    }
+
+    return true;
+}
+
+bool planLaunch(cl_kernel kernel, cl_device_id device, const LaunchLimits& limits,
+                cl_uint dimensions, const size_t* work, size_t* global, size_t* local)
+{
+    size_t kernelWorkGroupSize = 0, preferredMultiple = 1;
+    bool querySuccess = true;
+
+    querySuccess &= checkSuccess(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelWorkGroupSize, NULL));
+    querySuccess &= checkSuccess(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &preferredMultiple, NULL));
+
+    if (!querySuccess)
+    {
+        cerr << "Failed to collect kernel work group info. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    size_t budget = min(kernelWorkGroupSize, limits.maxWorkGroupSize);
+    size_t total = 1;
+
+    for (cl_uint i = 0; i < dimensions; i++)
+    {
+        local[i] = 1;
+    }
+
+    /*
+        Sizes grow in powers of two without outgrowing the work, so padding stays under half of it.
+        Dimension 0 walks down a column, which is contiguous in memory, so it gets the preferred
+        multiple first, then the dimensions take turns.
+    */
+    while (total * 2 <= budget && local[0] < preferredMultiple && local[0] * 2 <= work[0]
+           && local[0] * 2 <= limits.maxWorkItemSizes[0])
+    {
+        local[0] *= 2;
+        total *= 2;
+    }
+
+    bool grown = true;
+
+    while (grown)
+    {
+        grown = false;
+
+        for (cl_uint i = 0; i < dimensions; i++)
+        {
+            if (total * 2 <= budget && local[i] * 2 <= work[i] && local[i] * 2 <= limits.maxWorkItemSizes[i])
+            {
+                local[i] *= 2;
+                total *= 2;
+                grown = true;
+            }
+        }
+    }
+
+    for (cl_uint i = 0; i < dimensions; i++)
+    {
+        global[i] = (work[i] + local[i] - 1) / local[i] * local[i];
+    }
+
+    return true;
+}
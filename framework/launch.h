@@ -0,0 +1,23 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <CL/cl.h>
+
+/* Work group limits of a device, queried once and shared by every launch on it */
+struct LaunchLimits
+{
+    size_t maxWorkGroupSize;
+    cl_uint maxDimensions;
+    size_t maxWorkItemSizes[3];
+};
+
+bool queryLaunchLimits(cl_device_id device, LaunchLimits* limits);
+
+/*
+    Picks a local size for a kernel covering work[0..dimensions) items and pads the global size
+    up to a multiple of it. Kernels launched this way have to ignore work items past their shape.
+*/
+bool planLaunch(cl_kernel kernel, cl_device_id device, const LaunchLimits& limits,
+                cl_uint dimensions, const size_t* work, size_t* global, size_t* local);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef LAYER_H
+#define LAYER_H
+
+#include "layer_type.h"
+#include "tensor.h"
+
+/*
+    Description of one layer plus the tensors Network::build() allocated for it.
+    Convolution and fully connected layers apply a sigmoid, so they own y (before) and a (after).
+    Maxpool layers keep the winning indices in ind and the pooled values in a.
+    Without training y is a itself and ind is NULL.
+    During training e is the error of a, g the sigmoid gradient, d = e * g and dsyn the weight update.
+*/
+struct Layer
+{
+    LayerType type;
+    int numFilters;
+    int filterSize;
+
+    /* Output shape of one sample; fully connected layers use outMaps = 1, outRows = outputs, outCols = 1 */
+    size_t outMaps;
+    size_t outRows;
+    size_t outCols;
+
+    Tensor* syn;
+    Tensor* y;
+    Tensor* a;
+    Tensor* ind;
+    Tensor* e;
+    Tensor* g;
+    Tensor* d;
+    Tensor* dsyn;
+    Tensor* partial;        /* slices of dsyn summed by split_sum, convolution engine only */
+    Tensor* lut;            /* int8 sigmoid of every int8 y, int8 inference only */
+    Tensor* u;              /* filters as the convolution kernel reads them, once per weight update: 36 Winograd values per filter or the filter image */
+    Tensor* v;              /* input maps as the convolution kernel reads them, every pass: Winograd 6x6 tiles or the RGBA image2d_array_t */
+    int splits;
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef LAYER_TYPE_H
+#define LAYER_TYPE_H
+
+/* Kinds of layers, shared by Network and CpuNetwork; kept apart from layer.h so the CPU side needs no OpenCL headers */
+enum LayerType
+{
+    LAYER_INPUT,
+    LAYER_CONVOLUTION,          /* every filter sees the single input map */
+    LAYER_CONVOLUTION16,        /* filter f sees input map f % inMaps */
+    LAYER_MAXPOOL,              /* 2x2 max pooling, remembers which pixel won */
+    LAYER_FULLY_CONNECTED
+};
+
+#endif
@@ -0,0 +1,2313 @@
+#include "common.h"
+#include "network.h"
+#include "program.h"
+
+#include <CL/cl.h>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+/* Tile edge of the convolution engine, passed to kernels.cl as CONV_TILE */
+#define CONVOLUTION_TILE 8
+
+/* Output tile of the fully connected GEMM and the rows x columns of it per work item, passed as GEMM_TILE, GEMM_WPTM and GEMM_WPTN */
+#define GEMM_TILE 16
+#define GEMM_WPTM 2
+#define GEMM_WPTN 2
+
+/* Filter size of the F(2x2, 5x5) Winograd transforms, which turn 6x6 input tiles into 2x2 output tiles */
+#define WINOGRAD_FILTER 5
+#define WINOGRAD_TILE 36
+
+/* Filter gradient reductions get one slice per this many samples x pixels, at most MAX_SPLITS */
+#define SPLIT_COLUMNS 512
+#define MAX_SPLITS 16
+
+/* Work group of forward_lenet and the local memory it has for one sample, passed as FORWARD_LOCAL */
+#define FORWARD_GROUP 128
+#define FORWARD_LOCAL 4096
+
+/* int8 tensors use -INT8_LEVELS..INT8_LEVELS, sigmoid inputs beyond SIGMOID_RANGE are clamped, see calibrate() */
+#define INT8_LEVELS 127
+#define SIGMOID_RANGE 8.0f
+
+/* Launches per kernel in specializationReport(), the fastest one counts */
+#define SPECIALIZATION_REPEATS 10
+
+Network::Network(size_t batchSize)
+    : context(0), commandQueue(0), program(0), device(0), batchSize(batchSize), profiling(false), convolution(CONVOLUTION_GEMM), deconvolution(DECONVOLUTION_GATHER), fusion(true), outOfOrder(true), memoryPlanning(true), megakernel(false), specialization(false), accumulation(false), precision(PRECISION_FLOAT), alignment(sizeof(cl_float)), deferAllocation(false), inputTensor(NULL), targetTensor(NULL), weights(NULL), gradients(NULL), gradientSum(NULL), optimizerSteps(0), transformsStale(true), stepLayer(0)
+{
+    Optimizer defaults = {OPTIMIZER_SGD, 1.0f, 0.9f, 0.999f, 1e-8f, 0.0f};
+
+    optimizer = defaults;
+}
+
+Network::~Network()
+{
+    /* Events keep the queue alive, so they go first */
+    profiler.clear();
+    scheduler.retire();
+
+    vector<Step>* schedules[] = {&transformSteps, &forwardSteps, &backwardSteps, &updateSteps, &saveGradientSteps, &addGradientSteps};
+
+    for (int i = 0; i < 6; i++)
+    {
+        for (size_t j = 0; j < schedules[i]->size(); j++)
+        {
+            clReleaseKernel((*schedules[i])[j].kernel);
+        }
+    }
+
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        if (tensors[i]->buffer != 0)
+        {
+            clReleaseMemObject(tensors[i]->buffer);
+        }
+        delete tensors[i];
+    }
+
+    /* Sub-buffers hold on to their arena, so releasing it here only drops our reference */
+    for (size_t i = 0; i < arenas.size(); i++)
+    {
+        clReleaseMemObject(arenas[i]);
+    }
+
+    variants.release();
+
+    if (program != 0)
+    {
+        clReleaseProgram(program);
+    }
+
+    if (commandQueue != 0)
+    {
+        clReleaseCommandQueue(commandQueue);
+    }
+
+    if (context != 0)
+    {
+        clReleaseContext(context);
+    }
+}
+
+static Layer describeLayer(LayerType type, int numFilters, int filterSize)
+{
+    Layer layer;
+
+    memset(&layer, 0, sizeof(layer));
+    layer.type = type;
+    layer.numFilters = numFilters;
+    layer.filterSize = filterSize;
+
+    return layer;
+}
+
+void Network::addInput(size_t rows, size_t cols)
+{
+    Layer layer = describeLayer(LAYER_INPUT, 0, 0);
+
+    layer.outMaps = 1;
+    layer.outRows = rows;
+    layer.outCols = cols;
+    layers.push_back(layer);
+}
+
+void Network::addConvolution(int numFilters, int filterSize)
+{
+    layers.push_back(describeLayer(LAYER_CONVOLUTION, numFilters, filterSize));
+}
+
+void Network::addConvolution16(int numFilters, int filterSize)
+{
+    layers.push_back(describeLayer(LAYER_CONVOLUTION16, numFilters, filterSize));
+}
+
+void Network::addMaxPool()
+{
+    layers.push_back(describeLayer(LAYER_MAXPOOL, 0, 0));
+}
+
+void Network::addFullyConnected(int outputs)
+{
+    Layer layer = describeLayer(LAYER_FULLY_CONNECTED, 0, 0);
+
+    layer.outMaps = 1;
+    layer.outRows = outputs;
+    layer.outCols = 1;
+    layers.push_back(layer);
+}
+
+void Network::enableProfiling()
+{
+    profiling = true;
+}
+
+/* Call before build() */
+void Network::setConvolution(ConvolutionKernel kernel)
+{
+    convolution = kernel;
+}
+
+/* Call before build() */
+void Network::setLayerConvolution(size_t index, ConvolutionKernel kernel)
+{
+    layerConvolutions[index] = kernel;
+}
+
+ConvolutionKernel Network::convolutionOf(size_t index) const
+{
+    std::map<size_t, ConvolutionKernel>::const_iterator chosen = layerConvolutions.find(index);
+
+    return chosen != layerConvolutions.end() ? chosen->second : convolution;
+}
+
+/* Call before build() */
+void Network::setDeconvolution(DeconvolutionKernel kernel)
+{
+    deconvolution = kernel;
+}
+
+/* Call before build() */
+void Network::setFusion(bool enabled)
+{
+    fusion = enabled;
+}
+
+/* Call before build() */
+void Network::setOutOfOrder(bool enabled)
+{
+    outOfOrder = enabled;
+}
+
+/* Call before build() */
+void Network::setMemoryPlanning(bool enabled)
+{
+    memoryPlanning = enabled;
+}
+
+/* Call before build() */
+void Network::setMegakernel(bool enabled)
+{
+    megakernel = enabled;
+}
+
+/* Call before build() */
+void Network::setSpecialization(bool enabled)
+{
+    specialization = enabled;
+}
+
+/* Call before build() */
+void Network::setAccumulation(bool enabled)
+{
+    accumulation = enabled;
+}
+
+/* Call before build() */
+void Network::setOptimizer(const Optimizer& settings)
+{
+    optimizer = settings;
+}
+
+/* Call before build() */
+void Network::setPrecision(Precision storage)
+{
+    precision = storage;
+}
+
+static bool hasExtension(cl_device_id device, const string& extension)
+{
+    size_t size = 0;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &size) != CL_SUCCESS || size == 0)
+    {
+        return false;
+    }
+
+    vector<char> extensions(size);
+
+    if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, &extensions[0], NULL) != CL_SUCCESS)
+    {
+        return false;
+    }
+
+    /* Space separated names, so pad both sides to match whole names only */
+    return (" " + string(&extensions[0]) + " ").find(" " + extension + " ") != string::npos;
+}
+
+static bool hasImages(cl_device_id device)
+{
+    cl_bool support = CL_FALSE;
+
+    return clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(support), &support, NULL) == CL_SUCCESS && support == CL_TRUE;
+}
+
+bool Network::build(const string& kernelsFile, bool training)
+{
+    if (batchSize == 0)
+    {
+        cerr << "Network needs a batch of at least one sample. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (layers.size() < 2 || layers[0].type != LAYER_INPUT)
+    {
+        cerr << "Network needs an input layer followed by at least one layer. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!createContext(&context))
+    {
+        cerr << "Failed to create an OpenCL context. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!createCommandQueue(context, &commandQueue, &device))
+    {
+        cerr << "Failed to create the OpenCL command queue. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* Every layer of a forward-only graph waits for the one before it, out-of-order would only add events */
+    outOfOrder = outOfOrder && training;
+
+    if (!createQueue())
+    {
+        return false;
+    }
+
+    if (!queryLaunchLimits(device, &limits))
+    {
+        cerr << "Failed to query the work group limits. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    cl_uint alignmentBits = 0;
+
+    if (!checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignmentBits), &alignmentBits, NULL)))
+    {
+        cerr << "Failed to query the base address alignment. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* The device gives it in bits */
+    alignment = max(alignment, (size_t)alignmentBits / 8);
+
+    if (precision == PRECISION_INT8 && training)
+    {
+        cerr << "int8 networks can only be built for inference. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    string options = "-DCONV_TILE=" + to_string(CONVOLUTION_TILE) + " -DFORWARD_LOCAL=" + to_string(FORWARD_LOCAL)
+        + " -DGEMM_TILE=" + to_string(GEMM_TILE) + " -DGEMM_WPTM=" + to_string(GEMM_WPTM) + " -DGEMM_WPTN=" + to_string(GEMM_WPTN);
+
+    if (precision == PRECISION_HALF && !hasExtension(device, "cl_khr_fp16"))
+    {
+        cerr << "Device has no cl_khr_fp16, the network stays in single precision. " << __FILE__ << ":"<< __LINE__ << endl;
+        precision = PRECISION_FLOAT;
+    }
+
+    /* Half words cannot be added atomically, which rules out the scatter */
+    if (precision == PRECISION_HALF)
+    {
+        options += " -DHALF_PRECISION";
+        deconvolution = DECONVOLUTION_GATHER;
+    }
+
+    if (!buildProgram(context, device, kernelsFile, options, &program))
+    {
+        cerr << "Failed to create OpenCL program." << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    programFile = kernelsFile;
+
+    if (specialization && !variants.open(context, device, kernelsFile, options, program))
+    {
+        cerr << "Failed to prepare the shape specialisation. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    deferAllocation = true;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (!buildLayer(i, training))
+        {
+            return false;
+        }
+    }
+
+    /* The only work of the input layer is narrowing the image to half or int8, calibrate() sets the scale */
+    if (layers[0].a != inputTensor)
+    {
+        int size = inputTensor->size();
+        size_t global[1] = {(size_t)size};
+        bool quantized = precision == PRECISION_INT8;
+        string kernelName = quantized ? "quantize" : "to_real";
+
+        stepLayer = 0;
+
+        if (!addStep(forwardSteps, "L0_a = " + kernelName, kernelName, 1, global, {size}, {inputTensor, layers[0].a},
+                     NULL, 1, quantized ? vector<float>(1, 1.0f) : vector<float>()))
+        {
+            return false;
+        }
+    }
+
+    if (megakernel && fitsMegakernel(training))
+    {
+        if (!buildMegakernel())
+        {
+            return false;
+        }
+    }
+    else
+    {
+        for (size_t i = 1; i < layers.size(); i++)
+        {
+            if (!(precision == PRECISION_INT8 ? buildQuantized(i) : buildForward(i)))
+            {
+                return false;
+            }
+        }
+    }
+
+    if (training)
+    {
+        Layer& last = layers.back();
+        targetTensor = createTensor("output", last.a->rows, last.a->cols);
+
+        if (targetTensor == NULL)
+        {
+            return false;
+        }
+
+        for (size_t i = layers.size() - 1; i > 0; i--)
+        {
+            if (!buildBackward(i))
+            {
+                return false;
+            }
+        }
+
+        if (!buildOptimizer())
+        {
+            return false;
+        }
+    }
+
+    if (!planMemory())
+    {
+        return false;
+    }
+
+    /* The padding between the weights stays zero from here on */
+    return !training || (fill(weights, 0) && resetOptimizer());
+}
+
+bool Network::hasSigmoid(size_t index) const
+{
+    LayerType type = layers[index].type;
+
+    return type == LAYER_CONVOLUTION || type == LAYER_CONVOLUTION16 || type == LAYER_FULLY_CONNECTED;
+}
+
+/* Convolution index writes the pooled output of the maxpool after it */
+bool Network::fusesPool(size_t index) const
+{
+    return fusion && convolutionOf(index) == CONVOLUTION_GEMM && index + 1 < layers.size()
+        && (layers[index].type == LAYER_CONVOLUTION || layers[index].type == LAYER_CONVOLUTION16)
+        && layers[index + 1].type == LAYER_MAXPOOL;
+}
+
+/* The delta of layer index is written by the layer after it, which skips its error */
+bool Network::fusesDelta(size_t index) const
+{
+    return fusion && hasSigmoid(index) && index + 1 < layers.size()
+        && (layers[index + 1].type == LAYER_FULLY_CONNECTED || layers[index + 1].type == LAYER_MAXPOOL);
+}
+
+/* The queue of common.h is in-order and may come without profiling, replace it when either is wanted */
+bool Network::createQueue()
+{
+    cl_command_queue_properties supported = 0;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL) != CL_SUCCESS)
+    {
+        supported = 0;
+    }
+
+    outOfOrder = outOfOrder && (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+    cl_command_queue_properties properties = (profiling ? CL_QUEUE_PROFILING_ENABLE : 0)
+        | (outOfOrder ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0);
+
+    if (properties == 0)
+    {
+        return true;
+    }
+
+    cl_int errorNumber;
+
+    clReleaseCommandQueue(commandQueue);
+    commandQueue = clCreateCommandQueue(context, device, properties, &errorNumber);
+
+    if (!checkSuccess(errorNumber))
+    {
+        commandQueue = 0;
+        cerr << "Failed to create the command queue. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Works out the output shape of a layer and allocates every tensor it needs */
+bool Network::buildLayer(size_t index, bool training)
+{
+    Layer& layer = layers[index];
+    string prefix = "L" + to_string(index) + "_";
+    size_t element = precision == PRECISION_HALF ? sizeof(cl_half) : precision == PRECISION_INT8 ? sizeof(cl_char) : sizeof(cl_float);
+
+    if (layer.type == LAYER_INPUT)
+    {
+        string name = precision == PRECISION_INT8 ? "image_int8" : "image_half";
+
+        inputTensor = createTensor("image", layer.outRows, batchSize * layer.outMaps * layer.outCols);
+        layer.a = element == sizeof(cl_float) ? inputTensor : createTensor(name, inputTensor->rows, inputTensor->cols, element);
+        return inputTensor != NULL && layer.a != NULL;
+    }
+
+    const Layer& previous = layers[index - 1];
+    size_t synRows = 0, synCols = 0;
+
+    switch (layer.type)
+    {
+    case LAYER_CONVOLUTION:
+    case LAYER_CONVOLUTION16:
+        if (layer.type == LAYER_CONVOLUTION && previous.outMaps != 1)
+        {
+            cerr << "Layer " << index << ": convolution expects a single input map. " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+        layer.outMaps = layer.numFilters;
+        layer.outRows = previous.outRows - layer.filterSize + 1;
+        layer.outCols = previous.outCols - layer.filterSize + 1;
+        synRows = layer.filterSize;
+        synCols = layer.numFilters * layer.filterSize;
+        layer.splits = 1;
+
+        if (convolutionOf(index) == CONVOLUTION_WINOGRAD && (layer.filterSize != WINOGRAD_FILTER || precision == PRECISION_INT8))
+        {
+            cerr << "Layer " << index << ": Winograd needs float " << WINOGRAD_FILTER << "x" << WINOGRAD_FILTER << " filters, it runs on GEMM. " << __FILE__ << ":"<< __LINE__ << endl;
+            layerConvolutions[index] = CONVOLUTION_GEMM;
+        }
+
+        if (convolutionOf(index) == CONVOLUTION_IMAGE && (precision == PRECISION_INT8 || !hasImages(device)))
+        {
+            cerr << "Layer " << index << ": the image path needs a float network on a device with images, it runs on GEMM. " << __FILE__ << ":"<< __LINE__ << endl;
+            layerConvolutions[index] = CONVOLUTION_GEMM;
+        }
+
+        /* Winograd and image layers train on the GEMM kernels */
+        if (convolutionOf(index) != CONVOLUTION_DIRECT)
+        {
+            size_t columns = batchSize * layer.outRows * layer.outCols;
+            layer.splits = min((size_t)MAX_SPLITS, max((size_t)1, columns / SPLIT_COLUMNS));
+        }
+        break;
+
+    case LAYER_MAXPOOL:
+        if (previous.outRows % 2 != 0 || previous.outCols % 2 != 0)
+        {
+            cerr << "Layer " << index << ": maxpool expects even sized maps. " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+        layer.outMaps = previous.outMaps;
+        layer.outRows = previous.outRows / 2;
+        layer.outCols = previous.outCols / 2;
+        break;
+
+    case LAYER_FULLY_CONNECTED:
+        synRows = previous.outRows * previous.outMaps * previous.outCols;
+        synCols = layer.outRows;
+        break;
+
+    default:
+        cerr << "Layer " << index << ": input layer can only be the first one. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* Samples are stacked along columns after each other */
+    size_t rows = layer.outRows;
+    size_t cols = batchSize * layer.outMaps * layer.outCols;
+    bool createTensorsSuccess = true;
+
+    /* Only maxpool_error reads the indices, without training the pools leave them out */
+    if (layer.type == LAYER_MAXPOOL && training)
+    {
+        layer.ind = createTensor(prefix + "ind", rows, cols, element);
+        createTensorsSuccess &= layer.ind != NULL;
+    }
+    else if (layer.type != LAYER_MAXPOOL)
+    {
+        layer.syn = createTensor(prefix + "syn", synRows, synCols, precision == PRECISION_INT8 ? sizeof(cl_char) : sizeof(cl_float));
+        createTensorsSuccess &= layer.syn != NULL;
+
+        if (precision == PRECISION_INT8)
+        {
+            layer.lut = createTensor(prefix + "lut", 2 * INT8_LEVELS + 2, 1, sizeof(cl_char));
+            createTensorsSuccess &= layer.lut != NULL;
+        }
+
+        /* Nothing reads y but the sigmoid, which can just as well overwrite it in place */
+        if (training)
+        {
+            layer.y = createTensor(prefix + "y", rows, cols, element);
+            createTensorsSuccess &= layer.y != NULL;
+        }
+    }
+
+    layer.a = createTensor(prefix + "a", rows, cols, element);
+    createTensorsSuccess &= layer.a != NULL;
+
+    if (layer.type != LAYER_MAXPOOL && layer.type != LAYER_FULLY_CONNECTED && convolutionOf(index) == CONVOLUTION_WINOGRAD)
+    {
+        const Layer& previous = layers[index - 1];
+        size_t tiles = ((layer.outRows + 1) / 2) * ((layer.outCols + 1) / 2);
+
+        layer.u = createTensor(prefix + "u", WINOGRAD_TILE, layer.numFilters);
+        layer.v = createTensor(prefix + "v", WINOGRAD_TILE, tiles * batchSize * previous.outMaps);
+        createTensorsSuccess &= layer.u != NULL && layer.v != NULL;
+    }
+
+    /* Four input maps to a texel, see convolution_image for the filter image */
+    if (layer.type != LAYER_MAXPOOL && layer.type != LAYER_FULLY_CONNECTED && convolutionOf(index) == CONVOLUTION_IMAGE)
+    {
+        const Layer& previous = layers[index - 1];
+        size_t numMaps = layer.type == LAYER_CONVOLUTION ? 1 : previous.outMaps;
+        size_t groups = (numMaps + 3) / 4, rounds = (layer.numFilters + numMaps - 1) / numMaps;
+
+        layer.u = createImage(prefix + "u", CL_MEM_OBJECT_IMAGE2D, layer.filterSize * layer.filterSize, rounds * groups, 1);
+        layer.v = createImage(prefix + "v", CL_MEM_OBJECT_IMAGE2D_ARRAY, previous.outCols, previous.outRows, batchSize * groups);
+        createTensorsSuccess &= layer.u != NULL && layer.v != NULL;
+    }
+
+    if (layer.type != LAYER_MAXPOOL && !training)
+    {
+        layer.y = layer.a;
+    }
+
+    if (training)
+    {
+        layer.e = createTensor(prefix + "e", rows, cols, element);
+        createTensorsSuccess &= layer.e != NULL;
+
+        if (layer.type != LAYER_MAXPOOL)
+        {
+            layer.g = createTensor(prefix + "g", rows, cols, element);
+            layer.d = createTensor(prefix + "d", rows, cols, element);
+            layer.dsyn = createTensor(prefix + "dsyn", synRows, synCols);
+            createTensorsSuccess &= layer.g != NULL && layer.d != NULL && layer.dsyn != NULL;
+
+            if (layer.splits > 1)
+            {
+                layer.partial = createTensor(prefix + "dsyn_partial", synRows * synCols, layer.splits);
+                createTensorsSuccess &= layer.partial != NULL;
+            }
+        }
+    }
+
+    return createTensorsSuccess;
+}
+
+/* Graph forward_lenet computes, with the activations of one sample within its FORWARD_LOCAL floats */
+bool Network::fitsMegakernel(bool training) const
+{
+    static const LayerType shape[] = {LAYER_INPUT, LAYER_CONVOLUTION16, LAYER_MAXPOOL, LAYER_CONVOLUTION16, LAYER_MAXPOOL,
+                                      LAYER_FULLY_CONNECTED, LAYER_FULLY_CONNECTED, LAYER_FULLY_CONNECTED};
+    bool fits = !training && precision == PRECISION_FLOAT && layers.size() == sizeof(shape) / sizeof(shape[0]);
+
+    /* The first convolution sees one map, where both kinds are the same */
+    for (size_t i = 0; i < layers.size() && fits; i++)
+    {
+        fits = layers[i].type == shape[i] || (i == 1 && layers[i].type == LAYER_CONVOLUTION);
+    }
+
+    if (!fits)
+    {
+        cerr << "Only forward-only float LeNet graphs run as one kernel, forward() keeps a step per layer. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    size_t floats = 0;
+    cl_ulong localMemory = 0;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (i != 1 && i != 3)
+        {
+            floats += layers[i].outMaps * layers[i].outRows * layers[i].outCols;
+        }
+    }
+
+    if (!checkSuccess(clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemory), &localMemory, NULL))
+        || floats > FORWARD_LOCAL || FORWARD_LOCAL * sizeof(cl_float) > localMemory)
+    {
+        cerr << "A sample needs " << floats << " floats of local memory, forward() keeps a step per layer. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* The whole forward pass as one step, which touches nothing but the image, the weights and the output */
+bool Network::buildMegakernel()
+{
+    const Layer& input = layers[0];
+    const Layer& last = layers.back();
+    size_t group = min((size_t)FORWARD_GROUP, limits.maxWorkGroupSize);
+    size_t work[1] = {batchSize * group};
+    size_t local[1] = {group};
+    size_t kernelGroup = 0;
+
+    stepLayer = 1;
+
+    if (!addStep(forwardSteps, "L" + to_string(layers.size() - 1) + "_a = forward_lenet", "forward_lenet", 1, work,
+                 {(int)input.outRows, (int)input.outCols, layers[1].numFilters, layers[1].filterSize, layers[3].numFilters,
+                  layers[3].filterSize, (int)layers[5].outRows, (int)layers[6].outRows, (int)last.outRows},
+                 {inputTensor, layers[1].syn, layers[3].syn, layers[5].syn, layers[6].syn, last.syn, last.a}, local))
+    {
+        return false;
+    }
+
+    /* Registers can leave the kernel less than the device allows, it works with any group size */
+    Step& step = forwardSteps.back();
+
+    if (!checkSuccess(clGetKernelWorkGroupInfo(step.kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelGroup), &kernelGroup, NULL)))
+    {
+        cerr << "Failed to query the work group size of forward_lenet. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (kernelGroup < group)
+    {
+        step.local[0] = kernelGroup;
+        step.global[0] = batchSize * kernelGroup;
+    }
+
+    return true;
+}
+
+bool Network::buildForward(size_t index)
+{
+    Layer& layer = layers[index];
+    const Layer& previous = layers[index - 1];
+    string prefix = "L" + to_string(index);
+    int inRows = previous.outRows, inCols = previous.outCols, inMaps = previous.outMaps;
+    int outRows = layer.outRows, outCols = layer.outCols;
+    int rows = layer.a->rows, cols = layer.a->cols;
+    int batch = batchSize;
+    bool success = true;
+
+    stepLayer = index;
+
+    if ((layer.type == LAYER_CONVOLUTION || layer.type == LAYER_CONVOLUTION16) && convolutionOf(index) == CONVOLUTION_WINOGRAD)
+    {
+        /* The filters are transformed once per weight update, the input tiles every pass, see transformSteps */
+        int numMaps = layer.type == LAYER_CONVOLUTION ? 1 : inMaps;
+        int tileRows = (outRows + 1) / 2, tileCols = (outCols + 1) / 2;
+        size_t globalFilters[1] = {(size_t)layer.numFilters};
+        size_t globalInput[2] = {(size_t)(tileRows * tileCols), (size_t)(batch * inMaps)};
+        size_t globalOutput[2] = {(size_t)(tileRows * tileCols), (size_t)(batch * layer.numFilters)};
+
+        success &= addStep(transformSteps, prefix + "_u = winograd_filter", "winograd_filter", 1, globalFilters,
+            {layer.numFilters}, {layer.syn, layer.u});
+        success &= addStep(forwardSteps, prefix + "_v = winograd_input", "winograd_input", 2, globalInput,
+            {inRows, inCols, tileRows, tileCols, batch * inMaps}, {previous.a, layer.v});
+        success &= addStep(forwardSteps, prefix + "_y = winograd_output", "winograd_output", 2, globalOutput,
+            {outRows, outCols, tileRows, tileCols, layer.numFilters, numMaps, inMaps, batch}, {layer.u, layer.v, layer.y});
+    }
+    else if ((layer.type == LAYER_CONVOLUTION || layer.type == LAYER_CONVOLUTION16) && convolutionOf(index) == CONVOLUTION_IMAGE)
+    {
+        /* Only the input is packed into an image, the outputs are written back in the buffer layout */
+        int numMaps = layer.type == LAYER_CONVOLUTION ? 1 : inMaps;
+        int groups = (numMaps + 3) / 4, rounds = (layer.numFilters + numMaps - 1) / numMaps;
+        int taps = layer.filterSize * layer.filterSize;
+        size_t globalFilters[2] = {(size_t)taps, (size_t)(rounds * groups)};
+        size_t globalInput[3] = {(size_t)inCols, (size_t)inRows, (size_t)(batch * groups)};
+        size_t globalOutput[3] = {(size_t)outCols, (size_t)outRows, (size_t)(batch * rounds * groups)};
+
+        success &= addStep(transformSteps, prefix + "_u = image_filters", "image_filters", 2, globalFilters,
+            {layer.numFilters, taps, numMaps}, {layer.syn, layer.u});
+        success &= addStep(forwardSteps, prefix + "_v = image_input", "image_input", 3, globalInput,
+            {inRows, inCols, numMaps, batch}, {previous.a, layer.v});
+        success &= addStep(forwardSteps, prefix + "_y = convolution_image", "convolution_image", 3, globalOutput,
+            {outRows, outCols, layer.numFilters, layer.filterSize, numMaps, batch}, {layer.v, layer.u, layer.y});
+    }
+    else if ((layer.type == LAYER_CONVOLUTION || layer.type == LAYER_CONVOLUTION16) && convolutionOf(index) == CONVOLUTION_GEMM)
+    {
+        /* The single input map of a plain convolution is the numMaps == 1 case */
+        int numMaps = layer.type == LAYER_CONVOLUTION ? 1 : inMaps;
+        int filtersPerMap = (layer.numFilters + numMaps - 1) / numMaps;
+        size_t global[3] = {(size_t)(batch * outRows * outCols), (size_t)filtersPerMap, (size_t)numMaps};
+        size_t local[3] = {CONVOLUTION_TILE, CONVOLUTION_TILE, 1};
+
+        if (fusesPool(index))
+        {
+            const Layer& next = layers[index + 1];
+            return addStep(forwardSteps, "L" + to_string(index + 1) + "_a = convolution_gemm_pool", "convolution_gemm_pool", 3, global,
+                {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, numMaps, batch}, {previous.a, layer.syn, next.ind, next.a}, local, 2);
+        }
+
+        success &= addStep(forwardSteps, prefix + "_y = convolution_gemm", "convolution_gemm", 3, global,
+            {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, numMaps, batch}, {previous.a, layer.syn, layer.y}, local);
+    }
+    else switch (layer.type)
+    {
+    case LAYER_CONVOLUTION:
+    {
+        size_t global[3] = {(size_t)(batch * layer.numFilters), (size_t)outRows, (size_t)outCols};
+        success &= addStep(forwardSteps, prefix + "_y = convolution", "convolution", 3, global,
+            {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, batch}, {previous.a, layer.syn, layer.y});
+        break;
+    }
+    case LAYER_CONVOLUTION16:
+    {
+        size_t global[3] = {(size_t)(batch * layer.numFilters), (size_t)outRows, (size_t)outCols};
+        success &= addStep(forwardSteps, prefix + "_y = convolution16", "convolution16", 3, global,
+            {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, inMaps, batch}, {previous.a, layer.syn, layer.y});
+        break;
+    }
+    case LAYER_MAXPOOL:
+    {
+        if (fusesPool(index - 1))
+        {
+            return true;
+        }
+
+        size_t global[2] = {(size_t)rows, (size_t)cols};
+        return addStep(forwardSteps, prefix + "_a = maxpool", "maxpool", 2, global,
+            {rows, cols}, {previous.a, layer.ind, layer.a}, NULL, 2);
+    }
+    case LAYER_FULLY_CONNECTED:
+    {
+        /* y (outputs x batch) = syn^T * a, every column of the previous activations is one sample */
+        int inputs = layer.syn->rows;
+        size_t global[2] = {(size_t)(outRows + GEMM_WPTM - 1) / GEMM_WPTM, (size_t)(batch + GEMM_WPTN - 1) / GEMM_WPTN};
+        size_t local[2] = {GEMM_TILE / GEMM_WPTM, GEMM_TILE / GEMM_WPTN};
+
+        if (fusion)
+        {
+            return addStep(forwardSteps, prefix + "_a = matrix_transpose_multiply_sigmoid_blocked", "matrix_transpose_multiply_sigmoid_blocked", 2, global,
+                {inputs, outRows, batch}, {layer.syn, previous.a, layer.a}, local);
+        }
+
+        success &= addStep(forwardSteps, prefix + "_y = matrix_transpose_multiply_blocked", "matrix_transpose_multiply_blocked", 2, global,
+            {inputs, outRows, batch}, {layer.syn, previous.a, layer.y}, local);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    size_t global[2] = {(size_t)rows, (size_t)cols};
+    success &= addStep(forwardSteps, prefix + "_a = sigmoid", "sigmoid", 2, global,
+        {rows, cols}, {layer.y, layer.a});
+
+    return success;
+}
+
+/* int8 forward pass, every layer is one dispatch that looks its sigmoid up in lut, calibrate() sets the rescales */
+bool Network::buildQuantized(size_t index)
+{
+    Layer& layer = layers[index];
+    const Layer& previous = layers[index - 1];
+    string prefix = "L" + to_string(index);
+    int inRows = previous.outRows, inCols = previous.outCols, inMaps = previous.outMaps;
+    int outRows = layer.outRows, outCols = layer.outCols;
+    int rows = layer.a->rows, cols = layer.a->cols;
+    int batch = batchSize;
+
+    stepLayer = index;
+
+    switch (layer.type)
+    {
+    case LAYER_CONVOLUTION:
+    case LAYER_CONVOLUTION16:
+    {
+        /* A plain convolution has a single input map, which makes it the numMaps == 1 convolution16 */
+        size_t global[3] = {(size_t)(batch * layer.numFilters), (size_t)outRows, (size_t)outCols};
+        return addStep(forwardSteps, prefix + "_a = convolution_int8", "convolution_int8", 3, global,
+            {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, inMaps, batch}, {previous.a, layer.syn, layer.lut, layer.a}, NULL, 1, {1.0f});
+    }
+    case LAYER_MAXPOOL:
+    {
+        size_t global[2] = {(size_t)rows, (size_t)cols};
+        return addStep(forwardSteps, prefix + "_a = maxpool_int8", "maxpool_int8", 2, global,
+            {rows, cols}, {previous.a, layer.a});
+    }
+    case LAYER_FULLY_CONNECTED:
+    {
+        int inputs = layer.syn->rows;
+        size_t global[2] = {(size_t)outRows, (size_t)batch};
+        return addStep(forwardSteps, prefix + "_a = matrix_transpose_multiply_int8", "matrix_transpose_multiply_int8", 2, global,
+            {inputs, outRows, batch}, {layer.syn, previous.a, layer.lut, layer.a}, NULL, 1, {1.0f});
+    }
+    default:
+        return false;
+    }
+}
+
+/* Records the error propagation of one layer and its weight update, walking the layers backwards */
+bool Network::buildBackward(size_t index)
+{
+    Layer& layer = layers[index];
+    const Layer& previous = layers[index - 1];
+    string prefix = "L" + to_string(index);
+    int inRows = previous.outRows, inCols = previous.outCols, inMaps = previous.outMaps;
+    int outRows = layer.outRows, outCols = layer.outCols;
+    int rows = layer.a->rows, cols = layer.a->cols;
+    int batch = batchSize;
+    bool hasPrevious = index > 1;
+    bool isLast = index == layers.size() - 1;
+    size_t global2[2] = {(size_t)rows, (size_t)cols};
+    bool success = true;
+
+    stepLayer = index;
+
+    if (isLast && fusion && hasSigmoid(index))
+    {
+        success &= addStep(backwardSteps, prefix + "_d = output_delta", "output_delta", 2, global2,
+            {rows, cols}, {targetTensor, layer.a, layer.d});
+    }
+    else if (isLast)
+    {
+        success &= addStep(backwardSteps, prefix + "_e = matrix_subtract", "matrix_subtract", 2, global2,
+            {rows, cols}, {targetTensor, layer.a, layer.e});
+    }
+
+    if (layer.type == LAYER_MAXPOOL)
+    {
+        if (hasPrevious && fusesDelta(index - 1))
+        {
+            success &= addStep(backwardSteps, "L" + to_string(index - 1) + "_d = maxpool_delta", "maxpool_delta", 2, global2,
+                {rows, cols}, {layer.e, layer.ind, layer.a, previous.d});
+        }
+        else if (hasPrevious)
+        {
+            success &= addStep(backwardSteps, "L" + to_string(index - 1) + "_e = maxpool_error", "maxpool_error", 2, global2,
+                {rows, cols}, {layer.e, layer.ind, previous.e});
+        }
+        return success;
+    }
+
+    /* Otherwise the delta was already written by output_delta or by the layer after this one */
+    if (!(isLast && fusion) && !fusesDelta(index))
+    {
+        success &= addStep(backwardSteps, prefix + "_g = sigmoid_derivative", "sigmoid_derivative", 2, global2,
+            {rows, cols}, {layer.a, layer.g});
+        success &= addStep(backwardSteps, prefix + "_d = matrix_point_multiply", "matrix_point_multiply", 2, global2,
+            {rows, cols}, {layer.e, layer.g, layer.d});
+    }
+
+    if (layer.type == LAYER_FULLY_CONNECTED)
+    {
+        /* dsyn = a * d^T sums the update over the batch, e = syn * d */
+        int inputs = layer.syn->rows;
+        size_t globalSyn[2] = {(size_t)inputs, (size_t)outRows};
+        success &= addStep(backwardSteps, prefix + "_dsyn = matrix_multiply_transpose", "matrix_multiply_transpose", 2, globalSyn,
+            {inputs, batch, outRows}, {previous.a, layer.d, layer.dsyn});
+
+        if (hasPrevious)
+        {
+            size_t globalError[2] = {(size_t)inputs, (size_t)batch};
+
+            if (fusesDelta(index - 1))
+            {
+                success &= addStep(backwardSteps, "L" + to_string(index - 1) + "_d = matrix_multiply_sigmoid_delta", "matrix_multiply_sigmoid_delta", 2, globalError,
+                    {inputs, outRows, batch}, {layer.syn, layer.d, previous.a, previous.d});
+            }
+            else
+            {
+                success &= addStep(backwardSteps, "L" + to_string(index - 1) + "_e = matrix_multiply", "matrix_multiply", 2, globalError,
+                    {inputs, outRows, batch}, {layer.syn, layer.d, previous.e});
+            }
+        }
+    }
+    else
+    {
+        size_t globalSyn[3] = {(size_t)layer.numFilters, (size_t)layer.filterSize, (size_t)layer.filterSize};
+
+        if (convolutionOf(index) != CONVOLUTION_DIRECT)
+        {
+            int numMaps = layer.type == LAYER_CONVOLUTION ? 1 : inMaps;
+            int filtersPerMap = (layer.numFilters + numMaps - 1) / numMaps;
+            int taps = layer.filterSize * layer.filterSize;
+            size_t globalGemm[3] = {(size_t)taps, (size_t)filtersPerMap, (size_t)(numMaps * layer.splits)};
+            size_t local[3] = {CONVOLUTION_TILE, CONVOLUTION_TILE, 1};
+            Tensor* partial = layer.splits > 1 ? layer.partial : layer.dsyn;
+
+            success &= addStep(backwardSteps, prefix + "_dsyn = back_convolution_gemm", "back_convolution_gemm", 3, globalGemm,
+                {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, numMaps, batch, layer.splits}, {previous.a, layer.d, partial}, local);
+
+            if (layer.splits > 1)
+            {
+                int size = layer.dsyn->size();
+                size_t globalSum[1] = {(size_t)size};
+                success &= addStep(backwardSteps, prefix + "_dsyn = split_sum", "split_sum", 1, globalSum,
+                    {size, layer.splits}, {layer.partial, layer.dsyn});
+            }
+        }
+        else if (layer.type == LAYER_CONVOLUTION)
+        {
+            success &= addStep(backwardSteps, prefix + "_dsyn = back_convolution", "back_convolution", 3, globalSyn,
+                {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, batch}, {previous.a, layer.d, layer.dsyn});
+        }
+        else
+        {
+            success &= addStep(backwardSteps, prefix + "_dsyn = back_convolution16", "back_convolution16", 3, globalSyn,
+                {inRows, inCols, outRows, outCols, layer.numFilters, layer.filterSize, inMaps, batch}, {previous.a, layer.d, layer.dsyn});
+        }
+
+        if (hasPrevious)
+        {
+            string previousPrefix = "L" + to_string(index - 1);
+
+            if (deconvolution == DECONVOLUTION_GATHER)
+            {
+                size_t globalError[3] = {(size_t)(batch * inMaps), (size_t)inRows, (size_t)inCols};
+
+                success &= addStep(backwardSteps, previousPrefix + "_e = deconvolution16_gather", "deconvolution16_gather", 3, globalError,
+                    {outRows, outCols, inRows, inCols, layer.numFilters, layer.filterSize, inMaps, batch}, {layer.d, layer.syn, previous.e});
+            }
+            else
+            {
+                size_t globalZero[2] = {previous.e->rows, previous.e->cols};
+                size_t globalError[3] = {(size_t)(batch * layer.numFilters), (size_t)outRows, (size_t)outCols};
+
+                /* deconvolution16 accumulates into its output */
+                success &= addStep(backwardSteps, previousPrefix + "_e = 0", "matrix_zero", 2, globalZero,
+                    {(int)previous.e->rows, (int)previous.e->cols}, {previous.e});
+                success &= addStep(backwardSteps, previousPrefix + "_e = deconvolution16", "deconvolution16", 3, globalError,
+                    {outRows, outCols, inRows, inCols, layer.numFilters, layer.filterSize, inMaps, batch}, {layer.d, layer.syn, previous.e});
+            }
+        }
+    }
+
+    return success;
+}
+
+/*
+    Lays every syn out in weights and every dsyn at the same offset of gradients, each slice starting
+    on the sub-buffer alignment, and records the update as one dispatch over all of them.
+    The update covers every layer, the profiler books it on layer 0.
+*/
+bool Network::buildOptimizer()
+{
+    size_t stride = alignment / sizeof(cl_float);
+    size_t total = 0;
+    vector<size_t> offsets;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        offsets.push_back(total);
+
+        if (layers[i].syn != NULL)
+        {
+            total += (layers[i].syn->size() + stride - 1) / stride * stride;
+        }
+    }
+
+    weights = createTensor("weights", total, 1);
+    gradients = createTensor("gradients", total, 1);
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].syn != NULL)
+        {
+            Slice syn = {layers[i].syn, weights, offsets[i] * sizeof(cl_float)};
+            Slice dsyn = {layers[i].dsyn, gradients, offsets[i] * sizeof(cl_float)};
+
+            slices.push_back(syn);
+            slices.push_back(dsyn);
+        }
+    }
+
+    int size = total;
+    size_t global[1] = {total};
+    size_t global2[2] = {total, 1};
+    bool success = true;
+
+    stepLayer = 0;
+
+    if (accumulation)
+    {
+        gradientSum = createTensor("gradient_sum", total, 1);
+
+        /* A split_sum over one slice is a copy */
+        success &= addStep(saveGradientSteps, "gradient_sum = split_sum", "split_sum", 1, global,
+            {size, 1}, {gradients, gradientSum});
+        success &= addStep(addGradientSteps, "gradients = matrix_add", "matrix_add", 2, global2,
+            {size, 1}, {gradients, gradientSum, gradients});
+    }
+
+    switch (optimizer.type)
+    {
+    case OPTIMIZER_SGD:
+        success &= addStep(updateSteps, "syn = sgd", "sgd", 1, global,
+            {size}, {gradients, weights}, NULL, 1, {optimizer.learningRate, optimizer.weightDecay});
+        break;
+
+    case OPTIMIZER_MOMENTUM:
+    case OPTIMIZER_NESTEROV:
+        optimizerState.push_back(createTensor("velocity", total, 1));
+        success &= addStep(updateSteps, "syn = sgd_momentum", "sgd_momentum", 1, global,
+            {size, optimizer.type == OPTIMIZER_NESTEROV}, {gradients, optimizerState[0], weights}, NULL, 2,
+            {optimizer.learningRate, optimizer.momentum, optimizer.weightDecay});
+        break;
+
+    case OPTIMIZER_ADAM:
+        /* The bias corrections are set by stepOptimizer() before every update */
+        optimizerState.push_back(createTensor("moment1", total, 1));
+        optimizerState.push_back(createTensor("moment2", total, 1));
+        success &= addStep(updateSteps, "syn = adam", "adam", 1, global,
+            {size}, {gradients, optimizerState[0], optimizerState[1], weights}, NULL, 3,
+            {optimizer.learningRate, optimizer.momentum, optimizer.beta2, optimizer.epsilon, optimizer.weightDecay, 1.0f, 1.0f});
+        break;
+    }
+
+    return success;
+}
+
+/* Adam corrects its moments by 1 / (1 - beta^t), the only kernel arguments that change after build() */
+bool Network::stepOptimizer()
+{
+    if (optimizer.type != OPTIMIZER_ADAM)
+    {
+        return true;
+    }
+
+    Step& step = updateSteps.front();
+    optimizerSteps++;
+
+    float correction1 = 1.0f / (1.0f - pow(optimizer.momentum, (float)optimizerSteps));
+    float correction2 = 1.0f / (1.0f - pow(optimizer.beta2, (float)optimizerSteps));
+
+    if (!checkSuccess(clSetKernelArg(step.kernel, step.firstBuffer - 2, sizeof(float), &correction1))
+        || !checkSuccess(clSetKernelArg(step.kernel, step.firstBuffer - 1, sizeof(float), &correction2)))
+    {
+        cerr << "Failed setting the Adam bias corrections. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Network::resetOptimizer()
+{
+    bool fillSuccess = true;
+
+    for (size_t i = 0; i < optimizerState.size(); i++)
+    {
+        fillSuccess &= fill(optimizerState[i], 0);
+    }
+
+    optimizerSteps = 0;
+    return fillSuccess;
+}
+
+static float largest(const vector<float>& values)
+{
+    float result = 0;
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        result = max(result, fabs(values[i]));
+    }
+
+    return result;
+}
+
+/* Scale that maps range to INT8_LEVELS, an all zero tensor keeps 1 */
+static float scaleOf(float range)
+{
+    return range > 0 ? range / INT8_LEVELS : 1.0f;
+}
+
+bool Network::calibrate(Network& trained, const float* images)
+{
+    if (precision != PRECISION_INT8 || forwardSteps.empty())
+    {
+        cerr << "Only a built int8 network can be calibrated. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* The same layers in float, unfused and unplanned so every activation can still be read after the pass */
+    Network reference(batchSize);
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        Layer layer = describeLayer(layers[i].type, layers[i].numFilters, layers[i].filterSize);
+
+        layer.outMaps = layers[i].outMaps;
+        layer.outRows = layers[i].outRows;
+        layer.outCols = layers[i].outCols;
+        reference.layers.push_back(layer);
+    }
+
+    reference.setFusion(false);
+    reference.setMemoryPlanning(false);
+
+    vector<Tensor*> from = trained.parameters();
+
+    if (!reference.build(programFile, false) || from.size() != reference.parameters().size())
+    {
+        cerr << "Failed to build the float network to calibrate against. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    bool copySuccess = true;
+
+    for (size_t i = 0; i < from.size(); i++)
+    {
+        vector<float> weights(from[i]->size());
+        copySuccess = copySuccess && trained.read(from[i], &weights[0]) && reference.write(reference.parameters()[i], &weights[0]);
+    }
+
+    vector<float> outputs(reference.output()->size());
+
+    if (!copySuccess || !reference.predict(images, &outputs[0], batchSize))
+    {
+        return false;
+    }
+
+    /* The sigmoid layers carry their activation scale on, the pools keep that of their input */
+    vector<float> image(images, images + inputTensor->size());
+    layers[0].a->scale = scaleOf(largest(image));
+
+    float inverse = 1.0f / layers[0].a->scale;
+    bool calibrateSuccess = checkSuccess(clSetKernelArg(forwardSteps[0].kernel, forwardSteps[0].firstBuffer - 1, sizeof(float), &inverse));
+
+    for (size_t i = 1; i < layers.size() && calibrateSuccess; i++)
+    {
+        Layer& layer = layers[i];
+        const Layer& measured = reference.layers[i];
+
+        if (layer.type == LAYER_MAXPOOL)
+        {
+            layer.a->scale = layers[i - 1].a->scale;
+            continue;
+        }
+
+        vector<float> weights(layer.syn->size()), activations(layer.a->size());
+
+        calibrateSuccess &= reference.read(measured.syn, &weights[0]) && reference.read(measured.a, &activations[0]);
+        layer.syn->scale = scaleOf(largest(weights));
+        layer.a->scale = scaleOf(largest(activations));
+
+        /* The sigmoid inputs are only known through the activations, the logit gives them back */
+        float range = 0;
+
+        for (size_t j = 0; j < activations.size(); j++)
+        {
+            float a = activations[j];
+            range = max(range, a <= 0 || a >= 1 ? SIGMOID_RANGE : fabs(log(a / (1 - a))));
+        }
+
+        float inputScale = scaleOf(min(range, SIGMOID_RANGE));
+        float rescale = layer.syn->scale * layers[i - 1].a->scale / inputScale;
+        vector<float> table(layer.lut->size());
+
+        /* lut[y + 128] = sigmoid(y) in the scale of a, the lut itself keeps a scale of 1 */
+        for (size_t j = 0; j < table.size(); j++)
+        {
+            float y = ((int)j - INT8_LEVELS - 1) * inputScale;
+            table[j] = nearbyint(1 / (1 + exp(-y)) / layer.a->scale);
+        }
+
+        calibrateSuccess &= write(layer.syn, &weights[0]) && write(layer.lut, &table[0]);
+
+        for (size_t j = 0; j < forwardSteps.size(); j++)
+        {
+            if (forwardSteps[j].layer == i)
+            {
+                calibrateSuccess &= checkSuccess(clSetKernelArg(forwardSteps[j].kernel, forwardSteps[j].firstBuffer - 1, sizeof(float), &rescale));
+            }
+        }
+    }
+
+    if (!calibrateSuccess)
+    {
+        cerr << "Failed to calibrate the int8 network. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+Tensor* Network::createTensor(const string& name, size_t rows, size_t cols, size_t element)
+{
+    Tensor* tensor = new Tensor;
+
+    tensor->name = name;
+    tensor->rows = rows;
+    tensor->cols = cols;
+    tensor->element = element;
+    tensor->scale = 1.0f;
+    tensor->buffer = 0;
+    tensor->type = CL_MEM_OBJECT_BUFFER;
+    tensor->slices = 1;
+    tensors.push_back(tensor);
+
+    /* Tensors of build() get their memory once planMemory() knows every step */
+    if (deferAllocation)
+    {
+        return tensor;
+    }
+
+    return allocate(tensor) ? tensor : NULL;
+}
+
+/* An RGBA float image of width x height texels per slice, never placed by planMemory() */
+Tensor* Network::createImage(const string& name, cl_mem_object_type type, size_t width, size_t height, size_t slices)
+{
+    Tensor* tensor = new Tensor;
+
+    tensor->name = name;
+    tensor->rows = height;
+    tensor->cols = width * slices;
+    tensor->element = 4 * sizeof(cl_float);
+    tensor->scale = 1.0f;
+    tensor->buffer = 0;
+    tensor->type = type;
+    tensor->slices = slices;
+    tensors.push_back(tensor);
+
+    if (deferAllocation)
+    {
+        return tensor;
+    }
+
+    return allocate(tensor) ? tensor : NULL;
+}
+
+bool Network::allocate(Tensor* tensor)
+{
+    cl_int errorNumber;
+
+    if (tensor->type != CL_MEM_OBJECT_BUFFER)
+    {
+        cl_image_format format = {CL_RGBA, CL_FLOAT};
+        cl_image_desc description;
+
+        memset(&description, 0, sizeof(description));
+        description.image_type = tensor->type;
+        description.image_width = tensor->cols / tensor->slices;
+        description.image_height = tensor->rows;
+        description.image_array_size = tensor->slices;
+
+        tensor->buffer = clCreateImage(context, CL_MEM_READ_WRITE, &format, &description, NULL, &errorNumber);
+    }
+    else
+    {
+        tensor->buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, tensor->bytes(), NULL, &errorNumber);
+    }
+
+    if (!checkSuccess(errorNumber))
+    {
+        tensor->buffer = 0;
+        cerr << "Failed to create OpenCL memory for " << tensor->name << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Sizes and float scalars of step, the arguments ahead of its buffers */
+static bool setScalars(const Step& step)
+{
+    bool setKernelArgumentsSuccess = true;
+    cl_uint argument = 0;
+
+    for (size_t i = 0; i < step.sizes.size(); i++)
+    {
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(step.kernel, argument++, sizeof(int), (void*)&step.sizes[i]));
+    }
+
+    for (size_t i = 0; i < step.scalars.size(); i++)
+    {
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(step.kernel, argument++, sizeof(float), (void*)&step.scalars[i]));
+    }
+
+    return setKernelArgumentsSuccess;
+}
+
+bool Network::addStep(vector<Step>& schedule, const string& label, const string& kernelName,
+                      cl_uint dimensions, const size_t* work, const vector<int>& sizes, const vector<Tensor*>& buffers,
+                      const size_t* local, size_t outputs, const vector<float>& scalars)
+{
+    cl_int errorNumber;
+    Step step;
+
+    step.label = label;
+    step.kernelName = kernelName;
+    step.layer = stepLayer;
+    step.dimensions = dimensions;
+    step.specialized = false;
+
+    if (specialization)
+    {
+        step.kernel = variants.createKernel(kernelName, sizes, &step.specialized);
+        errorNumber = step.kernel != NULL ? CL_SUCCESS : CL_INVALID_KERNEL;
+    }
+    else
+    {
+        step.kernel = clCreateKernel(program, kernelName.c_str(), &errorNumber);
+    }
+
+    if (!checkSuccess(errorNumber))
+    {
+        cerr << "Failed to create OpenCL kernel " << kernelName << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* Kernels that tile through local memory bring their own local size */
+    if (local != NULL)
+    {
+        for (cl_uint i = 0; i < dimensions; i++)
+        {
+            step.local[i] = local[i];
+            step.global[i] = (work[i] + local[i] - 1) / local[i] * local[i];
+        }
+    }
+    else if (!planLaunch(step.kernel, device, limits, dimensions, work, step.global, step.local))
+    {
+        cerr << "Failed to plan the launch of " << label << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        clReleaseKernel(step.kernel);
+        return false;
+    }
+
+    /* Every kernel takes its sizes first, then its float scalars and its buffers last, the last outputs of them are written */
+    step.tensors = buffers;
+    step.sizes = sizes;
+    step.scalars = scalars;
+    step.firstBuffer = sizes.size() + scalars.size();
+    step.outputs = outputs;
+
+    /* The buffers are only known after planMemory(), which calls setBuffers() */
+    bool setKernelArgumentsSuccess = setScalars(step);
+
+    schedule.push_back(step);
+
+    if (!setKernelArgumentsSuccess)
+    {
+        cerr << "Failed setting OpenCL kernel arguments for " << label << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Network::setBuffers(Step& step)
+{
+    size_t firstOutput = step.tensors.size() - step.outputs;
+    bool setKernelArgumentsSuccess = true;
+
+    step.reads.clear();
+    step.writes.clear();
+
+    /* A NULL tensor is a NULL buffer argument, the kernel skips what it would have written there */
+    for (size_t i = 0; i < step.tensors.size(); i++)
+    {
+        cl_mem buffer = step.tensors[i] != NULL ? step.tensors[i]->buffer : 0;
+
+        (i < firstOutput ? step.reads : step.writes).push_back(buffer);
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(step.kernel, step.firstBuffer + i, sizeof(cl_mem), (void*)&buffer));
+    }
+
+    if (!setKernelArgumentsSuccess)
+    {
+        cerr << "Failed setting OpenCL kernel arguments for " << step.label << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Bytes [offset, offset + size) of an arena, in use from step first to step last */
+struct Placement
+{
+    size_t tensor;
+    size_t arena;
+    size_t offset;
+    size_t size;
+    size_t first;
+    size_t last;
+};
+
+/* First step of a tensor no step touches */
+#define NO_STEP ((size_t)-1)
+
+static bool overlapping(const Placement& a, const Placement& b)
+{
+    return a.arena == b.arena && a.first <= b.last && b.first <= a.last;
+}
+
+/*
+    Steps are numbered forward, backward, update, the order train() enqueues them in. A tensor whose
+    first access in a pass is a write carries nothing over from the pass before, so it only needs
+    memory from that write to its last read. Those tensors are placed largest first, each at the
+    lowest offset of the first arena where it overlaps no tensor alive at the same time and the
+    arena stays within the largest allocation the device allows; a new arena starts when none has room.
+    Tensors no step touches, like the ones fusion skips, get no memory at all. Everything else gets
+    a buffer of its own, and so does every tensor with planning off.
+*/
+bool Network::planMemory()
+{
+    vector<Step>* schedules[] = {&transformSteps, &forwardSteps, &backwardSteps, &updateSteps, &saveGradientSteps, &addGradientSteps};
+    vector<size_t> first(tensors.size(), NO_STEP), last(tensors.size(), NO_STEP);
+    vector<bool> readFirst(tensors.size(), false);
+    size_t position = 0;
+
+    deferAllocation = false;
+
+    for (int i = 0; i < 6; i++)
+    {
+        for (size_t j = 0; j < schedules[i]->size(); j++, position++)
+        {
+            const Step& step = (*schedules[i])[j];
+
+            /* Reads come before writes in the buffers of a step, so a tensor a step updates in place counts as read */
+            for (size_t k = 0; k < step.tensors.size(); k++)
+            {
+                size_t index = find(tensors.begin(), tensors.end(), step.tensors[k]) - tensors.begin();
+
+                if (index == tensors.size())
+                {
+                    continue;
+                }
+
+                if (first[index] == NO_STEP)
+                {
+                    first[index] = position;
+                    readFirst[index] = k + step.outputs < step.tensors.size();
+                }
+
+                last[index] = position;
+            }
+        }
+    }
+
+    /*
+        The host writes or reads these between passes, the weights and the optimizer state carry over
+        from pass to pass; the optimizer updates them in place, which only lists them as written.
+    */
+    vector<Tensor*> kept = parameters();
+    kept.push_back(input());
+    kept.push_back(output());
+    kept.push_back(targetTensor);
+    kept.push_back(weights);
+    kept.push_back(gradients);
+    kept.insert(kept.end(), optimizerState.begin(), optimizerState.end());
+
+    /* Carries the gradients across the backward steps of an accumulating backward() */
+    if (gradientSum != NULL)
+    {
+        kept.push_back(gradientSum);
+    }
+
+    /* Transformed filters outlive the pass that wrote them */
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].u != NULL)
+        {
+            kept.push_back(layers[i].u);
+        }
+    }
+
+    cl_ulong maxAllocation = 0;
+
+    if (!checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocation), &maxAllocation, NULL)))
+    {
+        cerr << "Failed to query the largest allocation of the device. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    vector<size_t> planned;
+    vector<bool> sliced(tensors.size(), false);
+    bool allocateSuccess = true;
+
+    for (size_t i = 0; i < slices.size(); i++)
+    {
+        sliced[find(tensors.begin(), tensors.end(), slices[i].tensor) - tensors.begin()] = true;
+    }
+
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        if (sliced[i])
+        {
+            continue;
+        }
+
+        if (!memoryPlanning || readFirst[i] || tensors[i]->type != CL_MEM_OBJECT_BUFFER || find(kept.begin(), kept.end(), tensors[i]) != kept.end())
+        {
+            allocateSuccess = allocateSuccess && allocate(tensors[i]);
+        }
+        else if (first[i] != NO_STEP)
+        {
+            planned.push_back(i);
+        }
+    }
+
+    for (size_t i = 0; i < slices.size() && allocateSuccess; i++)
+    {
+        cl_int errorNumber;
+        Tensor* tensor = slices[i].tensor;
+        cl_buffer_region region = {slices[i].offset, tensor->bytes()};
+
+        tensor->buffer = clCreateSubBuffer(slices[i].whole->buffer, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &errorNumber);
+
+        if (!checkSuccess(errorNumber))
+        {
+            tensor->buffer = 0;
+            cerr << "Failed to create OpenCL sub-buffer for " << tensor->name << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+    }
+
+    stable_sort(planned.begin(), planned.end(), [this](size_t a, size_t b) { return tensors[a]->bytes() > tensors[b]->bytes(); });
+
+    vector<Placement> placements;
+    vector<size_t> arenaSizes;
+
+    for (size_t i = 0; i < planned.size(); i++)
+    {
+        size_t index = planned[i];
+        size_t size = (tensors[index]->bytes() + alignment - 1) / alignment * alignment;
+        Placement placement = {index, 0, 0, size, first[index], last[index]};
+
+        for (;; placement.arena++)
+        {
+            if (placement.arena == arenaSizes.size())
+            {
+                placement.offset = 0;
+                arenaSizes.push_back(0);
+                break;
+            }
+
+            /* The lowest free offset is either the start of the arena or the end of a tensor in the way */
+            vector<size_t> candidates(1, 0);
+            bool found = false;
+
+            for (size_t j = 0; j < placements.size(); j++)
+            {
+                if (overlapping(placement, placements[j]))
+                {
+                    candidates.push_back(placements[j].offset + placements[j].size);
+                }
+            }
+
+            sort(candidates.begin(), candidates.end());
+
+            for (size_t j = 0; j < candidates.size() && !found; j++)
+            {
+                placement.offset = candidates[j];
+                found = placement.offset + size <= maxAllocation;
+
+                for (size_t k = 0; k < placements.size() && found; k++)
+                {
+                    const Placement& other = placements[k];
+                    found = !overlapping(placement, other) || placement.offset >= other.offset + other.size || other.offset >= placement.offset + size;
+                }
+            }
+
+            if (found)
+            {
+                break;
+            }
+        }
+
+        arenaSizes[placement.arena] = max(arenaSizes[placement.arena], placement.offset + size);
+        placements.push_back(placement);
+    }
+
+    for (size_t i = 0; i < arenaSizes.size() && allocateSuccess; i++)
+    {
+        cl_int errorNumber;
+        cl_mem arena = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, arenaSizes[i], NULL, &errorNumber);
+
+        if (!checkSuccess(errorNumber))
+        {
+            cerr << "Failed to create OpenCL buffer for arena " << i << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+
+        arenas.push_back(arena);
+    }
+
+    for (size_t i = 0; i < placements.size() && allocateSuccess; i++)
+    {
+        cl_int errorNumber;
+        Tensor* tensor = tensors[placements[i].tensor];
+        cl_buffer_region region = {placements[i].offset, tensor->bytes()};
+
+        tensor->buffer = clCreateSubBuffer(arenas[placements[i].arena], CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &errorNumber);
+
+        if (!checkSuccess(errorNumber))
+        {
+            tensor->buffer = 0;
+            cerr << "Failed to create OpenCL sub-buffer for " << tensor->name << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+    }
+
+    for (int i = 0; i < 6 && allocateSuccess; i++)
+    {
+        for (size_t j = 0; j < schedules[i]->size(); j++)
+        {
+            allocateSuccess &= setBuffers((*schedules[i])[j]);
+        }
+    }
+
+    return allocateSuccess;
+}
+
+bool Network::enqueue(const vector<Step>& schedule, const string& pass)
+{
+    vector<cl_event> waitList;
+
+    for (size_t i = 0; i < schedule.size(); i++)
+    {
+        const Step& step = schedule[i];
+        cl_event event = 0;
+
+        if (outOfOrder)
+        {
+            scheduler.dependencies(step.reads, step.writes, &waitList);
+        }
+
+        if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, step.kernel, step.dimensions, NULL, step.global, step.local,
+            waitList.size(), waitList.empty() ? NULL : &waitList[0], (profiling || outOfOrder) ? &event : NULL)))
+        {
+            cerr << "Failed enqueuing " << step.label << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+
+        if (outOfOrder)
+        {
+            scheduler.record(step.reads, step.writes, event);
+        }
+
+        if (profiling)
+        {
+            profiler.record(step.label, step.kernelName, pass, step.layer, event);
+        }
+        else if (outOfOrder)
+        {
+            clReleaseEvent(event);
+        }
+    }
+
+    return true;
+}
+
+/* IEEE 754 binary16, rounded to nearest even like the device rounds its stores */
+static cl_half toHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t mantissa = bits & 0x7fffff;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+
+    if (((bits >> 23) & 0xff) == 0xff)
+    {
+        return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+    }
+
+    if (exponent >= 31)
+    {
+        return sign | 0x7c00;
+    }
+
+    /* Subnormal or zero, the implicit leading one shifts into the mantissa */
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+        {
+            return sign;
+        }
+
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+
+        return sign | (half + (rest > halfway || (rest == halfway && (half & 1)) ? 1 : 0));
+    }
+
+    /* A carry out of the mantissa correctly bumps the exponent, up to infinity */
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+
+    return sign | (half + (rest > 0x1000 || (rest == 0x1000 && (half & 1)) ? 1 : 0));
+}
+
+static float fromHalf(cl_half value)
+{
+    uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0)
+    {
+        float subnormal = ldexp((float)mantissa, -24);
+        return sign != 0 ? -subnormal : subnormal;
+    }
+
+    if (exponent == 0x1f)
+    {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else
+    {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/* count values between host floats and the mapped storage of tensor */
+static void store(const Tensor* tensor, void* mapped, const float* data, size_t count)
+{
+    if (tensor->element == sizeof(cl_char))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            float level = nearbyint(data[i] / tensor->scale);
+            ((cl_char*)mapped)[i] = (cl_char)max(-(float)INT8_LEVELS, min((float)INT8_LEVELS, level));
+        }
+    }
+    else if (tensor->element == sizeof(cl_half))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            ((cl_half*)mapped)[i] = toHalf(data[i]);
+        }
+    }
+    else
+    {
+        memcpy(mapped, data, count * sizeof(cl_float));
+    }
+}
+
+static void load(const Tensor* tensor, const void* mapped, float* data, size_t count)
+{
+    if (tensor->element == sizeof(cl_char))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            data[i] = ((const cl_char*)mapped)[i] * tensor->scale;
+        }
+    }
+    else if (tensor->element == sizeof(cl_half))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            data[i] = fromHalf(((const cl_half*)mapped)[i]);
+        }
+    }
+    else
+    {
+        memcpy(data, mapped, count * sizeof(cl_float));
+    }
+}
+
+/* The transforms only run when the weights changed since the last pass */
+bool Network::forward()
+{
+    if (transformsStale && !enqueue(transformSteps, "transform"))
+    {
+        return false;
+    }
+
+    transformsStale = false;
+    return enqueue(forwardSteps, "forward");
+}
+
+bool Network::train()
+{
+    return backward() && update();
+}
+
+/* The backward steps overwrite dsyn, so an accumulating pass keeps the earlier sum aside and adds it back */
+bool Network::backward(bool accumulate)
+{
+    if (targetTensor == NULL)
+    {
+        cerr << "Network was not built for training. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!accumulate)
+    {
+        return forward() && enqueue(backwardSteps, "backward");
+    }
+
+    if (gradientSum == NULL)
+    {
+        cerr << "Network was not built with setAccumulation(true). " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return enqueue(saveGradientSteps, "backward") && forward() && enqueue(backwardSteps, "backward")
+        && enqueue(addGradientSteps, "backward");
+}
+
+bool Network::update()
+{
+    if (targetTensor == NULL)
+    {
+        cerr << "Network was not built for training. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    transformsStale = true;
+    return stepOptimizer() && enqueue(updateSteps, "update");
+}
+
+/*
+    Blocks until the outputs are read, the one point where the host waits: the input upload, the forward
+    pass and the readback are queued back to back. Only the columns of the first samples are copied
+    either way, the rest of the batch is computed on whatever it held before.
+*/
+bool Network::predict(const float* images, float* outputs, size_t samples)
+{
+    Tensor* in = input();
+    Tensor* out = output();
+
+    if (samples == 0 || samples > batchSize)
+    {
+        cerr << "Predict takes 1 to " << batchSize << " samples, not " << samples << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    float* mapped = map(in, true, NULL);
+
+    if (mapped == NULL)
+    {
+        return false;
+    }
+
+    store(in, mapped, images, in->size() / batchSize * samples);
+
+    if (!unmap(in, mapped, true) || !forward())
+    {
+        return false;
+    }
+
+    mapped = map(out, false, NULL);
+
+    if (mapped == NULL)
+    {
+        return false;
+    }
+
+    load(out, mapped, outputs, out->size() / batchSize * samples);
+    return unmap(out, mapped, false);
+}
+
+bool Network::finish()
+{
+    if (!checkSuccess(clFinish(commandQueue)))
+    {
+        cerr << "Failed waiting for kernel execution to finish. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    scheduler.retire();
+    return true;
+}
+
+bool Network::profileReport(ostream& out)
+{
+    if (!profiling)
+    {
+        cerr << "Network was built without profiling. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!finish() || !profiler.collect())
+    {
+        return false;
+    }
+
+    profiler.report(out);
+    return true;
+}
+
+bool Network::profileTrace(const string& filename)
+{
+    if (!profiling)
+    {
+        cerr << "Network was built without profiling. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return finish() && profiler.collect() && profiler.writeTrace(filename);
+}
+
+void Network::memoryReport(ostream& out) const
+{
+    size_t separateBytes = 0, ownBytes = 0, arenaBytes = 0, planned = 0;
+
+    /* Slices of weights and gradients are counted with them */
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        cl_mem parent = 0;
+
+        /* Planned away entirely */
+        if (tensors[i]->buffer == 0)
+        {
+            separateBytes += tensors[i]->bytes();
+            continue;
+        }
+
+        if (clGetMemObjectInfo(tensors[i]->buffer, CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(parent), &parent, NULL) != CL_SUCCESS)
+        {
+            continue;
+        }
+
+        if (parent == 0)
+        {
+            ownBytes += tensors[i]->bytes();
+        }
+        else if (find(arenas.begin(), arenas.end(), parent) != arenas.end())
+        {
+            separateBytes += tensors[i]->bytes();
+            planned++;
+        }
+    }
+
+    separateBytes += ownBytes;
+
+    for (size_t i = 0; i < arenas.size(); i++)
+    {
+        size_t size = 0;
+
+        clGetMemObjectInfo(arenas[i], CL_MEM_SIZE, sizeof(size), &size, NULL);
+        arenaBytes += size;
+    }
+
+    out << "Device memory " << (ownBytes + arenaBytes) / 1024 << " KB, " << separateBytes / 1024 << " KB with a buffer per tensor" << endl;
+    out << planned << " of " << tensors.size() << " tensors share " << arenaBytes / 1024 << " KB in " << arenas.size() << " arenas" << endl;
+}
+
+/* Fastest of SPECIALIZATION_REPEATS launches of kernel with the launch shape of step, each waited for on its own */
+static bool timeKernel(cl_command_queue commandQueue, const Step& step, cl_kernel kernel, double* microseconds)
+{
+    for (int i = 0; i < SPECIALIZATION_REPEATS; i++)
+    {
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+        if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernel, step.dimensions, NULL, step.global, step.local, 0, NULL, NULL))
+            || !checkSuccess(clFinish(commandQueue)))
+        {
+            cerr << "Failed running " << step.label << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            return false;
+        }
+
+        double elapsed = chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+        *microseconds = i == 0 ? elapsed : min(*microseconds, elapsed);
+    }
+
+    return true;
+}
+
+/* The optimizer steps are left out, rerunning them would move the weights */
+bool Network::specializationReport(ostream& out)
+{
+    if (!specialization)
+    {
+        cerr << "Network was built without shape specialisation. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!finish())
+    {
+        return false;
+    }
+
+    vector<Step>* schedules[] = {&transformSteps, &forwardSteps, &backwardSteps};
+    double genericTotal = 0, specializedTotal = 0;
+
+    out << variants.size() << " specialised variants" << endl;
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (size_t j = 0; j < schedules[i]->size(); j++)
+        {
+            const Step& step = (*schedules[i])[j];
+
+            if (!step.specialized)
+            {
+                continue;
+            }
+
+            /* The same arguments on the kernel of the generic program */
+            cl_int errorNumber;
+            Step generic = step;
+            double genericTime = 0, specializedTime = 0;
+
+            generic.kernel = clCreateKernel(program, step.kernelName.c_str(), &errorNumber);
+
+            if (!checkSuccess(errorNumber))
+            {
+                cerr << "Failed to create OpenCL kernel " << step.kernelName << ". " << __FILE__ << ":"<< __LINE__ << endl;
+                return false;
+            }
+
+            bool timeSuccess = setScalars(generic) && setBuffers(generic)
+                && timeKernel(commandQueue, generic, generic.kernel, &genericTime)
+                && timeKernel(commandQueue, step, step.kernel, &specializedTime);
+
+            clReleaseKernel(generic.kernel);
+
+            if (!timeSuccess)
+            {
+                return false;
+            }
+
+            out << step.label << " (";
+            for (size_t k = 0; k < step.sizes.size(); k++)
+            {
+                out << (k > 0 ? ", " : "") << step.sizes[k];
+            }
+            out << "): generic " << genericTime << " us, specialised " << specializedTime << " us, speedup "
+                << genericTime / max(specializedTime, 1e-3) << endl;
+
+            genericTotal += genericTime;
+            specializedTotal += specializedTime;
+        }
+    }
+
+    out << "All specialised steps: generic " << genericTotal << " us, specialised " << specializedTotal << " us, speedup "
+        << genericTotal / max(specializedTotal, 1e-3) << endl;
+    return true;
+}
+
+/* The host side of a tensor is ordered like any kernel: writing waits for its readers, reading for its writer */
+float* Network::map(Tensor* tensor, bool writing, cl_event* event)
+{
+    cl_int errorNumber;
+    vector<cl_mem> buffers(1, tensor->buffer);
+    vector<cl_event> waitList;
+
+    if (tensor->type != CL_MEM_OBJECT_BUFFER)
+    {
+        cerr << tensor->name << " is an image, only kernels can access it. " << __FILE__ << ":"<< __LINE__ << endl;
+        return NULL;
+    }
+
+    /* New weights need new transformed filters */
+    if (writing && !transformSteps.empty())
+    {
+        vector<Tensor*> written = parameters();
+        written.push_back(weights);
+        transformsStale = transformsStale || find(written.begin(), written.end(), tensor) != written.end();
+    }
+
+    if (outOfOrder)
+    {
+        scheduler.dependencies(writing ? vector<cl_mem>() : buffers, writing ? buffers : vector<cl_mem>(), &waitList);
+    }
+
+    float* mapped = (float*)clEnqueueMapBuffer(commandQueue, tensor->buffer, event == NULL ? CL_TRUE : CL_FALSE,
+        writing ? CL_MAP_WRITE : CL_MAP_READ, 0, tensor->bytes(), waitList.size(), waitList.empty() ? NULL : &waitList[0], event, &errorNumber);
+
+    if (!checkSuccess(errorNumber))
+    {
+        cerr << "Failed to map buffer " << tensor->name << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return NULL;
+    }
+
+    /* Whoever waits on the event from another thread needs the map to actually be submitted */
+    if (event != NULL)
+    {
+        clFlush(commandQueue);
+    }
+
+    return mapped;
+}
+
+bool Network::unmap(Tensor* tensor, float* mapped, bool written)
+{
+    cl_event event = 0;
+    vector<cl_mem> buffers(1, tensor->buffer);
+
+    if (!checkSuccess(clEnqueueUnmapMemObject(commandQueue, tensor->buffer, mapped, 0, NULL, outOfOrder ? &event : NULL)))
+    {
+        cerr << "Unmapping memory objects failed " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (outOfOrder)
+    {
+        scheduler.record(written ? vector<cl_mem>() : buffers, written ? buffers : vector<cl_mem>(), event);
+        clReleaseEvent(event);
+    }
+
+    return true;
+}
+
+bool Network::write(Tensor* tensor, const float* data)
+{
+    float* mapped = map(tensor, true, NULL);
+
+    if (mapped == NULL)
+    {
+        return false;
+    }
+
+    store(tensor, mapped, data, tensor->size());
+    return unmap(tensor, mapped, true);
+}
+
+bool Network::fill(Tensor* tensor, float value)
+{
+    vector<float> data(tensor->size(), value);
+
+    return write(tensor, &data[0]);
+}
+
+bool Network::read(Tensor* tensor, float* data)
+{
+    float* mapped = map(tensor, false, NULL);
+
+    if (mapped == NULL)
+    {
+        return false;
+    }
+
+    load(tensor, mapped, data, tensor->size());
+    return unmap(tensor, mapped, false);
+}
+
+bool Network::bind(Tensor* tensor, Tensor* other)
+{
+    vector<Step>* schedules[] = {&transformSteps, &forwardSteps, &backwardSteps, &updateSteps, &saveGradientSteps, &addGradientSteps};
+    bool setKernelArgumentsSuccess = true;
+
+    for (int i = 0; i < 6; i++)
+    {
+        for (size_t j = 0; j < schedules[i]->size(); j++)
+        {
+            Step& step = (*schedules[i])[j];
+            size_t firstOutput = step.tensors.size() - step.outputs;
+
+            for (size_t k = 0; k < step.tensors.size(); k++)
+            {
+                if (step.tensors[k] != tensor)
+                {
+                    continue;
+                }
+
+                setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(step.kernel, step.firstBuffer + k, sizeof(cl_mem), (void*)&other->buffer));
+
+                if (k < firstOutput)
+                {
+                    step.reads[k] = other->buffer;
+                }
+                else
+                {
+                    step.writes[k - firstOutput] = other->buffer;
+                }
+            }
+        }
+    }
+
+    if (!setKernelArgumentsSuccess)
+    {
+        cerr << "Failed binding " << other->name << " in place of " << tensor->name << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+Tensor* Network::tensor(const string& name)
+{
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        if (tensors[i]->name == name)
+        {
+            return tensors[i];
+        }
+    }
+
+    return NULL;
+}
+
+size_t Network::batch() const
+{
+    return batchSize;
+}
+
+Tensor* Network::input()
+{
+    return inputTensor;
+}
+
+Tensor* Network::target()
+{
+    return targetTensor;
+}
+
+Tensor* Network::output()
+{
+    return layers.back().a;
+}
+
+vector<Tensor*> Network::parameters()
+{
+    vector<Tensor*> result;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].syn != NULL)
+        {
+            result.push_back(layers[i].syn);
+        }
+    }
+
+    return result;
+}
+
+vector<Tensor*> Network::parameterGradients()
+{
+    vector<Tensor*> result;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].dsyn != NULL)
+        {
+            result.push_back(layers[i].dsyn);
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,285 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include "launch.h"
+#include "layer.h"
+#include "optimizer.h"
+#include "profiler.h"
+#include "program.h"
+#include "scheduler.h"
+#include "tensor.h"
+
+#include <CL/cl.h>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+    One recorded kernel launch. Every step owns its own cl_kernel, so the arguments are set
+    once in Network::build() and replaying a schedule is nothing but clEnqueueNDRangeKernel calls.
+    global is already padded to a multiple of local, see planLaunch(). reads and writes are the
+    buffers the kernel touches, which is all the Scheduler needs to order it on an out-of-order queue.
+    tensors are the buffer arguments as recorded, starting at argument firstBuffer, the last outputs
+    of them are written; Network::bind() uses them to point the step at another buffer. A NULL
+    tensor is passed as a NULL buffer, which the pooling kernels take as "no indices".
+    sizes and scalars are the other arguments, sizes also being the shape a specialised kernel
+    was built for.
+*/
+struct Step
+{
+    std::string label;
+    std::string kernelName;
+    size_t layer;
+    cl_kernel kernel;
+    cl_uint dimensions;
+    size_t global[3];
+    size_t local[3];
+    std::vector<cl_mem> reads;
+    std::vector<cl_mem> writes;
+    std::vector<Tensor*> tensors;
+    cl_uint firstBuffer;
+    size_t outputs;
+    std::vector<int> sizes;
+    std::vector<float> scalars;
+    bool specialized;   /* kernel comes from a variant of the ProgramCache, not the generic program */
+};
+
+/* Kernels the convolution layers run on */
+enum ConvolutionKernel
+{
+    CONVOLUTION_GEMM,           /* convolution_gemm and back_convolution_gemm, tiled implicit GEMM */
+    CONVOLUTION_DIRECT,         /* convolution(16) and back_convolution(16), one loop per output */
+    CONVOLUTION_WINOGRAD,       /* winograd_input and winograd_output, F(2x2, 5x5) for 5x5 filters, trains on GEMM */
+    CONVOLUTION_IMAGE           /* image_input and convolution_image, maps and filters read as RGBA images, trains on GEMM */
+};
+
+/* How the error of a convolution16 layer is propagated back to its input maps */
+enum DeconvolutionKernel
+{
+    DECONVOLUTION_GATHER,       /* deconvolution16_gather, deterministic, no atomics */
+    DECONVOLUTION_SCATTER       /* deconvolution16, atomic float adds into a zeroed error */
+};
+
+/*
+    Storage of the activations, errors, deltas and pooling indices. Weights, gradients, the optimizer
+    state and every accumulation stay float, so half precision halves the traffic of the layers
+    without training on rounded weights. PRECISION_HALF needs cl_khr_fp16 and the gather deconvolution.
+    PRECISION_INT8 is inference only: weights and activations are int8 with a scale per tensor that
+    calibrate() takes from a float forward pass, sums are int and the sigmoid is a lookup table.
+*/
+enum Precision
+{
+    PRECISION_FLOAT,
+    PRECISION_HALF,
+    PRECISION_INT8
+};
+
+/*
+    With fusion on (the default) elementwise work rides along with the kernel before it:
+        convolution + sigmoid + maxpool     convolution_gemm_pool, needs CONVOLUTION_GEMM
+        fully connected + sigmoid           matrix_transpose_multiply_sigmoid_blocked
+        output error + delta                output_delta
+        maxpool error + delta               maxpool_delta
+        fully connected error + delta       matrix_multiply_sigmoid_delta
+    The y, g and e tensors the fused steps skip are still there but no step touches them any more,
+    so with memory planning they get no buffer at all.
+*/
+
+/*
+    Small layer graph: describe the layers with the add* calls, build() records the forward,
+    backward and weight update schedules and allocates every tensor, forward()/train() replay them.
+    Built without training it is a forward-only graph for predict(): no errors, deltas, gradients or
+    pooling indices, the sigmoids work in place and the planner leaves the activations in two
+    ping-pong buffers.
+    Every tensor holds batchSize samples stacked along its columns, so one pass over the schedule
+    processes the whole batch and the weight updates are summed over it.
+
+    Memory planning (on by default) gives a tensor a buffer of its own only when it has to keep
+    its contents between passes: the input, the target, the output, the weights and the optimizer
+    state (for training the weights and their gradients are slices of one buffer each), plus the
+    gradient sum with setAccumulation() and the transformed filters of Winograd layers. Every other
+    tensor is written before it is read within a pass, so it only lives from the first to the last
+    step touching it and shares an arena with tensors whose lifetimes do not overlap its own, see
+    planMemory(). Their contents are therefore only meaningful right after the step writing them;
+    turn planning off to read intermediate tensors after a pass.
+*/
+class Network
+{
+public:
+    explicit Network(size_t batchSize = 1);
+    ~Network();
+
+    void addInput(size_t rows, size_t cols);
+    void addConvolution(int numFilters, int filterSize);
+    void addConvolution16(int numFilters, int filterSize);
+    void addMaxPool();
+    void addFullyConnected(int outputs);
+
+    /* Call before build(), every dispatch then gets an event with its queued/submit/start/end times */
+    void enableProfiling();
+    void setConvolution(ConvolutionKernel kernel);
+    /* Overrides setConvolution() for the convolution layer index */
+    void setLayerConvolution(size_t index, ConvolutionKernel kernel);
+    void setDeconvolution(DeconvolutionKernel kernel);
+    void setFusion(bool enabled);
+    /* On by default, only takes effect for training and when the device supports out-of-order queues */
+    void setOutOfOrder(bool enabled);
+    void setMemoryPlanning(bool enabled);
+    /*
+        Forward-only float graphs shaped like LeNet (convolution + maxpool twice, three fully connected
+        layers) run forward() as one forward_lenet dispatch, one work group per sample with every
+        activation in local memory. Other graphs keep their per layer steps.
+    */
+    void setMegakernel(bool enabled);
+    /*
+        Steps whose kernel takes part in shape specialisation run the variant of the kernels file
+        built for their sizes, see ProgramCache in program.h. Costs a program build per kernel and
+        shape on the first run on a device, the binary cache makes later runs load them instead.
+    */
+    void setSpecialization(bool enabled);
+    /* Off by default, backward(true) needs it: keeps gradient_sum, a second buffer the size of the gradients */
+    void setAccumulation(bool enabled);
+    void setOptimizer(const Optimizer& settings);
+    /* Falls back to float when the device lacks cl_khr_fp16 */
+    void setPrecision(Precision storage);
+    bool build(const std::string& kernelsFile, bool training);
+
+    /* Enqueue one pass, none of these waits for the device, use finish() for that */
+    bool forward();
+    bool train();
+    /* train() in two halves: the gradients of the batch, then one optimizer step with whatever they hold.
+       With accumulate the gradients are added to the ones dsyn already holds, on the device, see setAccumulation() */
+    bool backward(bool accumulate = false);
+    bool update();
+    bool finish();
+    /* Outputs of the first samples images of a batch, samples at most batch(), waits for them */
+    bool predict(const float* images, float* outputs, size_t samples);
+    /* Zeroes the momentum or Adam moments, as build() leaves them */
+    bool resetOptimizer();
+    /*
+        Quantizes the weights of trained, a float network with the same layers, into an int8 network
+        and sets every activation scale from a float forward pass over one batch of images. Sigmoid
+        inputs are clamped to +-8, the sigmoid is saturated beyond that anyway.
+    */
+    bool calibrate(Network& trained, const float* images);
+
+    /* Both wait for the queue and cover every pass enqueued since build() */
+    bool profileReport(std::ostream& out);
+    bool profileTrace(const std::string& filename);
+    /* Device memory of the tensors, planned against what a buffer per tensor would take */
+    void memoryReport(std::ostream& out) const;
+    /*
+        Times every specialised step against the generic kernel with the same arguments and prints
+        the speedup of each variant. Only call it between passes: it reruns forward and backward
+        steps on their own, which overwrites intermediate tensors and gradients.
+    */
+    bool specializationReport(std::ostream& out);
+
+    bool write(Tensor* tensor, const float* data);
+    bool fill(Tensor* tensor, float value);
+    bool read(Tensor* tensor, float* data);
+
+    /* Non-blocking, ordered after every command using tensor, mapped is only valid once *event completes.
+       Hands out the stored values, cl_half rather than float for the activations of a half precision network */
+    float* map(Tensor* tensor, bool writing, cl_event* event);
+    bool unmap(Tensor* tensor, float* mapped, bool written);
+
+    /* Extra tensors of the network, such as the input slots of an InputPipeline */
+    Tensor* createTensor(const std::string& name, size_t rows, size_t cols, size_t element = sizeof(cl_float));
+    /* Every step recorded with tensor reads and writes the buffer of other from now on */
+    bool bind(Tensor* tensor, Tensor* other);
+
+    size_t batch() const;
+    Tensor* tensor(const std::string& name);
+    Tensor* input();
+    Tensor* target();
+    Tensor* output();
+    std::vector<Tensor*> parameters();
+    /* dsyn of every parameter, in the same order */
+    std::vector<Tensor*> parameterGradients();
+
+private:
+    bool addStep(std::vector<Step>& schedule, const std::string& label, const std::string& kernelName,
+                 cl_uint dimensions, const size_t* work, const std::vector<int>& sizes, const std::vector<Tensor*>& buffers,
+                 const size_t* local = NULL, size_t outputs = 1, const std::vector<float>& scalars = std::vector<float>());
+    bool buildLayer(size_t index, bool training);
+    bool buildForward(size_t index);
+    bool buildBackward(size_t index);
+    bool buildQuantized(size_t index);
+    ConvolutionKernel convolutionOf(size_t index) const;
+    bool fitsMegakernel(bool training) const;
+    bool buildMegakernel();
+    bool buildOptimizer();
+    bool stepOptimizer();
+    bool hasSigmoid(size_t index) const;
+    bool fusesPool(size_t index) const;
+    bool fusesDelta(size_t index) const;
+    bool enqueue(const std::vector<Step>& schedule, const std::string& pass);
+    bool createQueue();
+    Tensor* createImage(const std::string& name, cl_mem_object_type type, size_t width, size_t height, size_t slices);
+    bool allocate(Tensor* tensor);
+    bool planMemory();
+    bool setBuffers(Step& step);
+
+    cl_context context;
+    cl_command_queue commandQueue;
+    cl_program program;
+    cl_device_id device;
+    LaunchLimits limits;
+    size_t batchSize;
+    bool profiling;
+    ConvolutionKernel convolution;
+    std::map<size_t, ConvolutionKernel> layerConvolutions;
+    DeconvolutionKernel deconvolution;
+    bool fusion;
+    bool outOfOrder;    /* asked for before build(), whether the queue really is out-of-order after it */
+    bool memoryPlanning;
+    bool megakernel;
+    bool specialization;
+    bool accumulation;
+    Precision precision;    /* as asked for before build(), as built after it */
+    size_t alignment;   /* bytes a sub-buffer has to start on */
+    bool deferAllocation;   /* set while build() creates tensors, planMemory() allocates them */
+    std::string programFile;
+    ProgramCache variants;
+    Profiler profiler;
+    Scheduler scheduler;
+
+    std::vector<Layer> layers;
+    std::vector<Tensor*> tensors;
+    std::vector<cl_mem> arenas;     /* parents of the sub-buffers of planned tensors */
+    Tensor* inputTensor;    /* the float image, layer 0 holds its half copy in a half precision network */
+    Tensor* targetTensor;
+
+    /* Tensors living inside another one, planMemory() makes them sub-buffers of it */
+    struct Slice
+    {
+        Tensor* tensor;
+        Tensor* whole;
+        size_t offset;      /* in bytes */
+    };
+
+    std::vector<Slice> slices;
+
+    /* Every syn and dsyn is a slice of weights and gradients, so one dispatch updates them all */
+    Optimizer optimizer;
+    Tensor* weights;
+    Tensor* gradients;
+    Tensor* gradientSum;    /* the gradients before an accumulating backward() */
+    std::vector<Tensor*> optimizerState;
+    size_t optimizerSteps;
+
+    /* Winograd filter transforms, enqueued ahead of the next pass whenever the weights changed */
+    std::vector<Step> transformSteps;
+    bool transformsStale;
+    std::vector<Step> forwardSteps;
+    std::vector<Step> backwardSteps;
+    std::vector<Step> updateSteps;
+    /* gradient_sum = gradients ahead of an accumulating backward(), gradients += gradient_sum after it */
+    std::vector<Step> saveGradientSteps;
+    std::vector<Step> addGradientSteps;
+    size_t stepLayer;   /* layer the steps recorded by addStep() belong to */
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+/* Weight update rule, see the optimizer kernels at the end of kernels.cl */
+enum OptimizerType
+{
+    OPTIMIZER_SGD,
+    OPTIMIZER_MOMENTUM,
+    OPTIMIZER_NESTEROV,
+    OPTIMIZER_ADAM
+};
+
+/*
+    Gradients are summed over the batch, so learningRate scales the sum. momentum is beta1 for Adam.
+    The default, plain SGD with a rate of 1 and no decay, is the syn += dsyn of the original LeNet.
+    Shared by Network and CpuNetwork, which implement the same rules.
+*/
+struct Optimizer
+{
+    OptimizerType type;
+    float learningRate;
+    float momentum;
+    float beta2;
+    float epsilon;
+    float weightDecay;
+};
+
+#endif
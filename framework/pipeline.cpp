@@ -0,0 +1,203 @@
+#include "common.h"
+#include "pipeline.h"
+
+#include <iostream>
+
+using namespace std;
+
+InputPipeline::InputPipeline(Network& network, size_t slots, BatchLoader loader)
+    : network(network), loader(loader), ring(slots), batches(0), next(0), stopping(false)
+{
+    for (size_t i = 0; i < ring.size(); i++)
+    {
+        ring[i].image = NULL;
+        ring[i].target = NULL;
+        ring[i].mappedImage = NULL;
+        ring[i].mappedTarget = NULL;
+        ring[i].events[0] = ring[i].events[1] = 0;
+        ring[i].batch = 0;
+        ring[i].filled = false;
+        ring[i].failed = false;
+    }
+}
+
+InputPipeline::~InputPipeline()
+{
+    stop();
+
+    /* Slots still mapped for batches that never came, the tensors themselves belong to the network */
+    for (size_t i = 0; i < ring.size(); i++)
+    {
+        Slot& slot = ring[i];
+
+        for (int j = 0; j < 2; j++)
+        {
+            if (slot.events[j] != 0)
+            {
+                clWaitForEvents(1, &slot.events[j]);
+                clReleaseEvent(slot.events[j]);
+            }
+        }
+
+        if (slot.mappedImage != NULL)
+        {
+            network.unmap(slot.image, slot.mappedImage, false);
+        }
+
+        if (slot.mappedTarget != NULL)
+        {
+            network.unmap(slot.target, slot.mappedTarget, false);
+        }
+    }
+}
+
+bool InputPipeline::start(size_t count)
+{
+    Tensor* input = network.input();
+    Tensor* target = network.target();
+
+    if (ring.empty() || target == NULL)
+    {
+        cerr << "Input pipeline needs at least one slot and a network built for training. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    batches = count;
+    next = 0;
+
+    for (size_t i = 0; i < ring.size(); i++)
+    {
+        string suffix = "_slot" + to_string(i);
+
+        ring[i].image = network.createTensor(input->name + suffix, input->rows, input->cols);
+        ring[i].target = network.createTensor(target->name + suffix, target->rows, target->cols);
+
+        if (ring[i].image == NULL || ring[i].target == NULL)
+        {
+            return false;
+        }
+    }
+
+    producer = thread(&InputPipeline::produce, this);
+
+    for (size_t i = 0; i < ring.size() && i < batches; i++)
+    {
+        if (!load(i, i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Maps slot index for writing and queues it for the producer */
+bool InputPipeline::load(size_t index, size_t batch)
+{
+    Slot& slot = ring[index];
+
+    slot.mappedImage = network.map(slot.image, true, &slot.events[0]);
+    slot.mappedTarget = network.map(slot.target, true, &slot.events[1]);
+
+    if (slot.mappedImage == NULL || slot.mappedTarget == NULL)
+    {
+        return false;
+    }
+
+    lock_guard<mutex> lock(queueMutex);
+    slot.batch = batch;
+    slot.filled = false;
+    slot.failed = false;
+    queue.push_back(index);
+    changed.notify_all();
+
+    return true;
+}
+
+void InputPipeline::produce()
+{
+    for (;;)
+    {
+        size_t index;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+
+            if (queue.empty())
+            {
+                return;
+            }
+
+            index = queue.front();
+            queue.pop_front();
+        }
+
+        Slot& slot = ring[index];
+        bool success = checkSuccess(clWaitForEvents(2, slot.events));
+
+        success = success && loader(slot.batch, slot.mappedImage, slot.mappedTarget);
+
+        lock_guard<mutex> lock(queueMutex);
+        slot.filled = true;
+        slot.failed = !success;
+        changed.notify_all();
+    }
+}
+
+void InputPipeline::stop()
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+        queue.clear();
+        changed.notify_all();
+    }
+
+    if (producer.joinable())
+    {
+        producer.join();
+    }
+}
+
+bool InputPipeline::train()
+{
+    if (next >= batches)
+    {
+        cerr << "Input pipeline ran out of batches. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    size_t index = next % ring.size();
+    Slot& slot = ring[index];
+    bool failed;
+    {
+        unique_lock<mutex> lock(queueMutex);
+        changed.wait(lock, [&slot]() { return slot.filled; });
+        failed = slot.failed;
+    }
+
+    clReleaseEvent(slot.events[0]);
+    clReleaseEvent(slot.events[1]);
+    slot.events[0] = slot.events[1] = 0;
+
+    bool success = network.unmap(slot.image, slot.mappedImage, true) && network.unmap(slot.target, slot.mappedTarget, true);
+    slot.mappedImage = slot.mappedTarget = NULL;
+
+    if (failed || !success)
+    {
+        cerr << "Failed to load batch " << slot.batch << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    success &= network.bind(network.input(), slot.image) && network.bind(network.target(), slot.target);
+    success = success && network.train();
+    next++;
+
+    /* The map waits for this step to be done with the slot, the producer waits for the map */
+    if (success && next - 1 + ring.size() < batches)
+    {
+        success &= load(index, next - 1 + ring.size());
+    }
+
+    return success;
+}
@@ -0,0 +1,71 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "network.h"
+#include "tensor.h"
+
+#include <CL/cl.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    Fills batch number batch straight into mapped device memory, laid out like the input and target
+    tensors of the network: sample s of the batch starts at column s * cols of the image.
+    Runs on the producer thread and returns false to stop the pipeline.
+*/
+typedef std::function<bool(size_t batch, float* image, float* target)> BatchLoader;
+
+/*
+    Ring of slots, each an input and a target tensor in pinned memory, that keeps the device fed
+    while the host prepares the next batches. The first slots batches are loaded up front; every
+    train() then hands the oldest filled slot to the network (Network::bind(), no copy) and maps
+    that slot again for the batch slots steps ahead. Mapping is non-blocking and ordered after the
+    step reading the slot, so the producer thread waits on the map event, not the caller, and the
+    device only waits on the host when the loader falls behind.
+    Every OpenCL call stays on the thread calling train(), the producer only touches host memory.
+*/
+class InputPipeline
+{
+public:
+    InputPipeline(Network& network, size_t slots, BatchLoader loader);
+    ~InputPipeline();
+
+    /* Call after Network::build(), batches is the number of train() calls to come */
+    bool start(size_t batches);
+    bool train();
+
+private:
+    struct Slot
+    {
+        Tensor* image;
+        Tensor* target;
+        float* mappedImage;
+        float* mappedTarget;
+        cl_event events[2];
+        size_t batch;
+        bool filled;
+        bool failed;
+    };
+
+    bool load(size_t index, size_t batch);
+    void produce();
+    void stop();
+
+    Network& network;
+    BatchLoader loader;
+    std::vector<Slot> ring;
+    size_t batches;
+    size_t next;
+
+    std::thread producer;
+    std::mutex queueMutex;
+    std::condition_variable changed;
+    std::deque<size_t> queue;   /* slots waiting for the producer, oldest first */
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "common.h"
+#include "profiler.h"
+
+#include <CL/cl.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <map>
+
+using namespace std;
+
+Profiler::~Profiler()
+{
+    clear();
+}
+
+void Profiler::record(const string& label, const string& kernelName, const string& pass, size_t layer, cl_event event)
+{
+    Pending entry;
+
+    entry.sample.label = label;
+    entry.sample.kernelName = kernelName;
+    entry.sample.pass = pass;
+    entry.sample.layer = layer;
+    entry.event = event;
+    pending.push_back(entry);
+}
+
+bool Profiler::collect()
+{
+    bool collectSuccess = true;
+
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        ProfileSample& sample = pending[i].sample;
+        cl_event event = pending[i].event;
+        bool querySuccess = true;
+
+        querySuccess &= checkSuccess(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &sample.queued, NULL));
+        querySuccess &= checkSuccess(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &sample.submit, NULL));
+        querySuccess &= checkSuccess(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &sample.start, NULL));
+        querySuccess &= checkSuccess(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &sample.end, NULL));
+
+        if (querySuccess)
+        {
+            samples.push_back(sample);
+        }
+        else
+        {
+            cerr << "Failed to get profiling info of " << sample.label << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            collectSuccess = false;
+        }
+
+        clReleaseEvent(event);
+    }
+
+    pending.clear();
+
+    return collectSuccess;
+}
+
+void Profiler::clear()
+{
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        clReleaseEvent(pending[i].event);
+    }
+
+    pending.clear();
+    samples.clear();
+}
+
+void Profiler::report(ostream& out) const
+{
+    struct Totals
+    {
+        size_t calls;
+        double time;
+        double wait;
+    };
+
+    map<string, Totals> kernels;
+    map<size_t, map<string, double> > layers;
+    double total = 0;
+
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        const ProfileSample& sample = samples[i];
+        double time = (sample.end - sample.start) / 1000.0;
+        Totals& kernel = kernels[sample.kernelName];
+
+        kernel.calls++;
+        kernel.time += time;
+        kernel.wait += (sample.start - sample.queued) / 1000.0;
+        layers[sample.layer][sample.pass] += time;
+        total += time;
+    }
+
+    out << fixed << setprecision(1);
+    out << left << setw(36) << "Kernel" << right << setw(8) << "Calls" << setw(14) << "Total us"
+        << setw(12) << "Avg us" << setw(12) << "Avg wait us" << setw(9) << "Share" << endl;
+
+    for (map<string, Totals>::const_iterator it = kernels.begin(); it != kernels.end(); ++it)
+    {
+        const Totals& kernel = it->second;
+
+        out << left << setw(36) << it->first << right << setw(8) << kernel.calls << setw(14) << kernel.time
+            << setw(12) << kernel.time / kernel.calls << setw(12) << kernel.wait / kernel.calls
+            << setw(8) << (total > 0 ? 100 * kernel.time / total : 0) << "%" << endl;
+    }
+
+    /* Error steps of layer i - 1 are accounted to layer i, which computes them */
+    out << endl << left << setw(8) << "Layer" << right << setw(14) << "Forward us"
+        << setw(14) << "Backward us" << setw(14) << "Update us" << endl;
+
+    for (map<size_t, map<string, double> >::const_iterator it = layers.begin(); it != layers.end(); ++it)
+    {
+        map<string, double> passes = it->second;
+
+        out << left << setw(8) << ("L" + to_string(it->first)) << right << setw(14) << passes["forward"]
+            << setw(14) << passes["backward"] << setw(14) << passes["update"] << endl;
+    }
+
+    out << "Total kernel time " << total << " us over " << samples.size() << " dispatches" << endl;
+    out.unsetf(ios::floatfield);
+}
+
+/* Chrome trace event format, open it in chrome://tracing or Perfetto */
+bool Profiler::writeTrace(const string& filename) const
+{
+    ofstream trace(filename.c_str());
+
+    if (!trace.is_open())
+    {
+        cerr << "Unable to open " << filename << " for writing. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    cl_ulong origin = 0;
+
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        if (i == 0 || samples[i].queued < origin)
+        {
+            origin = samples[i].queued;
+        }
+    }
+
+    trace << fixed << setprecision(3) << "{\"traceEvents\":[" << endl;
+
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        const ProfileSample& sample = samples[i];
+
+        trace << "{\"name\":\"" << sample.label << "\",\"cat\":\"" << sample.pass << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0"
+              << ",\"ts\":" << (sample.start - origin) / 1000.0 << ",\"dur\":" << (sample.end - sample.start) / 1000.0
+              << ",\"args\":{\"kernel\":\"" << sample.kernelName << "\",\"layer\":" << sample.layer
+              << ",\"queued\":" << (sample.queued - origin) / 1000.0 << ",\"submit\":" << (sample.submit - origin) / 1000.0 << "}}"
+              << (i + 1 < samples.size() ? "," : "") << endl;
+    }
+
+    trace << "],\"displayTimeUnit\":\"ms\"}" << endl;
+
+    return trace.good();
+}
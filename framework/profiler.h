@@ -0,0 +1,50 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <CL/cl.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* Timestamps of one finished dispatch in nanoseconds, as reported by clGetEventProfilingInfo */
+struct ProfileSample
+{
+    std::string label;
+    std::string kernelName;
+    std::string pass;
+    size_t layer;
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+};
+
+/*
+    Keeps the event of every dispatch enqueued on a profiling queue. Events are turned into
+    samples and released on collect(), which needs the queue to be finished first.
+*/
+class Profiler
+{
+public:
+    ~Profiler();
+
+    void record(const std::string& label, const std::string& kernelName, const std::string& pass, size_t layer, cl_event event);
+    bool collect();
+    void clear();
+
+    /* Time per kernel and per layer, summed over every collected pass */
+    void report(std::ostream& out) const;
+    bool writeTrace(const std::string& filename) const;
+
+private:
+    struct Pending
+    {
+        ProfileSample sample;
+        cl_event event;
+    };
+
+    std::vector<Pending> pending;
+    std::vector<ProfileSample> samples;
+};
+
+#endif
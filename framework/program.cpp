@@ -0,0 +1,346 @@
+#include "common.h"
+#include "program.h"
+
+#include <CL/cl.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cctype>
+
+using namespace std;
+
+/* 64 bit FNV-1a, only used to tell cached binaries apart, not for security */
+static uint64_t hashString(const string& data, uint64_t hash)
+{
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/* Anything that changes the compiled code has to change the name of the cached binary */
+static bool binaryFilename(cl_device_id device, const string& filename, const string& source,
+                           const string& options, string* binaryFile)
+{
+    char name[1024], driver[1024], version[1024];
+    bool querySuccess = true;
+
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL));
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL));
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version), version, NULL));
+
+    if (!querySuccess)
+    {
+        cerr << "Failed to collect device info. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hashString(source, hash);
+    hash = hashString(string(1, '\0') + options, hash);
+    hash = hashString(string(1, '\0') + name + '\0' + driver + '\0' + version, hash);
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    *binaryFile = filename + "." + hex + ".bin";
+
+    return true;
+}
+
+static bool loadBinary(cl_context context, cl_device_id device, const string& binaryFile,
+                       const string& options, cl_program* program)
+{
+    ifstream input(binaryFile.c_str(), ios::in | ios::binary);
+
+    if (!input.is_open())
+    {
+        return false;
+    }
+
+    ostringstream outputStringStream;
+    outputStringStream << input.rdbuf();
+    string binary = outputStringStream.str();
+
+    if (binary.empty())
+    {
+        return false;
+    }
+
+    cl_int errorNumber, binaryStatus;
+    size_t length = binary.size();
+    const unsigned char* binaryData = (const unsigned char*)binary.data();
+
+    *program = clCreateProgramWithBinary(context, 1, &device, &length, &binaryData, &binaryStatus, &errorNumber);
+
+    if (errorNumber != CL_SUCCESS || binaryStatus != CL_SUCCESS || *program == NULL)
+    {
+        *program = NULL;
+        return false;
+    }
+
+    /* Binaries still need clBuildProgram, a driver that rejects them here gets the source instead */
+    if (clBuildProgram(*program, 1, &device, options.c_str(), NULL, NULL) != CL_SUCCESS)
+    {
+        clReleaseProgram(*program);
+        *program = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static bool saveBinary(cl_program program, cl_device_id device, const string& binaryFile)
+{
+    cl_uint numDevices = 0;
+
+    if (!checkSuccess(clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &numDevices, NULL)) || numDevices == 0)
+    {
+        return false;
+    }
+
+    vector<cl_device_id> devices(numDevices);
+    vector<size_t> sizes(numDevices, 0);
+    bool querySuccess = true;
+
+    querySuccess &= checkSuccess(clGetProgramInfo(program, CL_PROGRAM_DEVICES, numDevices * sizeof(cl_device_id), &devices[0], NULL));
+    querySuccess &= checkSuccess(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), &sizes[0], NULL));
+
+    if (!querySuccess)
+    {
+        return false;
+    }
+
+    /* The program may span every device of the context, only the one it was built for is kept */
+    size_t index = 0;
+
+    while (index < numDevices && devices[index] != device)
+    {
+        index++;
+    }
+
+    if (index == numDevices || sizes[index] == 0)
+    {
+        return false;
+    }
+
+    vector<unsigned char> binary(sizes[index]);
+    vector<unsigned char*> binaries(numDevices, (unsigned char*)NULL);
+    binaries[index] = &binary[0];
+
+    if (!checkSuccess(clGetProgramInfo(program, CL_PROGRAM_BINARIES, numDevices * sizeof(unsigned char*), &binaries[0], NULL)))
+    {
+        return false;
+    }
+
+    /* Write next to it and rename, so a crash never leaves half a binary behind */
+    string temporaryFile = binaryFile + ".tmp";
+    ofstream output(temporaryFile.c_str(), ios::out | ios::binary | ios::trunc);
+
+    if (!output.is_open())
+    {
+        return false;
+    }
+
+    output.write((const char*)&binary[0], binary.size());
+    output.close();
+
+    if (!output.good() || rename(temporaryFile.c_str(), binaryFile.c_str()) != 0)
+    {
+        remove(temporaryFile.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool readSource(const string& filename, string* source)
+{
+    ifstream kernelFile(filename.c_str(), ios::in);
+
+    if (!kernelFile.is_open())
+    {
+        cerr << "Unable to open " << filename << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    ostringstream outputStringStream;
+    outputStringStream << kernelFile.rdbuf();
+    *source = outputStringStream.str();
+
+    return true;
+}
+
+bool buildProgram(cl_context context, cl_device_id device, const string& filename,
+                  const string& options, cl_program* program)
+{
+    cl_int errorNumber;
+    string source;
+
+    if (!readSource(filename, &source))
+    {
+        return false;
+    }
+
+    const char* sourceString = source.c_str();
+
+    string binaryFile;
+    bool cacheBinary = binaryFilename(device, filename, source, options, &binaryFile);
+
+    if (cacheBinary && loadBinary(context, device, binaryFile, options, program))
+    {
+        return true;
+    }
+
+    *program = clCreateProgramWithSource(context, 1, &sourceString, NULL, &errorNumber);
+
+    if (!checkSuccess(errorNumber) || *program == NULL)
+    {
+        cerr << "Failed to create OpenCL program from " << filename << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    if (!checkSuccess(clBuildProgram(*program, 1, &device, options.c_str(), NULL, NULL)))
+    {
+        size_t logSize = 0;
+        clGetProgramBuildInfo(*program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+
+        vector<char> log(logSize + 1, 0);
+        clGetProgramBuildInfo(*program, device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
+
+        cerr << "Failed to build " << filename << " with \"" << options << "\":" << endl << &log[0] << endl;
+        clReleaseProgram(*program);
+        *program = NULL;
+        return false;
+    }
+
+    /* Not being able to cache only costs the next start its compile time */
+    if (cacheBinary && !saveBinary(*program, device, binaryFile))
+    {
+        cerr << "Failed to cache the program binary in " << binaryFile << ". " << __FILE__ << ":"<< __LINE__ << endl;
+    }
+
+    return true;
+}
+
+ProgramCache::ProgramCache()
+    : context(0), device(0), generic(0)
+{
+}
+
+ProgramCache::~ProgramCache()
+{
+    release();
+}
+
+bool ProgramCache::open(cl_context context, cl_device_id device, const string& filename,
+                        const string& options, cl_program generic)
+{
+    release();
+
+    this->context = context;
+    this->device = device;
+    this->filename = filename;
+    this->options = options;
+    this->generic = generic;
+
+    return readSource(filename, &source);
+}
+
+/* The source names SPECIALIZE_<kernelName> as a whole word, matrix_multiply is not matrix_multiply_sigmoid_delta */
+bool ProgramCache::takesPart(const string& kernelName) const
+{
+    string gate = "SPECIALIZE_" + kernelName;
+
+    for (size_t position = source.find(gate); position != string::npos; position = source.find(gate, position + 1))
+    {
+        size_t end = position + gate.size();
+
+        if (end == source.size() || !(isalnum((unsigned char)source[end]) || source[end] == '_'))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+cl_kernel ProgramCache::createKernel(const string& kernelName, const vector<int>& sizes, bool* specialized)
+{
+    cl_int errorNumber;
+    cl_program program = generic;
+
+    if (takesPart(kernelName))
+    {
+        string shape = " -DSPECIALIZE_" + kernelName;
+
+        for (size_t i = 0; i < sizes.size(); i++)
+        {
+            shape += " -DSHAPE" + to_string(i) + "=" + to_string(sizes[i]);
+        }
+
+        map<string, cl_program>::iterator variant = variants.find(shape);
+
+        if (variant == variants.end())
+        {
+            cl_program built = NULL;
+
+            /* A shape the compiler chokes on is simply left to the generic kernel */
+            if (!buildProgram(context, device, filename, options + shape, &built))
+            {
+                cerr << "Failed to specialise " << kernelName << ", it runs generic. " << __FILE__ << ":"<< __LINE__ << endl;
+                built = NULL;
+            }
+
+            variant = variants.insert(make_pair(shape, built)).first;
+        }
+
+        if (variant->second != NULL)
+        {
+            program = variant->second;
+        }
+    }
+
+    *specialized = program != generic;
+
+    cl_kernel kernel = clCreateKernel(program, kernelName.c_str(), &errorNumber);
+
+    if (!checkSuccess(errorNumber))
+    {
+        cerr << "Failed to create OpenCL kernel " << kernelName << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return NULL;
+    }
+
+    return kernel;
+}
+
+size_t ProgramCache::size() const
+{
+    size_t built = 0;
+
+    for (map<string, cl_program>::const_iterator variant = variants.begin(); variant != variants.end(); ++variant)
+    {
+        built += variant->second != NULL;
+    }
+
+    return built;
+}
+
+/* Kernels hold on to their program, the ones created from a variant keep it alive */
+void ProgramCache::release()
+{
+    for (map<string, cl_program>::iterator variant = variants.begin(); variant != variants.end(); ++variant)
+    {
+        if (variant->second != NULL)
+        {
+            clReleaseProgram(variant->second);
+        }
+    }
+
+    variants.clear();
+}
@@ -0,0 +1,57 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <CL/cl.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+    Same as createProgram() from common.h, but passes options such as "-DTS=16" to the compiler,
+    which is how kernel variants are specialised without editing the .cl files.
+    The compiled binary is kept next to the source as <filename>.<hash>.bin, where the hash covers
+    the source, the options and the device name, driver and OpenCL version, so later runs load it
+    with clCreateProgramWithBinary() and only compile again when one of those changes or the driver
+    rejects the binary. Stale binaries are never removed, delete them by hand.
+*/
+bool buildProgram(cl_context context, cl_device_id device, const std::string& filename,
+                  const std::string& options, cl_program* program);
+
+/*
+    Variants of the kernels of one .cl file specialised for the int arguments they are launched
+    with. A kernel takes part with an "#ifdef SPECIALIZE_<kernel>" block that takes the sizes its
+    loops depend on from SHAPE<i>, the value of its int argument i. Its variant for a shape is the
+    file built with the generic options plus -DSPECIALIZE_<kernel> -DSHAPE0=... -DSHAPE<n>=..., so
+    the compiler sees constant trip counts and strides and can unroll. Variants are built the first
+    time a shape is asked for and kept by kernel and shape, buildProgram() keeps their binaries on
+    disk as well. Kernels without the block and shapes whose variant fails to build get the kernel
+    of the generic program instead.
+*/
+class ProgramCache
+{
+public:
+    ProgramCache();
+    ~ProgramCache();
+
+    /* generic stays owned by the caller and has to outlive the cache */
+    bool open(cl_context context, cl_device_id device, const std::string& filename,
+              const std::string& options, cl_program generic);
+    /* NULL on failure, *specialized tells whether the kernel came from a variant */
+    cl_kernel createKernel(const std::string& kernelName, const std::vector<int>& sizes, bool* specialized);
+    /* Variants built so far */
+    size_t size() const;
+    void release();
+
+private:
+    bool takesPart(const std::string& kernelName) const;
+
+    cl_context context;
+    cl_device_id device;
+    std::string filename;
+    std::string options;
+    std::string source;
+    cl_program generic;
+    std::map<std::string, cl_program> variants;    /* by kernel and shape, NULL when the build failed */
+};
+
+#endif
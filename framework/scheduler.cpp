@@ -0,0 +1,166 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Scheduler::~Scheduler()
+{
+    retire();
+}
+
+static void addEvent(cl_event event, vector<cl_event>* waitList)
+{
+    if (event != 0 && find(waitList->begin(), waitList->end(), event) == waitList->end())
+    {
+        waitList->push_back(event);
+    }
+}
+
+static bool complete(cl_event event)
+{
+    cl_int status = CL_QUEUED;
+
+    clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    return status == CL_COMPLETE;
+}
+
+static bool overlap(cl_mem rootA, size_t offsetA, size_t sizeA, cl_mem rootB, size_t offsetB, size_t sizeB)
+{
+    return rootA == rootB && offsetA < offsetB + sizeB && offsetB < offsetA + sizeA;
+}
+
+Scheduler::Region Scheduler::region(cl_mem buffer) const
+{
+    map<cl_mem, Access>::const_iterator it = accesses.find(buffer);
+
+    if (it != accesses.end())
+    {
+        return it->second.region;
+    }
+
+    /* Should the size not be known, the buffer still overlaps itself */
+    Region result = {buffer, 0, 1};
+    cl_mem parent = 0;
+
+    clGetMemObjectInfo(buffer, CL_MEM_SIZE, sizeof(result.size), &result.size, NULL);
+
+    /* Sub-buffers can not be nested, one step up is the root */
+    if (clGetMemObjectInfo(buffer, CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(parent), &parent, NULL) == CL_SUCCESS && parent != 0)
+    {
+        result.root = parent;
+        clGetMemObjectInfo(buffer, CL_MEM_OFFSET, sizeof(result.offset), &result.offset, NULL);
+    }
+
+    return result;
+}
+
+Scheduler::Access& Scheduler::track(cl_mem buffer)
+{
+    map<cl_mem, Access>::iterator it = accesses.find(buffer);
+
+    if (it != accesses.end())
+    {
+        return it->second;
+    }
+
+    Access access;
+
+    access.region = region(buffer);
+    access.writer = 0;
+    return accesses[buffer] = access;
+}
+
+void Scheduler::dependencies(const vector<cl_mem>& reads, const vector<cl_mem>& writes,
+                             vector<cl_event>* waitList) const
+{
+    waitList->clear();
+
+    for (size_t i = 0; i < reads.size() + writes.size(); i++)
+    {
+        bool writing = i >= reads.size();
+        Region touched = region(writing ? writes[i - reads.size()] : reads[i]);
+
+        for (map<cl_mem, Access>::const_iterator it = accesses.begin(); it != accesses.end(); ++it)
+        {
+            const Region& other = it->second.region;
+
+            if (!overlap(touched.root, touched.offset, touched.size, other.root, other.offset, other.size))
+            {
+                continue;
+            }
+
+            addEvent(it->second.writer, waitList);
+
+            for (size_t j = 0; writing && j < it->second.readers.size(); j++)
+            {
+                addEvent(it->second.readers[j], waitList);
+            }
+        }
+    }
+}
+
+void Scheduler::record(const vector<cl_mem>& reads, const vector<cl_mem>& writes, cl_event event)
+{
+    for (size_t i = 0; i < reads.size(); i++)
+    {
+        Access& access = track(reads[i]);
+
+        /* Buffers nothing writes between passes, like the weights during inference, would collect a reader per pass */
+        for (size_t j = access.readers.size(); j > 0; j--)
+        {
+            if (complete(access.readers[j - 1]))
+            {
+                clReleaseEvent(access.readers[j - 1]);
+                access.readers.erase(access.readers.begin() + (j - 1));
+            }
+        }
+
+        if (find(access.readers.begin(), access.readers.end(), event) == access.readers.end())
+        {
+            clRetainEvent(event);
+            access.readers.push_back(event);
+        }
+    }
+
+    /*
+        A write supersedes everything recorded for the buffer before it, reads of the same command included.
+        Other buffers on the same bytes keep theirs, the next command touching them still waits for this one.
+    */
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+        Access& access = track(writes[i]);
+
+        for (size_t j = 0; j < access.readers.size(); j++)
+        {
+            clReleaseEvent(access.readers[j]);
+        }
+
+        if (access.writer != 0)
+        {
+            clReleaseEvent(access.writer);
+        }
+
+        clRetainEvent(event);
+        access.writer = event;
+        access.readers.clear();
+    }
+}
+
+void Scheduler::retire()
+{
+    for (map<cl_mem, Access>::iterator it = accesses.begin(); it != accesses.end(); ++it)
+    {
+        if (it->second.writer != 0)
+        {
+            clReleaseEvent(it->second.writer);
+        }
+
+        for (size_t j = 0; j < it->second.readers.size(); j++)
+        {
+            clReleaseEvent(it->second.readers[j]);
+        }
+    }
+
+    accesses.clear();
+}
@@ -0,0 +1,59 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <CL/cl.h>
+#include <map>
+#include <vector>
+
+/*
+    Dependencies between commands on an out-of-order queue, worked out from the buffers each
+    command reads and writes. Per buffer it remembers the command that wrote it last and the
+    commands that read it since:
+        read after write    a reader waits for the last writer
+        write after write   a writer waits for the last writer
+        write after read    a writer waits for every reader since that write
+    Together that is the dependency DAG of everything enqueued, so independent commands (the
+    weight gradient of a layer and the error it sends back) are free to overlap while the
+    results stay those of an in-order queue.
+    Sub-buffers are compared by the bytes of their parent they cover, so tensors the memory
+    planner puts on the same bytes of an arena are ordered like one buffer.
+    Holds its own reference to every event it tracks until retire().
+*/
+class Scheduler
+{
+public:
+    ~Scheduler();
+
+    /* Events a command touching these buffers has to wait for, without duplicates */
+    void dependencies(const std::vector<cl_mem>& reads, const std::vector<cl_mem>& writes,
+                      std::vector<cl_event>* waitList) const;
+
+    /* Makes event the command reads and writes depend on from now on */
+    void record(const std::vector<cl_mem>& reads, const std::vector<cl_mem>& writes, cl_event event);
+
+    /* Releases every tracked event, only after the queue is finished */
+    void retire();
+
+private:
+    /* Bytes of the outermost buffer a buffer covers */
+    struct Region
+    {
+        cl_mem root;
+        size_t offset;
+        size_t size;
+    };
+
+    struct Access
+    {
+        Region region;
+        cl_event writer;
+        std::vector<cl_event> readers;
+    };
+
+    Region region(cl_mem buffer) const;
+    Access& track(cl_mem buffer);
+
+    std::map<cl_mem, Access> accesses;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define SIMD_SSE
+#endif
+
+/*
+    The two loops every CpuNetwork layer comes down to, four floats at a time with NEON on ARM
+    and SSE on x86, plain C++ anywhere else. Neither needs aligned pointers.
+*/
+
+/* a[0] * b[0] + ... + a[n - 1] * b[n - 1] */
+inline float dot(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    float result = 0;
+
+#if defined(SIMD_NEON)
+    float32x4_t acc = vdupq_n_f32(0);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+
+    result = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#elif defined(SIMD_SSE)
+    __m128 acc = _mm_setzero_ps();
+    float lanes[4];
+
+    for (; i + 4 <= n; i += 4)
+    {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+
+    _mm_storeu_ps(lanes, acc);
+    result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; i < n; i++)
+    {
+        result += a[i] * b[i];
+    }
+
+    return result;
+}
+
+/* y[i] += alpha * x[i] for i < n */
+inline void axpy(float alpha, const float* x, float* y, size_t n)
+{
+    size_t i = 0;
+
+#if defined(SIMD_NEON)
+    float32x4_t scale = vdupq_n_f32(alpha);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(y + i, vmlaq_f32(vld1q_f32(y + i), scale, vld1q_f32(x + i)));
+    }
+#elif defined(SIMD_SSE)
+    __m128 scale = _mm_set1_ps(alpha);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(scale, _mm_loadu_ps(x + i))));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        y[i] += alpha * x[i];
+    }
+}
+
+#endif
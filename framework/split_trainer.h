@@ -0,0 +1,280 @@
+#ifndef SPLIT_TRAINER_H
+#define SPLIT_TRAINER_H
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/* Weight of the latest step in the samples per second a side is credited with */
+#define SPLIT_SMOOTHING 0.5
+
+/*
+    Trains every batch on two networks at once: a Network on the GPU queue and a CpuNetwork on the
+    cores that would otherwise wait for it, or, to try it out without a GPU, two Networks, each on the
+    context and queue its build() got from createContext() and createCommandQueue().
+    Both are built for training with the same layers and a batch of one micro-batch, a Network side
+    with setAccumulation(true). A batch is cut
+    into micro-batches, the device takes the first deviceSamples() samples and the host the rest,
+    and each side runs backward() once per micro-batch, every one after the first adding its
+    gradients to the ones the side already holds, the host side on a thread of its own. Each side's
+    sums are read once per batch and added into the gradients of device, which takes the one
+    optimizer step, then its weights are copied to host. Training therefore matches a single network
+    over the whole batch up to the order of the float sums.
+    Between batches the share moves to whatever split finishes both sides first at the samples per
+    second their backward() passes measured so far. A side left without work keeps its last
+    measurement and gets work back once the other side drops below it.
+    Device and Host only need what Network and CpuNetwork have in common: batch(), input(), target(),
+    write(), read(), backward(), finish(), update(), parameters() and parameterGradients().
+*/
+template <class Device, class Host>
+class SplitTrainer
+{
+public:
+    /* batchSize has to be a multiple of the micro-batch both networks were built with */
+    SplitTrainer(Device& device, Host& host, size_t batchSize);
+
+    /* batchSize images and targets laid out like the input and target tensors */
+    bool train(const float* images, const float* targets);
+
+    /* Of the next batch */
+    size_t deviceSamples() const;
+    /* Samples per second, 0 until the side got work */
+    double deviceThroughput() const;
+    double hostThroughput() const;
+
+private:
+    template <class Side>
+    static bool run(Side& side, const float* images, const float* targets, size_t first, size_t count,
+                    std::vector<float>* sums, double* throughput);
+    template <class Side, class SideTensor>
+    static bool accumulate(Side& side, const std::vector<SideTensor*>& tensors, std::vector<float>* sums);
+    template <class Side, class SideTensor>
+    static bool scatter(Side& side, const std::vector<SideTensor*>& tensors, const std::vector<float>& values);
+    bool copyWeights();
+    void rebalance();
+
+    Device& device;
+    Host& host;
+    size_t batchSize;
+    size_t deviceBatches;   /* micro-batches of the next batch that go to device */
+    double deviceRate;
+    double hostRate;
+    bool synchronized;      /* host holds the weights of device */
+};
+
+template <class Device, class Host>
+SplitTrainer<Device, Host>::SplitTrainer(Device& device, Host& host, size_t batchSize)
+    : device(device), host(host), batchSize(batchSize), deviceBatches(0), deviceRate(0), hostRate(0), synchronized(false)
+{
+    /* Half each until both sides are measured */
+    if (device.batch() != 0)
+    {
+        deviceBatches = (batchSize / device.batch() + 1) / 2;
+    }
+}
+
+template <class Device, class Host>
+bool SplitTrainer<Device, Host>::train(const float* images, const float* targets)
+{
+    size_t micro = device.batch();
+
+    if (micro == 0 || host.batch() != micro || batchSize % micro != 0 || batchSize == 0)
+    {
+        std::cerr << "Both networks need the same micro-batch and the batch a multiple of it. " << __FILE__ << ":"<< __LINE__ << std::endl;
+        return false;
+    }
+
+    if (!synchronized && !copyWeights())
+    {
+        return false;
+    }
+
+    synchronized = true;
+
+    size_t batches = batchSize / micro;
+    std::vector<float> deviceSums, hostSums;
+    bool hostSuccess = true;
+    std::thread worker([&]()
+    {
+        hostSuccess = run(host, images, targets, deviceBatches, batches - deviceBatches, &hostSums, &hostRate);
+    });
+
+    bool deviceSuccess = run(device, images, targets, 0, deviceBatches, &deviceSums, &deviceRate);
+
+    worker.join();
+
+    if (!deviceSuccess || !hostSuccess)
+    {
+        std::cerr << "Failed to run the " << (deviceSuccess ? "host" : "device") << " share of a batch. " << __FILE__ << ":"<< __LINE__ << std::endl;
+        return false;
+    }
+
+    /* A side without work left its sums empty */
+    if (deviceSums.empty())
+    {
+        deviceSums.swap(hostSums);
+    }
+
+    for (size_t i = 0; i < hostSums.size(); i++)
+    {
+        deviceSums[i] += hostSums[i];
+    }
+
+    /* The gradients of device become the sums over the whole batch */
+    if (!scatter(device, device.parameterGradients(), deviceSums) || !device.update() || !copyWeights())
+    {
+        std::cerr << "Failed to update the weights. " << __FILE__ << ":"<< __LINE__ << std::endl;
+        return false;
+    }
+
+    rebalance();
+    return true;
+}
+
+/*
+    Micro-batches first..first + count - 1 on side, summed by the side itself and read into sums once.
+    The rate only counts backward() and the wait for it, not the uploads or the final read.
+*/
+template <class Device, class Host>
+template <class Side>
+bool SplitTrainer<Device, Host>::run(Side& side, const float* images, const float* targets, size_t first, size_t count,
+                                     std::vector<float>* sums, double* throughput)
+{
+    size_t imageSize = side.input()->size(), targetSize = side.target()->size();
+    double seconds = 0;
+
+    for (size_t i = first; i < first + count; i++)
+    {
+        if (!side.write(side.input(), images + i * imageSize) || !side.write(side.target(), targets + i * targetSize))
+        {
+            return false;
+        }
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+        if (!side.backward(i > first) || !side.finish())
+        {
+            return false;
+        }
+
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    if (count > 0 && !accumulate(side, side.parameterGradients(), sums))
+    {
+        return false;
+    }
+
+    if (count > 0)
+    {
+        double measured = count * side.batch() / std::max(seconds, 1e-9);
+
+        *throughput = *throughput == 0 ? measured : SPLIT_SMOOTHING * measured + (1 - SPLIT_SMOOTHING) * *throughput;
+    }
+
+    return true;
+}
+
+/* Adds the values of tensors, one after another, to sums; reading a gradient waits for the backward() writing it */
+template <class Device, class Host>
+template <class Side, class SideTensor>
+bool SplitTrainer<Device, Host>::accumulate(Side& side, const std::vector<SideTensor*>& tensors, std::vector<float>* sums)
+{
+    size_t offset = 0;
+    std::vector<float> values;
+
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        values.resize(tensors[i]->size());
+
+        if (!side.read(tensors[i], &values[0]))
+        {
+            return false;
+        }
+
+        sums->resize(std::max(sums->size(), offset + values.size()), 0.0f);
+
+        for (size_t j = 0; j < values.size(); j++)
+        {
+            (*sums)[offset + j] += values[j];
+        }
+
+        offset += values.size();
+    }
+
+    return true;
+}
+
+/* Writes values into tensors one after another, the inverse of accumulate() into empty sums */
+template <class Device, class Host>
+template <class Side, class SideTensor>
+bool SplitTrainer<Device, Host>::scatter(Side& side, const std::vector<SideTensor*>& tensors, const std::vector<float>& values)
+{
+    size_t offset = 0;
+
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        if (offset + tensors[i]->size() > values.size() || !side.write(tensors[i], &values[offset]))
+        {
+            return false;
+        }
+
+        offset += tensors[i]->size();
+    }
+
+    return true;
+}
+
+template <class Device, class Host>
+bool SplitTrainer<Device, Host>::copyWeights()
+{
+    std::vector<float> weights;
+
+    return accumulate(device, device.parameters(), &weights) && scatter(host, host.parameters(), weights);
+}
+
+/* The device share that finishes both sides first at the rates measured so far */
+template <class Device, class Host>
+void SplitTrainer<Device, Host>::rebalance()
+{
+    if (deviceRate == 0 || hostRate == 0)
+    {
+        return;
+    }
+
+    size_t batches = batchSize / device.batch();
+    double best = -1;
+
+    for (size_t share = 0; share <= batches; share++)
+    {
+        double time = std::max(share / deviceRate, (batches - share) / hostRate);
+
+        if (best < 0 || time < best)
+        {
+            best = time;
+            deviceBatches = share;
+        }
+    }
+}
+
+template <class Device, class Host>
+size_t SplitTrainer<Device, Host>::deviceSamples() const
+{
+    return deviceBatches * device.batch();
+}
+
+template <class Device, class Host>
+double SplitTrainer<Device, Host>::deviceThroughput() const
+{
+    return deviceRate;
+}
+
+template <class Device, class Host>
+double SplitTrainer<Device, Host>::hostThroughput() const
+{
+    return hostRate;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <CL/cl.h>
+#include <string>
+
+/*
+    Column-major matrix of floats backed by one OpenCL buffer. Element (row, col) lives at
+    col * rows + row, the same convention every kernel in assets/kernels.cl uses. Stacks of
+    feature maps are stored one map after another, so 6@28x28 is a 28 x 168 tensor.
+    element is the size of one stored value, sizeof(cl_half) for the activations of a half
+    precision network and 1 for int8 tensors, which store round(value / scale).
+    Network::read(), write() and fill() convert from and to float.
+    Image tensors hold RGBA float texels instead: rows is the height, cols the width of every
+    slice side by side and element the 16 bytes of a texel, so bytes() still covers the whole
+    image. The host cannot map them, only kernels read and write them.
+*/
+struct Tensor
+{
+    std::string name;
+    size_t rows;
+    size_t cols;
+    size_t element;
+    float scale;
+    cl_mem buffer;
+    cl_mem_object_type type;    /* CL_MEM_OBJECT_BUFFER, CL_MEM_OBJECT_IMAGE2D or CL_MEM_OBJECT_IMAGE2D_ARRAY */
+    size_t slices;              /* of an image2d_array_t, 1 otherwise */
+
+    size_t size() const { return rows * cols; }
+    size_t bytes() const { return size() * element; }
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+ThreadPool::ThreadPool(size_t threads)
+    : job(NULL), count(0), generation(0), pending(0), stopping(false)
+{
+    if (threads == 0)
+    {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+
+    /* The caller of run() is the first thread */
+    for (size_t i = 1; i < threads; i++)
+    {
+        workers.push_back(thread(&ThreadPool::work, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(poolMutex);
+        stopping = true;
+        started.notify_all();
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+size_t ThreadPool::size() const
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::run(size_t items, const RangeJob& task)
+{
+    if (workers.empty() || items < 2)
+    {
+        task(0, items);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(poolMutex);
+        job = &task;
+        count = items;
+        pending = workers.size();
+        generation++;
+        started.notify_all();
+    }
+
+    range(0);
+
+    unique_lock<mutex> lock(poolMutex);
+    finished.wait(lock, [this]() { return pending == 0; });
+    job = NULL;
+}
+
+/* Thread index takes the index-th of size() nearly equal ranges */
+void ThreadPool::range(size_t index)
+{
+    size_t begin = count * index / size();
+    size_t end = count * (index + 1) / size();
+
+    if (begin < end)
+    {
+        (*job)(begin, end);
+    }
+}
+
+void ThreadPool::work(size_t index)
+{
+    size_t seen = 0;
+
+    for (;;)
+    {
+        {
+            unique_lock<mutex> lock(poolMutex);
+            started.wait(lock, [this, seen]() { return stopping || generation != seen; });
+
+            if (stopping)
+            {
+                return;
+            }
+
+            seen = generation;
+        }
+
+        range(index);
+
+        lock_guard<mutex> lock(poolMutex);
+
+        if (--pending == 0)
+        {
+            finished.notify_all();
+        }
+    }
+}
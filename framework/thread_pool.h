@@ -0,0 +1,45 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Work on items begin..end - 1 of a run() */
+typedef std::function<void(size_t begin, size_t end)> RangeJob;
+
+/*
+    Fixed set of threads that split every run() into one contiguous range per thread, the calling
+    thread included, so a job over count items never allocates and its ranges only depend on count
+    and size(). Threads sleep on a condition variable between runs. run() is not reentrant and
+    only one thread may call it at a time.
+*/
+class ThreadPool
+{
+public:
+    /* 0 takes one thread per hardware thread */
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    size_t size() const;
+    /* Returns once job has covered 0..count - 1 */
+    void run(size_t count, const RangeJob& job);
+
+private:
+    void work(size_t index);
+    void range(size_t index);
+
+    std::vector<std::thread> workers;
+    std::mutex poolMutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    const RangeJob* job;
+    size_t count;
+    size_t generation;  /* counts runs, a worker starts when it changes */
+    size_t pending;     /* workers still busy with the current run */
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,449 @@
+#include "common.h"
+#include "program.h"
+#include "tuner.h"
+
+#include <CL/cl.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+
+using namespace std;
+
+#define REPEATS 5
+
+static const int tileSizes[] = {4, 8, 16, 32};
+static const int worksPerThread[] = {1, 2, 4, 8};
+
+static string buildOptions(int tileSize, int workPerThread)
+{
+    return "-DTS=" + to_string(tileSize) + " -DWPT=" + to_string(workPerThread);
+}
+
+/* Device name and driver version, a new driver may well change which kernel wins */
+static bool deviceKey(cl_device_id device, string* key)
+{
+    char name[1024], driver[1024];
+    bool querySuccess = true;
+
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL));
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL));
+
+    if (!querySuccess)
+    {
+        cerr << "Failed to collect device info. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    *key = string(name) + "\t" + driver;
+    return true;
+}
+
+/* One line per tuned shape: device, driver, M, N, K, kernel, TS, WPT, local0, local1, time, tab separated */
+static bool loadConfig(const string& cacheFile, const string& key, size_t M, size_t N, size_t K, GemmConfig* config)
+{
+    ifstream cache(cacheFile.c_str());
+    string shape = key + "\t" + to_string(M) + "\t" + to_string(N) + "\t" + to_string(K) + "\t";
+    string line;
+    bool found = false;
+
+    while (getline(cache, line))
+    {
+        if (line.compare(0, shape.size(), shape) != 0)
+        {
+            continue;
+        }
+
+        /* Later lines win, so a re-tuned shape simply gets appended */
+        istringstream fields(line.substr(shape.size()));
+        GemmConfig entry;
+
+        if (getline(fields, entry.kernelName, '\t')
+            && fields >> entry.tileSize >> entry.workPerThread >> entry.local[0] >> entry.local[1] >> entry.time)
+        {
+            *config = entry;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+static bool saveConfig(const string& cacheFile, const string& key, size_t M, size_t N, size_t K, const GemmConfig& config)
+{
+    ofstream cache(cacheFile.c_str(), ios::app);
+
+    if (!cache.is_open())
+    {
+        cerr << "Unable to open " << cacheFile << " for writing. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    cache << key << "\t" << M << "\t" << N << "\t" << K << "\t" << config.kernelName << "\t"
+          << config.tileSize << "\t" << config.workPerThread << "\t"
+          << config.local[0] << "\t" << config.local[1] << "\t" << config.time << endl;
+
+    return cache.good();
+}
+
+bool matrixMultiplyTransposesB(const GemmConfig& config)
+{
+    return config.kernelName == "matrix_multiply_vector";
+}
+
+void matrixMultiplyLocalSize(const string& kernelName, int tileSize, int workPerThread, size_t* local)
+{
+    local[0] = tileSize;
+    local[1] = tileSize / workPerThread;
+
+    if (kernelName == "matrix_multiply_blocked")
+    {
+        local[0] = tileSize / workPerThread;
+    }
+}
+
+void matrixMultiplyGlobalSize(const GemmConfig& config, size_t M, size_t N, size_t* global)
+{
+    global[0] = M;
+    global[1] = N;
+
+    if (config.kernelName == "matrix_multiply_blocked")
+    {
+        /* Whole tiles, the kernel drops what lies past M and N */
+        size_t tiles[2] = {(M + config.tileSize - 1) / config.tileSize, (N + config.tileSize - 1) / config.tileSize};
+
+        global[0] = tiles[0] * config.local[0];
+        global[1] = tiles[1] * config.local[1];
+    }
+    else if (config.kernelName == "matrix_multiply_less_loads")
+    {
+        global[1] = N / config.workPerThread;
+    }
+    else if (config.kernelName == "matrix_multiply_vector")
+    {
+        global[0] = M / 4;
+        global[1] = N / 4;
+    }
+}
+
+bool createMatrixMultiply(cl_context context, cl_device_id device, const string& kernelsFile,
+                          const GemmConfig& config, cl_program* program, cl_kernel* kernel)
+{
+    cl_int errorNumber;
+
+    if (!buildProgram(context, device, kernelsFile, buildOptions(config.tileSize, config.workPerThread), program))
+    {
+        return false;
+    }
+
+    *kernel = clCreateKernel(*program, config.kernelName.c_str(), &errorNumber);
+
+    if (!checkSuccess(errorNumber))
+    {
+        cerr << "Failed to create OpenCL kernel " << config.kernelName << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+    Runs one candidate, compares it with the reference and returns its best time out of REPEATS runs.
+    memoryObjects are A, B, C and B transposed.
+*/
+static bool timeCandidate(cl_command_queue commandQueue, cl_kernel kernel, const GemmConfig& config,
+                          size_t M, size_t N, size_t K, cl_mem* memoryObjects, const vector<float>& reference, double* time)
+{
+    int sizes[3] = {(int)M, (int)N, (int)K};
+    size_t global[2];
+    bool setKernelArgumentsSuccess = true;
+
+    matrixMultiplyGlobalSize(config, M, N, global);
+
+    cl_mem buffers[3] = {memoryObjects[0], matrixMultiplyTransposesB(config) ? memoryObjects[3] : memoryObjects[1], memoryObjects[2]};
+
+    for (cl_uint i = 0; i < 3; i++)
+    {
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, i, sizeof(int), (void*)&sizes[i]));
+        setKernelArgumentsSuccess &= checkSuccess(clSetKernelArg(kernel, i + 3, sizeof(cl_mem), (void*)&buffers[i]));
+    }
+
+    if (!setKernelArgumentsSuccess)
+    {
+        cerr << "Failed setting OpenCL kernel arguments. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    /* The first run warms up and is the one that gets checked */
+    if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, global, config.local, 0, NULL, NULL)))
+    {
+        return false;
+    }
+
+    vector<float> result(M * N);
+
+    if (!checkSuccess(clEnqueueReadBuffer(commandQueue, memoryObjects[2], CL_TRUE, 0, M * N * sizeof(float), &result[0], 0, NULL, NULL)))
+    {
+        cerr << "Failed to read the result. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < result.size(); i++)
+    {
+        if (fabs(result[i] - reference[i]) > 1e-3f * (fabs(reference[i]) + 1))
+        {
+            cerr << config.kernelName << " TS=" << config.tileSize << " WPT=" << config.workPerThread
+                 << " gives " << result[i] << " instead of " << reference[i] << " at index " << i << ", skipped." << endl;
+            return false;
+        }
+    }
+
+    *time = -1;
+
+    for (int r = 0; r < REPEATS; r++)
+    {
+        cl_event event = 0;
+        cl_ulong start = 0, end = 0;
+
+        if (!checkSuccess(clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, global, config.local, 0, NULL, &event))
+            || !checkSuccess(clWaitForEvents(1, &event))
+            || !checkSuccess(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL))
+            || !checkSuccess(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL)))
+        {
+            cerr << "Failed to time " << config.kernelName << ". " << __FILE__ << ":"<< __LINE__ << endl;
+            if (event != 0)
+            {
+                clReleaseEvent(event);
+            }
+            return false;
+        }
+
+        clReleaseEvent(event);
+
+        double microseconds = (end - start) / 1000.0;
+        if (*time < 0 || microseconds < *time)
+        {
+            *time = microseconds;
+        }
+    }
+
+    return true;
+}
+
+static bool sweep(cl_context context, cl_device_id device, cl_command_queue commandQueue, const string& kernelsFile,
+                  size_t M, size_t N, size_t K, cl_mem* memoryObjects, const vector<float>& reference, GemmConfig* best)
+{
+    size_t maxWorkGroupSize = 0;
+    size_t maxWorkItemSizes[3] = {0, 0, 0};
+    cl_ulong localMemorySize = 0;
+    bool querySuccess = true;
+
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL));
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxWorkItemSizes), maxWorkItemSizes, NULL));
+    querySuccess &= checkSuccess(clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemorySize, NULL));
+
+    if (!querySuccess)
+    {
+        cerr << "Failed to collect device info. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    best->time = -1;
+
+    for (size_t t = 0; t < sizeof(tileSizes) / sizeof(tileSizes[0]); t++)
+    {
+        for (size_t w = 0; w < sizeof(worksPerThread) / sizeof(worksPerThread[0]); w++)
+        {
+            int tileSize = tileSizes[t], workPerThread = worksPerThread[w];
+
+            if (workPerThread > tileSize)
+            {
+                continue;
+            }
+
+            cl_program program = 0;
+
+            if (!buildProgram(context, device, kernelsFile, buildOptions(tileSize, workPerThread), &program))
+            {
+                continue;
+            }
+
+            /* Only matrix_multiply_blocked handles edges, the others need the tile to divide every dimension */
+            bool divides = M % tileSize == 0 && N % tileSize == 0 && K % tileSize == 0;
+            vector<string> kernelNames;
+
+            /* The naive kernel only cares about the local size, which TS x TS/WPT sweeps as well */
+            if (divides)
+            {
+                kernelNames.push_back("matrix_multiply");
+            }
+
+            if (divides && 2 * tileSize * tileSize * sizeof(float) <= localMemorySize)
+            {
+                kernelNames.push_back(workPerThread == 1 ? "matrix_multiply_tiling" : "matrix_multiply_less_loads");
+            }
+
+            /* 4x4 blocks per work item, so the local size has to divide M/4 x N/4 */
+            if (divides && M % 4 == 0 && N % 4 == 0 && (M / 4) % tileSize == 0 && (N / 4) % (tileSize / workPerThread) == 0)
+            {
+                kernelNames.push_back("matrix_multiply_vector");
+            }
+
+            /* Two buffers of an A and a B tile */
+            if (4 * tileSize * tileSize * sizeof(float) <= localMemorySize)
+            {
+                kernelNames.push_back("matrix_multiply_blocked");
+            }
+
+            for (size_t k = 0; k < kernelNames.size(); k++)
+            {
+                size_t local[2];
+
+                matrixMultiplyLocalSize(kernelNames[k], tileSize, workPerThread, local);
+
+                if (local[0] * local[1] > maxWorkGroupSize || local[0] > maxWorkItemSizes[0] || local[1] > maxWorkItemSizes[1])
+                {
+                    continue;
+                }
+
+                cl_int errorNumber;
+                cl_kernel kernel = clCreateKernel(program, kernelNames[k].c_str(), &errorNumber);
+                size_t kernelWorkGroupSize = 0;
+
+                if (!checkSuccess(errorNumber))
+                {
+                    cerr << "Failed to create OpenCL kernel " << kernelNames[k] << ". " << __FILE__ << ":"<< __LINE__ << endl;
+                    continue;
+                }
+
+                GemmConfig candidate;
+                candidate.kernelName = kernelNames[k];
+                candidate.tileSize = tileSize;
+                candidate.workPerThread = workPerThread;
+                candidate.local[0] = local[0];
+                candidate.local[1] = local[1];
+
+                if (checkSuccess(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelWorkGroupSize, NULL))
+                    && local[0] * local[1] <= kernelWorkGroupSize
+                    && timeCandidate(commandQueue, kernel, candidate, M, N, K, memoryObjects, reference, &candidate.time))
+                {
+                    cout << "Tuning " << candidate.kernelName << " TS=" << tileSize << " WPT=" << workPerThread
+                         << " local " << local[0] << "x" << local[1] << ": " << candidate.time << " us" << endl;
+
+                    if (best->time < 0 || candidate.time < best->time)
+                    {
+                        *best = candidate;
+                    }
+                }
+
+                clReleaseKernel(kernel);
+            }
+
+            clReleaseProgram(program);
+        }
+    }
+
+    if (best->time < 0)
+    {
+        cerr << "No matrix multiply variant fits " << M << "x" << N << "x" << K << ". " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool tuneMatrixMultiply(cl_context context, cl_device_id device, const string& kernelsFile,
+                        const string& cacheFile, size_t M, size_t N, size_t K, GemmConfig* config)
+{
+    string key;
+
+    if (!deviceKey(device, &key))
+    {
+        return false;
+    }
+
+    if (loadConfig(cacheFile, key, M, N, K, config))
+    {
+        return true;
+    }
+
+    /* Profiling has to be enabled on the queue, so tuning gets a queue of its own */
+    cl_int errorNumber;
+    cl_command_queue commandQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &errorNumber);
+
+    if (!checkSuccess(errorNumber))
+    {
+        cerr << "Failed to create the profiling command queue. " << __FILE__ << ":"<< __LINE__ << endl;
+        return false;
+    }
+
+    vector<float> A(M * K), B(K * N), BT(N * K), reference(M * N, 0.0f);
+
+    for (size_t i = 0; i < A.size(); i++)
+    {
+        A[i] = rand() / (float)RAND_MAX;
+    }
+
+    for (size_t i = 0; i < B.size(); i++)
+    {
+        B[i] = rand() / (float)RAND_MAX;
+    }
+
+    /* Packing is paid once per weight matrix, so it stays out of the timings */
+    for (size_t col = 0; col < N; col++)
+    {
+        for (size_t k = 0; k < K; k++)
+        {
+            BT[k * N + col] = B[col * K + k];
+        }
+    }
+
+    /* Column major, like every kernel in multiply.cl */
+    for (size_t col = 0; col < N; col++)
+    {
+        for (size_t k = 0; k < K; k++)
+        {
+            for (size_t row = 0; row < M; row++)
+            {
+                reference[col * M + row] += A[k * M + row] * B[col * K + k];
+            }
+        }
+    }
+
+    cl_mem memoryObjects[4] = {0, 0, 0, 0};
+    bool createMemoryObjectsSuccess = true;
+
+    memoryObjects[0] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, A.size() * sizeof(float), &A[0], &errorNumber);
+    createMemoryObjectsSuccess &= checkSuccess(errorNumber);
+
+    memoryObjects[1] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, B.size() * sizeof(float), &B[0], &errorNumber);
+    createMemoryObjectsSuccess &= checkSuccess(errorNumber);
+
+    memoryObjects[2] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, reference.size() * sizeof(float), NULL, &errorNumber);
+    createMemoryObjectsSuccess &= checkSuccess(errorNumber);
+
+    memoryObjects[3] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, BT.size() * sizeof(float), &BT[0], &errorNumber);
+    createMemoryObjectsSuccess &= checkSuccess(errorNumber);
+
+    bool tuneSuccess = createMemoryObjectsSuccess
+        && sweep(context, device, commandQueue, kernelsFile, M, N, K, memoryObjects, reference, config);
+
+    if (!createMemoryObjectsSuccess)
+    {
+        cerr << "Failed to create OpenCL buffer. " << __FILE__ << ":"<< __LINE__ << endl;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (memoryObjects[i] != 0)
+        {
+            clReleaseMemObject(memoryObjects[i]);
+        }
+    }
+
+    clReleaseCommandQueue(commandQueue);
+
+    return tuneSuccess && saveConfig(cacheFile, key, M, N, K, *config);
+}
@@ -0,0 +1,36 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <CL/cl.h>
+#include <string>
+
+/* One matrix multiply kernel of multiply.cl together with the build options and launch shape it was timed with */
+struct GemmConfig
+{
+    std::string kernelName;
+    int tileSize;           /* -DTS */
+    int workPerThread;      /* -DWPT */
+    size_t local[2];
+    double time;            /* best kernel time in microseconds */
+};
+
+/*
+    Looks (M, N, K) up in cacheFile under the device name and driver version. On a miss every
+    variant x TS x WPT x local size that fits the device is built, checked against a CPU result
+    and timed with profiling events, and the fastest one is appended to cacheFile, so later runs
+    start with it right away. Delete the file to tune again, e.g. after changing multiply.cl.
+*/
+bool tuneMatrixMultiply(cl_context context, cl_device_id device, const std::string& kernelsFile,
+                        const std::string& cacheFile, size_t M, size_t N, size_t K, GemmConfig* config);
+
+/* Builds the program with the options of config and creates its kernel */
+bool createMatrixMultiply(cl_context context, cl_device_id device, const std::string& kernelsFile,
+                          const GemmConfig& config, cl_program* program, cl_kernel* kernel);
+
+/* matrix_multiply_vector takes B transposed (N x K), see matrix_transpose in multiply.cl */
+bool matrixMultiplyTransposesB(const GemmConfig& config);
+/* TS x TS/WPT, except TS/WPT x TS/WPT for the register blocks of matrix_multiply_blocked */
+void matrixMultiplyLocalSize(const std::string& kernelName, int tileSize, int workPerThread, size_t* local);
+void matrixMultiplyGlobalSize(const GemmConfig& config, size_t M, size_t N, size_t* global);
+
+#endif